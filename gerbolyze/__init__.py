@@ -58,13 +58,14 @@ def paste(input_gerbers, input_svg, output_gerbers, is_zip,
     def do_dilate(layer, amount):
         return dilate_gerber(layer, bounds, amount, curve_tolerance)
     
+    overlays = svg_to_gerbers(input_svg,
+            [(f'g-{side}-{use}', use == 'outline') for side, use in stack.graphic_layers],
+            trace_space=trace_space, vectorizer=vectorizer, vectorizer_map=vectorizer_map,
+            exclude_groups=exclude_groups, curve_tolerance=curve_tolerance,
+            preserve_aspect_ratio=preserve_aspect_ratio)
+
     for (side, use), layer in stack.graphic_layers.items():
-        overlay_grb = svg_to_gerber(input_svg,
-                trace_space=trace_space, vectorizer=vectorizer, vectorizer_map=vectorizer_map,
-                exclude_groups=exclude_groups, curve_tolerance=curve_tolerance,
-                preserve_aspect_ratio=preserve_aspect_ratio,
-                outline_mode=(use == 'outline'),
-                only_groups=f'g-{side}-{use}')
+        overlay_grb = overlays[f'g-{side}-{use}']
 
         if not overlay_grb:
             print(f'Overlay {side} {use} layer is empty. Skipping.')
@@ -229,6 +230,7 @@ def convert(input_svg, output_gerbers, is_zip, dilate, curve_tolerance, no_subtr
 
     stack = gn.LayerStack({}, [], board_name=input_svg.stem, original_path=input_svg)
 
+    layers = []
     for group_id, label in get_layers_from_svg(input_svg.read_text()):
         if not group_id or not label or 'no export' in label:
             continue
@@ -242,13 +244,18 @@ def convert(input_svg, output_gerbers, is_zip, dilate, curve_tolerance, no_subtr
             continue
         else:
             side, use = label.split()
-
-        grb = svg_to_gerber(input_svg,
-                trace_space=trace_space, vectorizer=vectorizer, vectorizer_map=vectorizer_map,
-                exclude_groups=exclude_groups, curve_tolerance=curve_tolerance, only_groups=group_id,
-                pattern_complete_tiles_only=pattern_complete_tiles_only,
-                use_apertures_for_patterns=(use_apertures_for_patterns and use not in ('outline', 'drill')),
-                outline_mode=(use == 'outline' or use == 'drill'))
+        layers.append((group_id, side, use))
+
+    # svg-flatten does not use apertures for patterns on outline mode (outline and drill) layers.
+    grbs = svg_to_gerbers(input_svg,
+            [(group_id, use in ('outline', 'drill')) for group_id, _side, use in layers],
+            trace_space=trace_space, vectorizer=vectorizer, vectorizer_map=vectorizer_map,
+            exclude_groups=exclude_groups, curve_tolerance=curve_tolerance,
+            pattern_complete_tiles_only=pattern_complete_tiles_only,
+            use_apertures_for_patterns=use_apertures_for_patterns)
+
+    for group_id, side, use in layers:
+        grb = grbs[group_id]
         grb.original_path = Path()
 
         if use == 'drill':
@@ -500,67 +507,114 @@ def dilate_gerber(layer, bounds, dilation, curve_tolerance):
         # dilate & render back to gerber
         # NOTE: Maybe reconsider or nicely document dilation semantics ; It is weird that negative dilations affect
         # clear color and positive affects dark colors
-        out = svg_to_gerber(temp_svg.name, dilate=-dilation, curve_tolerance=curve_tolerance)
+        out = svg_to_gerber(temp_svg.name, dilate=-dilation, dilate_merge=True, curve_tolerance=curve_tolerance)
         return out
 
+def svg_flatten_args(**kwargs):
+    args = []
+    for k, v in kwargs.items():
+        if v:
+            args.append('--' + k.replace('_', '-'))
+            if not isinstance(v, bool):
+                args.append(str(v))
+    return args
+
+def run_svg_flatten(args, native_only=False):
+    """ Run svg-flatten with the given arguments. The last two arguments must be the input and output file.
+
+    :param native_only: Do not fall back to the WASI build. Its wrapper only maps the input and output file paths into
+                        the sandbox, so it cannot write any other output files given in ``args``.
+    """
+    print(' '.join(args))
+
+    if 'SVG_FLATTEN' in os.environ:
+        subprocess.run([os.environ['SVG_FLATTEN'], *args], check=True)
+        print('used svg-flatten at $SVG_FLATTEN')
+
+    else:
+        # By default, try four options:
+        for candidate in [
+                # somewhere in $PATH
+                'svg-flatten',
+                None, # direct WASI import
+                'wasi-svg-flatten',
+
+                # in user-local pip installation
+                Path.home() / '.local' / 'bin' / 'svg-flatten',
+                Path.home() / '.local' / 'bin' / 'wasi-svg-flatten',
+
+                # next to our current python interpreter (e.g. in virtualenv)
+                str(Path(sys.executable).parent / 'svg-flatten'),
+                str(Path(sys.executable).parent / 'wasi-svg-flatten'),
+
+                # next to this python source file in the development repo
+                str(Path(__file__).parent.parent / 'svg-flatten' / 'build' / 'svg-flatten') ]:
+
+            if native_only and (candidate is None or Path(candidate).name.startswith('wasi-')):
+                continue
+
+            try:
+                if candidate is None:
+                    import svg_flatten_wasi
+                    svg_flatten_wasi.run_svg_flatten.callback(args[-2], args[-1], args[:-2], no_usvg=False)
+                    print('used svg_flatten_wasi python package') 
+
+                else:
+                    subprocess.run([candidate, *args], check=True)
+                    print('used svg-flatten at', candidate)
+
+                break
+            except (FileNotFoundError, ModuleNotFoundError):
+                continue
+
+        else:
+            raise SystemError('svg-flatten executable not found')
+
 def svg_to_gerber(infile, outline_mode=False, **kwargs):
     infile = Path(infile)
 
     args = [ '--format', ('gerber-outline' if outline_mode else 'gerber'),
             '--precision', '6', # intermediate file, use higher than necessary precision
             ]
-    
-    for k, v in kwargs.items():
-        if v:
-            args.append('--' + k.replace('_', '-'))
-            if not isinstance(v, bool):
-                args.append(str(v))
+    args += svg_flatten_args(**kwargs)
 
     with tempfile.NamedTemporaryFile(suffix='.gbr') as temp_gbr:
         args += [str(infile), str(temp_gbr.name)]
-        print(' '.join(args))
+        run_svg_flatten(args)
+        return gn.rs274x.GerberFile.open(temp_gbr.name)
 
-        if 'SVG_FLATTEN' in os.environ:
-            subprocess.run([os.environ['SVG_FLATTEN'], *args], check=True)
-            print('used svg-flatten at $SVG_FLATTEN')
+def svg_to_gerbers(infile, layers, **kwargs):
+    """ Render several top-level groups of the given SVG into separate gerber files using a single svg-flatten run, so
+    that the SVG only has to be parsed and preprocessed once.
 
-        else:
-            # By default, try four options:
-            for candidate in [
-                    # somewhere in $PATH
-                    'svg-flatten',
-                    None, # direct WASI import
-                    'wasi-svg-flatten',
-
-                    # in user-local pip installation
-                    Path.home() / '.local' / 'bin' / 'svg-flatten',
-                    Path.home() / '.local' / 'bin' / 'wasi-svg-flatten',
-
-                    # next to our current python interpreter (e.g. in virtualenv)
-                    str(Path(sys.executable).parent / 'svg-flatten'),
-                    str(Path(sys.executable).parent / 'wasi-svg-flatten'),
-
-                    # next to this python source file in the development repo
-                    str(Path(__file__).parent.parent / 'svg-flatten' / 'build' / 'svg-flatten') ]:
-
-                try:
-                    if candidate is None:
-                        import svg_flatten_wasi
-                        svg_flatten_wasi.run_svg_flatten.callback(args[-2], args[-1], args[:-2], no_usvg=False)
-                        print('used svg_flatten_wasi python package') 
-
-                    else:
-                        subprocess.run([candidate, *args], check=True)
-                        print('used svg-flatten at', candidate)
-
-                    break
-                except (FileNotFoundError, ModuleNotFoundError):
-                    continue
+    :param layers: list of ``(group_id, outline_mode)`` tuples
+    :returns: dict mapping each group id to its :py:class:`gerbonara.rs274x.GerberFile`
+    """
+    infile = Path(infile)
+    if not layers:
+        return {}
 
-            else:
-                raise SystemError('svg-flatten executable not found')
+    args = [ '--format', 'gerber',
+            '--precision', '6', # intermediate file, use higher than necessary precision
+            ]
+    args += svg_flatten_args(**kwargs)
 
-        return gn.rs274x.GerberFile.open(temp_gbr.name)
+    with tempfile.TemporaryDirectory() as tmpdir:
+        files = {}
+        mapping = []
+        for i, (group_id, outline_mode) in enumerate(layers):
+            files[group_id] = Path(tmpdir) / f'layer{i}.gbr'
+            mapping.append(f'{group_id}={files[group_id]}' + (':gerber-outline' if outline_mode else ''))
+
+        # The output file argument is ignored with --output-layers.
+        args += ['--output-layers', ','.join(mapping), str(infile), os.devnull]
+        try:
+            run_svg_flatten(args, native_only=True)
+        except SystemError:
+            # Only the WASI build is available. Render one layer per run instead.
+            return {group_id: svg_to_gerber(infile, outline_mode=outline_mode, only_groups=group_id, **kwargs)
+                    for group_id, outline_mode in layers}
+        return {group_id: gn.rs274x.GerberFile.open(fn) for group_id, fn in files.items()}
 
 def get_layers_from_svg(svg_data):
     svg = etree.fromstring(svg_data.encode('utf-8'))
@@ -23,5 +23,34 @@ namespace gerbolyze {
             double m_angle_tolerance;
             std::vector<d2p> m_points;
     };
+
+    /* Flattens cubic bezier curves straight into a clipper path in clipper's fixed-point units. One of these is meant to
+     * be reused for all curves of a path, and it never allocates anything itself.
+     *
+     * By default, this subdivides the curve adaptively exactly like curve4_div, but without recursion. With fast set, it
+     * instead calculates the number of segments up front using Wang's formula and then evaluates the curve at evenly
+     * spaced points by forward differencing. This does a lot less work per point. Wang's formula is a strict bound, so
+     * the result stays within the tolerance, but the points end up in different places than with subdivision.
+     */
+    class CurveFlattener {
+        public:
+            CurveFlattener(double distance_tolerance=0.1, bool fast=false)
+                : m_distance_tolerance(distance_tolerance),
+                m_distance_tolerance_square(0.25*distance_tolerance*distance_tolerance),
+                m_fast(fast)
+                {
+                }
+
+            /* Appends the curve's points to out, except for the start point p1 which the caller already has. */
+            void run(const d2p &p1, const d2p &p2, const d2p &p3, const d2p &p4, ClipperLib::Path &out);
+
+        private:
+            void subdivide(const d2p &p1, const d2p &p2, const d2p &p3, const d2p &p4, ClipperLib::Path &out);
+            void forward_difference(const d2p &p1, const d2p &p2, const d2p &p3, const d2p &p4, ClipperLib::Path &out);
+
+            double m_distance_tolerance;
+            double m_distance_tolerance_square;
+            bool m_fast;
+    };
 }
 
@@ -23,11 +23,13 @@
 #include <sstream>
 #include <iomanip>
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 
 #include <clipper.hpp>
 
 #include "svg_import_defs.h"
+#include "scan_util.h"
 
 using namespace std;
 
@@ -39,38 +41,137 @@ namespace gerbolyze {
     typedef std::array<int64_t, 2> i2p;
     typedef std::vector<i2p> Polygon_i;
 
+    /* Non-owning view of a polygon's points, which are either double mm or clipper's fixed-point integers. Points are
+     * converted, scaled and translated on access, so a polygon can go through the sink chain down to the output that serializes it
+     * without being copied at every stage. The points must outlive the view. */
+    class PolygonView {
+        public:
+            class const_iterator {
+                public:
+                    const_iterator(const PolygonView &view, size_t i) : m_view(view), m_i(i) {}
+                    d2p operator*() const { return m_view[m_i]; }
+                    const_iterator &operator++() { m_i++; return *this; }
+                    bool operator==(const const_iterator &other) const { return m_i == other.m_i; }
+                    bool operator!=(const const_iterator &other) const { return m_i != other.m_i; }
+
+                private:
+                    const PolygonView &m_view;
+                    size_t m_i;
+            };
+
+            PolygonView(const Polygon &poly) : m_points_d(poly.data()), m_size(poly.size()) {}
+            PolygonView(const ClipperLib::Path &path) : m_points_i(path.data()), m_size(path.size()) {}
+
+            /* Number of points, including the repeated first point of a closed() view */
+            size_t size() const { return (m_closed && m_size > 0) ? m_size+1 : m_size; }
+            bool empty() const { return m_size == 0; }
+
+            d2p operator[](size_t i) const {
+                if (i == m_size) {
+                    i = 0;
+                }
+
+                if (m_points_d) {
+                    return {m_points_d[i][0] * m_scale + m_offset[0], m_points_d[i][1] * m_scale + m_offset[1]};
+                } else {
+                    return {(double)m_points_i[i].X / clipper_scale * m_scale + m_offset[0],
+                        (double)m_points_i[i].Y / clipper_scale * m_scale + m_offset[1]};
+                }
+            }
+
+            const_iterator begin() const { return const_iterator(*this, 0); }
+            const_iterator end() const { return const_iterator(*this, size()); }
+
+            /* Same points, multiplied by scale */
+            PolygonView scaled(double scale) const {
+                PolygonView out(*this);
+                out.m_scale *= scale;
+                out.m_offset = {m_offset[0] * scale, m_offset[1] * scale};
+                return out;
+            }
+
+            /* Same points, moved by offset */
+            PolygonView translated(d2p offset) const {
+                PolygonView out(*this);
+                out.m_offset = {m_offset[0] + offset[0], m_offset[1] + offset[1]};
+                return out;
+            }
+
+            /* Same points, with the first one repeated at the end. Used for outline output. */
+            PolygonView closed() const {
+                PolygonView out(*this);
+                out.m_closed = true;
+                return out;
+            }
+
+            Polygon to_polygon() const {
+                Polygon out;
+                out.reserve(size());
+                for (size_t i=0; i<size(); i++) {
+                    out.push_back((*this)[i]);
+                }
+                return out;
+            }
+
+        private:
+            const d2p *m_points_d = nullptr;
+            const ClipperLib::IntPoint *m_points_i = nullptr;
+            size_t m_size;
+            double m_scale = 1.0;
+            d2p m_offset {0, 0};
+            bool m_closed = false;
+    };
+
     class xform2d {
         public:
+            /* What kind of matrix this is, so we can skip work for the common cases. Most elements in usvg's output
+             * have no transform at all, and most of the rest are plain translations. */
+            enum Kind {
+                XF_IDENTITY,
+                XF_TRANSLATE,
+                XF_SCALE_TRANSLATE,
+                XF_GENERAL
+            };
+
             xform2d(double xx, double yx, double xy, double yy, double x0=0.0, double y0=0.0) :
-                xx(xx), yx(yx), xy(xy), yy(yy), x0(x0), y0(y0) {}
+                xx(xx), yx(yx), xy(xy), yy(yy), x0(x0), y0(y0) {
+                classify();
+            }
             
             xform2d() : xform2d(1.0, 0.0, 0.0, 1.0) {}
 
-            xform2d(const string &svg_transform) : xform2d() {
-                if (svg_transform.empty())
+            /* usvg normalizes all transforms to a single matrix(a b c d e f). Anything else results in an identity
+             * transform. This gets called for every element in the document, so it parses the attribute value in place
+             * without copying it around. */
+            xform2d(const char *svg_transform) : xform2d() {
+                static const char start[] = "matrix(";
+                if (strncmp(svg_transform, start, sizeof(start) - 1))
                     return;
 
-                string start("matrix(");
-                if (svg_transform.substr(0, start.length()) != start)
+                const char *p = svg_transform + sizeof(start) - 1;
+                const char *end = p + strlen(p);
+                if (end == p || end[-1] != ')')
                     return;
-                if (svg_transform.back() != ')')
-                    return;
-
-                const string &foo = svg_transform.substr(start.length(), svg_transform.length());
-                const string &bar = foo.substr(0, foo.length() - 1);
-
-                istringstream xform(bar);
+                end--;
 
-                double a, c, e,
-                       b, d, f;
-                xform >> a >> b >> c >> d >> e >> f;
-                if (xform.fail())
-                    return;
+                double v[6];
+                for (auto &e : v) {
+                    p = scan_skip_sep(p, end);
+                    if (!scan_double(p, end, e))
+                        return;
+                }
 
-                xx=a, yx=b, xy=c, yy=d, x0=e, y0=f;
+                xx=v[0], yx=v[1], xy=v[2], yy=v[3], x0=v[4], y0=v[5];
+                classify();
                 //cerr << "xform loaded " << dbg_str() << endl;
             }
 
+            xform2d(const string &svg_transform) : xform2d(svg_transform.c_str()) {}
+
+            Kind kind() const { return m_kind; }
+            std::array<double, 6> coefficients() const { return {xx, yx, xy, yy, x0, y0}; }
+            bool is_identity() const { return m_kind == XF_IDENTITY; }
+
             xform2d &translate(double x, double y) {
                 xform2d xf(1, 0, 0, 1, x, y);
                 transform(xf);
@@ -84,6 +185,9 @@ namespace gerbolyze {
             }
 
             xform2d &transform(const xform2d &other) {
+                if (other.m_kind == XF_IDENTITY)
+                    return *this;
+
                 double n_xx = other.xx * xx + other.yx * xy;
                 double n_yx = other.xx * yx + other.yx * yy;
 
@@ -100,6 +204,7 @@ namespace gerbolyze {
                 x0 = n_x0;
                 y0 = n_y0;
 
+                classify();
                 return *this;
             };
 
@@ -142,27 +247,114 @@ namespace gerbolyze {
 
             /* Transform given clipper paths */
             void transform_paths(ClipperLib::Paths &paths) {
+                if (m_kind == XF_IDENTITY)
+                    return;
+
                 for (auto &p : paths) {
                     transform_clipper_path(p);
                 }
             }
 
+            /* The batch transforms below each pick the cheapest kernel for this matrix once per path instead of once
+             * per point. The loops are kept simple enough for the compiler to vectorize. Clipper paths are transformed
+             * directly in clipper's fixed-point units instead of round-tripping every point through document units. */
             void transform_clipper_path(ClipperLib::Path &path) {
-                std::transform(path.begin(), path.end(), path.begin(),
-                        [this](ClipperLib::IntPoint p) -> ClipperLib::IntPoint {
-                            d2p out(this->doc2phys(d2p{p.X / clipper_scale, p.Y / clipper_scale}));
-                            return {
-                                (ClipperLib::cInt)round(out[0] * clipper_scale),
-                                (ClipperLib::cInt)round(out[1] * clipper_scale)
-                            };
-                        });
+                ClipperLib::IntPoint *pts = path.data();
+                size_t n = path.size();
+
+                switch (m_kind) {
+                    case XF_IDENTITY:
+                        return;
+
+                    case XF_TRANSLATE: {
+                        ClipperLib::cInt dx = round(x0 * clipper_scale), dy = round(y0 * clipper_scale);
+                        for (size_t i=0; i<n; i++) {
+                            pts[i].X += dx;
+                            pts[i].Y += dy;
+                        }
+                        return;
+                    }
+
+                    case XF_SCALE_TRANSLATE: {
+                        double dx = x0 * clipper_scale, dy = y0 * clipper_scale;
+                        for (size_t i=0; i<n; i++) {
+                            pts[i].X = (ClipperLib::cInt)round(xx * pts[i].X + dx);
+                            pts[i].Y = (ClipperLib::cInt)round(yy * pts[i].Y + dy);
+                        }
+                        return;
+                    }
+
+                    case XF_GENERAL: {
+                        double dx = x0 * clipper_scale, dy = y0 * clipper_scale;
+                        for (size_t i=0; i<n; i++) {
+                            double x = pts[i].X, y = pts[i].Y;
+                            pts[i].X = (ClipperLib::cInt)round(xx * x + xy * y + dx);
+                            pts[i].Y = (ClipperLib::cInt)round(yx * x + yy * y + dy);
+                        }
+                        return;
+                    }
+                }
             }
 
             void transform_polygon(Polygon &poly) {
-                std::transform(poly.begin(), poly.end(), poly.begin(),
-                        [this](d2p p) -> d2p {
-                            return this->doc2phys(d2p{p[0], p[1]});
-                        });
+                d2p *pts = poly.data();
+                size_t n = poly.size();
+
+                switch (m_kind) {
+                    case XF_IDENTITY:
+                        return;
+
+                    case XF_TRANSLATE:
+                        for (size_t i=0; i<n; i++) {
+                            pts[i][0] += x0;
+                            pts[i][1] += y0;
+                        }
+                        return;
+
+                    case XF_SCALE_TRANSLATE:
+                        for (size_t i=0; i<n; i++) {
+                            pts[i][0] = xx * pts[i][0] + x0;
+                            pts[i][1] = yy * pts[i][1] + y0;
+                        }
+                        return;
+
+                    case XF_GENERAL:
+                        for (size_t i=0; i<n; i++) {
+                            double x = pts[i][0], y = pts[i][1];
+                            pts[i][0] = xx * x + xy * y + x0;
+                            pts[i][1] = yx * x + yy * y + y0;
+                        }
+                        return;
+                }
+            }
+
+            /* Transform an integer polygon (e.g. a traced raster image contour) given in document units into a clipper
+             * path in physical units. */
+            void transform_polygon(const Polygon_i &poly, ClipperLib::Path &out) {
+                const i2p *pts = poly.data();
+                size_t n = poly.size();
+                out.resize(n);
+                ClipperLib::IntPoint *opts = out.data();
+
+                double dx = x0 * clipper_scale, dy = y0 * clipper_scale;
+                if (m_kind == XF_GENERAL) {
+                    double sxx = xx * clipper_scale, sxy = xy * clipper_scale,
+                           syx = yx * clipper_scale, syy = yy * clipper_scale;
+                    for (size_t i=0; i<n; i++) {
+                        double x = pts[i][0], y = pts[i][1];
+                        opts[i].X = (ClipperLib::cInt)round(sxx * x + sxy * y + dx);
+                        opts[i].Y = (ClipperLib::cInt)round(syx * x + syy * y + dy);
+                    }
+
+                } else {
+                    /* The identity and translation cases can't take any shortcut here since we have to scale to
+                     * clipper units anyway. */
+                    double sxx = xx * clipper_scale, syy = yy * clipper_scale;
+                    for (size_t i=0; i<n; i++) {
+                        opts[i].X = (ClipperLib::cInt)round(sxx * pts[i][0] + dx);
+                        opts[i].Y = (ClipperLib::cInt)round(syy * pts[i][1] + dy);
+                    }
+                }
             }
 
             string dbg_str() {
@@ -175,8 +367,21 @@ namespace gerbolyze {
             }
 
         private:
+            void classify() {
+                if (xy == 0.0 && yx == 0.0) {
+                    if (xx == 1.0 && yy == 1.0) {
+                        m_kind = (x0 == 0.0 && y0 == 0.0) ? XF_IDENTITY : XF_TRANSLATE;
+                    } else {
+                        m_kind = XF_SCALE_TRANSLATE;
+                    }
+                } else {
+                    m_kind = XF_GENERAL;
+                }
+            }
+
             double xx, yx,
                    xy, yy,
                    x0, y0;
+            Kind m_kind;
     };
 }
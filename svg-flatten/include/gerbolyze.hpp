@@ -19,9 +19,16 @@
 #pragma once
 
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <string>
 #include <array>
+#include <tuple>
+#include <memory>
+#ifndef WASI
+#include <mutex>
+#endif
 
 #include <pugixml.hpp>
 
@@ -64,31 +71,41 @@ namespace gerbolyze {
         d2p m_offset;
     };
 
+    /* Promise that everything that follows until the end of the current layer lies within this box. Only sent to
+     * sinks that ask for it through wants_lookahead(). */
+    class LookaheadToken {
+    public:
+        LookaheadToken(d2p min, d2p max) : m_min(min), m_max(max) {}
+        d2p m_min, m_max;
+    };
+
     class PolygonSink {
         public:
             virtual ~PolygonSink() {}
             virtual void header(d2p origin, d2p size) {(void) origin; (void) size;}
             virtual bool can_do_apertures() { return false; }
+            virtual bool wants_lookahead() { return false; }
             virtual PolygonSink &operator<<(const Polygon &poly) = 0;
-            virtual PolygonSink &operator<<(const ClipperLib::Paths paths) {
+            /* Sinks that only look at the points once, like the output formats, override this to serialize straight
+             * from the view. Sinks that need to hold on to the polygon get a copy through operator<<(const Polygon &).
+             */
+            virtual PolygonSink &operator<<(const PolygonView &poly) {
+                return *this << poly.to_polygon();
+            };
+            virtual PolygonSink &operator<<(const ClipperLib::Paths &paths) {
                 for (const auto &poly : paths) {
                     *this << poly;
                 }
                 return *this;
             };
-            virtual PolygonSink &operator<<(const ClipperLib::Path poly) {
-                vector<array<double, 2>> out;
-                for (const auto &p : poly) {
-                    out.push_back(std::array<double, 2>{
-                            ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                    });
-                }
-                return *this << out;
+            virtual PolygonSink &operator<<(const ClipperLib::Path &poly) {
+                return *this << PolygonView(poly);
             };
             virtual PolygonSink &operator<<(const LayerNameToken &) { return *this; };
             virtual PolygonSink &operator<<(GerberPolarityToken pol) = 0;
             virtual PolygonSink &operator<<(const ApertureToken &) { return *this; };
             virtual PolygonSink &operator<<(const FlashToken &) { return *this; };
+            virtual PolygonSink &operator<<(const LookaheadToken &) { return *this; };
             virtual PolygonSink &operator<<(const PatternToken &) {
                 cerr << "Error: pattern to aperture mapping is not supporte for this output." << endl;
                 return *this;
@@ -97,41 +114,93 @@ namespace gerbolyze {
     };
 
     class Flattener_D;
+    class MappedFile;
     class Flattener : public PolygonSink {
         public:
-            Flattener(PolygonSink &sink);
+            /* tiled -> use LookaheadTokens to write out dark polygons as soon as no clear polygon can reach them anymore,
+             * instead of keeping all of them until the end of the layer. */
+            Flattener(PolygonSink &sink, bool tiled=false);
             virtual ~Flattener();
             virtual void header(d2p origin, d2p size);
+            virtual bool wants_lookahead() { return m_tiled; }
             virtual Flattener &operator<<(const Polygon &poly);
+            virtual Flattener &operator<<(const PolygonView &poly);
             virtual Flattener &operator<<(const LayerNameToken &layer_name);
             virtual Flattener &operator<<(GerberPolarityToken pol);
             virtual Flattener &operator<<(const ApertureToken &tok);
             virtual Flattener &operator<<(const FlashToken &tok);
+            virtual Flattener &operator<<(const LookaheadToken &tok);
             virtual void footer();
 
         private:
             void render_out_clear_polys();
             void flush_polys_to_sink();
             PolygonSink &m_sink;
+            bool m_tiled;
             GerberPolarityToken m_current_polarity = GRB_POL_DARK;
             Flattener_D *d;
     };
 
+    /* Alternative to Flattener that resolves the whole polygon stream of a layer at once when it ends instead of
+     * subtracting each run of clear polygons as it comes. */
+    class SweepFlattener_D;
+    class SweepFlattener : public PolygonSink {
+        public:
+            SweepFlattener(PolygonSink &sink);
+            virtual ~SweepFlattener();
+            virtual void header(d2p origin, d2p size);
+            virtual SweepFlattener &operator<<(const Polygon &poly);
+            virtual SweepFlattener &operator<<(const PolygonView &poly);
+            virtual SweepFlattener &operator<<(const LayerNameToken &layer_name);
+            virtual SweepFlattener &operator<<(GerberPolarityToken pol);
+            virtual SweepFlattener &operator<<(const ApertureToken &tok);
+            virtual SweepFlattener &operator<<(const FlashToken &tok);
+            virtual void footer();
+
+        private:
+            void flush_polys_to_sink();
+            PolygonSink &m_sink;
+            GerberPolarityToken m_current_polarity = GRB_POL_DARK;
+            SweepFlattener_D *d;
+    };
+
     class Dilater : public PolygonSink {
         public:
-            Dilater(PolygonSink &sink, double dilation) : m_sink(sink), m_dilation(dilation) {}
+            /* merge -> collect each run of polygons of the same polarity and offset them together, so that overlapping
+             * polygons mostly come out as one. */
+            Dilater(PolygonSink &sink, double dilation, bool merge=false)
+                : m_sink(sink), m_dilation(dilation), m_merge(merge) {}
             virtual void header(d2p origin, d2p size);
+            virtual bool wants_lookahead() { return !m_merge && m_sink.wants_lookahead(); }
             virtual Dilater &operator<<(const Polygon &poly);
+            virtual Dilater &operator<<(const PolygonView &poly);
             virtual Dilater &operator<<(const LayerNameToken &layer_name);
             virtual Dilater &operator<<(GerberPolarityToken pol);
             virtual Dilater &operator<<(const ApertureToken &ap);
             virtual Dilater &operator<<(const FlashToken &tok);
+            virtual Dilater &operator<<(const LookaheadToken &tok);
             virtual void footer();
 
         private:
+            void dilate(const ClipperLib::Paths &paths, const ClipperLib::IntRect *clip=nullptr);
+            void flush_bucket(size_t i);
+            void flush();
+
             PolygonSink &m_sink;
             double m_dilation;
+            bool m_merge;
             GerberPolarityToken m_current_polarity = GRB_POL_DARK;
+            bool m_aperture_set = false;
+
+            /* Merge mode: Polygons collected since the last polarity change, bucketed by position on a coarse grid over
+             * the document. Each bucket is offset on its own. Buckets that hold polygons reaching past their cell are
+             * cut to the cell afterwards. */
+            std::vector<ClipperLib::Paths> m_buckets;
+            std::vector<size_t> m_bucket_points;
+            std::vector<bool> m_bucket_spills;
+            size_t m_num_points = 0;
+            d2p m_origin {0, 0};
+            d2p m_size {0, 0};
     };
 
     class PolygonScaler : public PolygonSink {
@@ -139,11 +208,14 @@ namespace gerbolyze {
             PolygonScaler(PolygonSink &sink, double scale=1.0) : m_sink(sink), m_scale(scale) {}
             virtual void header(d2p origin, d2p size);
             virtual bool can_do_apertures();
+            virtual bool wants_lookahead();
             virtual PolygonScaler &operator<<(const Polygon &poly);
+            virtual PolygonScaler &operator<<(const PolygonView &poly);
             virtual PolygonScaler &operator<<(const LayerNameToken &layer_name);
             virtual PolygonScaler &operator<<(GerberPolarityToken pol);
             virtual PolygonScaler &operator<<(const ApertureToken &tok);
             virtual PolygonScaler &operator<<(const FlashToken &tok);
+            virtual PolygonScaler &operator<<(const LookaheadToken &tok);
             virtual PolygonScaler &operator<<(const PatternToken &tok);
             virtual void footer();
 
@@ -171,25 +243,58 @@ namespace gerbolyze {
 
     class ElementSelector {
     public:
+        /* Called once at the start of every render with the document's root element, before any of the others. */
+        virtual void prepare(const pugi::xml_node &root) const {
+            (void) root;
+        }
+
         virtual bool match(const pugi::xml_node &node, bool is_toplevel, bool parent_include) const {
             (void) node, (void) is_toplevel, (void) parent_include;
             return true;
         }
+
+        /* Called for groups that did not match themselves. If this returns false, nothing inside the group can match
+         * either and the renderer skips it entirely. */
+        virtual bool descendants_may_match(const pugi::xml_node &node) const {
+            (void) node;
+            return true;
+        }
     };
 
     class IDElementSelector : public ElementSelector {
     public:
         virtual bool match(const pugi::xml_node &node, bool is_toplevel, bool parent_include) const;
+        virtual void prepare(const pugi::xml_node &root) const;
+        virtual bool descendants_may_match(const pugi::xml_node &node) const;
+
+        std::unordered_set<std::string> include;
+        std::unordered_set<std::string> exclude;
+        const std::unordered_set<std::string> *layers = nullptr;
+
+    private:
+        /* All ancestors of included elements, from prepare() */
+        mutable std::unordered_set<const void *> m_include_ancestors;
+        mutable bool m_prepared = false;
+    };
 
-        std::vector<std::string> include;
-        std::vector<std::string> exclude;
-        const std::vector<std::string> *layers = nullptr;
+    /* A bitmap image to be vectorized. It is placed at (x, y) and scaled to width x height document units according to
+     * preserve_aspect_ratio, just like an SVG <image> element. data points to the still-encoded PNG/JPG file
+     * contents. */
+    struct RasterImage {
+        const void *data = nullptr;
+        size_t size = 0;
+        double x = 0.0, y = 0.0;
+        double width = 0.0, height = 0.0;
+        std::string preserve_aspect_ratio;
+        std::string id;
     };
 
     class ImageVectorizer {
     public:
         virtual ~ImageVectorizer() {};
-        virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) = 0;
+        /* Decodes the image data from an SVG <image> element and calls vectorize_raster on it */
+        void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+        virtual void vectorize_raster(RenderContext &ctx, const RasterImage &img, double min_feature_size_px) = 0;
     };
     
     ImageVectorizer *makeVectorizer(const std::string &name);
@@ -199,6 +304,7 @@ namespace gerbolyze {
         VectorizerSelectorizer(const std::string default_vectorizer="dev-null", const std::string defs="");
 
         ImageVectorizer *select(const pugi::xml_node &img);
+        ImageVectorizer *select(const std::string &id);
 
     private:
         std::string m_default;
@@ -217,6 +323,18 @@ namespace gerbolyze {
         bool flip_color_interpretation = false;
         bool pattern_complete_tiles_only = false;
         bool use_apertures_for_patterns = false;
+        int jobs = 1; /* > 1 -> render independent elements on this many threads */
+        bool fast_curves = false; /* flatten curves with a fixed number of segments instead of adaptive subdivision */
+    };
+
+    class ParallelRenderer;
+
+    /* A clip path in document coordinates from SVGDocument's clip cache. These are never modified after creation, so
+     * their address identifies them. */
+    struct InternedClip {
+        ClipperLib::Paths paths;
+        ClipperLib::IntRect bounds;
+        bool is_rect = false; /* paths are a single axis-aligned rectangle */
     };
 
     class RenderContext {
@@ -224,16 +342,34 @@ namespace gerbolyze {
             RenderContext(const RenderSettings &settings,
                     PolygonSink &sink,
                     const ElementSelector &sel,
-                    ClipperLib::Paths &clip);
+                    const ClipperLib::Paths &clip,
+                    ParallelRenderer *parallel=nullptr);
+            RenderContext(const RenderSettings &settings,
+                    PolygonSink &sink,
+                    const ElementSelector &sel,
+                    const InternedClip &clip,
+                    ParallelRenderer *parallel=nullptr);
+            /* For rendering an element on its own, e.g. on a ParallelRenderer worker thread after its parent context
+             * is long gone. */
+            RenderContext(const RenderSettings &settings,
+                    PolygonSink &sink,
+                    const ElementSelector &sel,
+                    const ClipperLib::Paths &clip,
+                    const xform2d &mat,
+                    bool included);
             RenderContext(RenderContext &parent,
                     xform2d transform);
             RenderContext(RenderContext &parent,
                     xform2d transform,
-                    ClipperLib::Paths &clip,
+                    const ClipperLib::Paths &clip,
+                    bool included);
+            RenderContext(RenderContext &parent,
+                    xform2d transform,
+                    const InternedClip &clip,
                     bool included);
             RenderContext(RenderContext &parent,
                     PolygonSink &sink,
-                    ClipperLib::Paths &clip);
+                    const ClipperLib::Paths &clip);
 
             PolygonSink &sink() { return m_sink; }
             const ElementSelector &sel() { return m_sel; }
@@ -241,7 +377,19 @@ namespace gerbolyze {
             xform2d &mat() { return m_mat; }
             bool root() const { return m_root; }
             bool included() const { return m_included; }
-            ClipperLib::Paths &clip() { return m_clip; }
+            ParallelRenderer *parallel() { return m_parallel; }
+            const ClipperLib::Paths &clip() { return m_clip; }
+            ClipperLib::IntRect clip_bounds();
+            /* Bounds of our clip if it is a single axis-aligned rectangle, nullptr otherwise */
+            const ClipperLib::IntRect *clip_rect();
+            /* nullptr if our clip did not come out of the clip cache */
+            const InternedClip *interned_clip() { return m_interned_clip; }
+            /* Bounds of everything that is rendered after the current element until the end of its layer, or nullptr
+             * if we don't know or nobody is interested. Empty (left > right) if nothing follows. */
+            const ClipperLib::IntRect *lookahead() { return m_lookahead; }
+            void set_lookahead(const ClipperLib::IntRect *lookahead) { m_lookahead = lookahead; }
+            /* Send box as a LookaheadToken to our sink */
+            void send_lookahead(const ClipperLib::IntRect &box);
             void transform(xform2d &transform) {
                 m_mat.transform(transform);
             }
@@ -256,16 +404,25 @@ namespace gerbolyze {
             bool m_root;
             bool m_included; /* TODO: refactor name */
             const ElementSelector &m_sel;
-            ClipperLib::Paths &m_clip;
+            const ClipperLib::Paths &m_clip;
+            const InternedClip *m_interned_clip = nullptr;
+            ParallelRenderer *m_parallel;
+            const ClipperLib::IntRect *m_lookahead = nullptr;
+            bool m_clip_rect_checked = false;
+            bool m_clip_is_rect = false;
+            ClipperLib::IntRect m_clip_rect;
     };
 
     class SVGDocument {
         public:
-            SVGDocument() : _valid(false) {}
+            SVGDocument();
+            ~SVGDocument();
 
             /* true -> load successful */
             bool load(std::istream &in);
+            /* Maps the file instead of reading it into memory */
             bool load(std::string filename);
+            bool load_buffer(std::string &&buf);
             /* true -> load successful */
             bool valid() const { return _valid; }
             operator bool() const { return valid(); }
@@ -279,19 +436,30 @@ namespace gerbolyze {
             void render(const RenderSettings &rset, PolygonSink &sink, const ElementSelector &sel=ElementSelector());
             void render_to_list(const RenderSettings &rset, std::vector<std::pair<Polygon, GerberPolarityToken>> &out, const ElementSelector &sel=ElementSelector());
 
+            void print_clip_cache_stats(std::ostream &out) const;
+
         private:
             friend class Pattern;
 
             const ClipperLib::Paths *lookup_clip_path(const pugi::xml_node &node);
+            void load_group_clip(const pugi::xml_node &group, const ClipperLib::Paths &parent_clip,
+                    const ClipperLib::IntRect *parent_rect, xform2d &mat, ClipperLib::Paths &out);
+            const InternedClip *intern_clip(const pugi::xml_node &group, const InternedClip &parent, xform2d &mat);
             Pattern *lookup_pattern(const std::string id);
 
             void export_svg_group(RenderContext &ctx, const pugi::xml_node &group);
             void export_svg_path(RenderContext &ctx, const pugi::xml_node &node);
+            void export_svg_image(RenderContext &ctx, const pugi::xml_node &node);
+            ClipperLib::IntRect element_bounds(const pugi::xml_node &node, xform2d &mat);
+            bool parse_buffer(char *data, size_t size);
+            bool setup_document();
             void setup_viewport_clip();
             void load_clips(const RenderSettings &rset);
             void load_patterns();
 
             bool _valid;
+            std::string m_buffer; /* backing storage for in-place parsing */
+            std::unique_ptr<MappedFile> m_mapping; /* ...or this, when loading from a file */
             pugi::xml_document svg_doc;
             pugi::xml_node root_elem;
             pugi::xml_node defs_node;
@@ -300,13 +468,62 @@ namespace gerbolyze {
             double page_w_mm, page_h_mm;
             std::map<std::string, Pattern> pattern_map;
             std::map<std::string, ClipperLib::Paths> clip_path_map;
-            ClipperLib::Paths vb_paths; /* viewport clip rect */
+            bool clips_loaded = false;
+            double clips_curve_tolerance = 0.0;
+            bool clips_fast_curves = false;
+            InternedClip vb_clip; /* viewport clip rect */
+
+            /* Clip paths of groups, transformed into document coordinates and intersected with their parent's clip.
+             * usvg likes to wrap every single one of thousands of sibling elements in its own group with the same clip
+             * path, so this saves us a lot of clipper runs. Only ever used from the serial part of the document
+             * traversal: Render tasks on other threads never have an interned clip. */
+            struct ClipCacheKey {
+                std::string id;
+                const InternedClip *parent;
+                std::array<double, 6> mat;
+
+                bool operator<(const ClipCacheKey &o) const {
+                    return std::tie(id, parent, mat) < std::tie(o.id, o.parent, o.mat);
+                }
+            };
+            std::map<ClipCacheKey, InternedClip> clip_cache;
+            uint64_t clip_cache_hits = 0;
+            uint64_t clip_cache_misses = 0;
+
+            /* Bounding boxes of elements in physical coordinates for lookahead, by pugixml node and parent transform.
+             * Pattern tiles render the same nodes under many different transforms, so the node alone is not enough.
+             * Only filled when the sink wants lookahead, and cleared on every render. Pattern content may be rendered
+             * on ParallelRenderer threads, hence the mutex. */
+            struct ElementBoundsKey {
+                const void *node;
+                std::array<double, 6> mat;
+
+                bool operator==(const ElementBoundsKey &o) const {
+                    return node == o.node && mat == o.mat;
+                }
+            };
+            struct ElementBoundsKeyHash {
+                size_t operator()(const ElementBoundsKey &k) const {
+                    size_t h = std::hash<const void *>()(k.node);
+                    for (double c : k.mat) {
+                        h = h * 31 + std::hash<double>()(c);
+                    }
+                    return h;
+                }
+            };
+            std::unordered_map<ElementBoundsKey, ClipperLib::IntRect, ElementBoundsKeyHash> element_bounds_cache;
+#ifndef WASI
+            std::mutex element_bounds_mutex;
+#endif
 
             static constexpr double dbg_fill_alpha = 0.8;
             static constexpr double dbg_stroke_alpha = 1.0;
             static constexpr double assumed_usvg_dpi = 96.0;
     };
 
+    /* Vectorize a bitmap image on its own, without an SVG document around it. Document units are millimeters. */
+    void render_raster_image(const RenderSettings &rset, PolygonSink &sink, const RasterImage &img);
+
     typedef std::function<void (const Polygon &, GerberPolarityToken)> lambda_sink_fun;
     class LambdaPolygonSink : public PolygonSink {
     public:
@@ -324,6 +541,7 @@ namespace gerbolyze {
         SimpleGerberOutput(std::ostream &out, bool only_polys=false, int digits_int=4, int digits_frac=6, double scale=1.0, d2p offset={0,0}, bool flip_polarity=false);
         virtual ~SimpleGerberOutput() {}
         virtual SimpleGerberOutput &operator<<(const Polygon &poly);
+        virtual SimpleGerberOutput &operator<<(const PolygonView &poly);
         virtual SimpleGerberOutput &operator<<(GerberPolarityToken pol);
         virtual SimpleGerberOutput &operator<<(const ApertureToken &ap);
         virtual SimpleGerberOutput &operator<<(const FlashToken &tok);
@@ -352,6 +570,7 @@ namespace gerbolyze {
         SimpleSVGOutput(std::ostream &out, bool only_polys=false, int digits_frac=6, std::string dark_color="#000000", std::string clear_color="#ffffff");
         virtual ~SimpleSVGOutput() {}
         virtual SimpleSVGOutput &operator<<(const Polygon &poly);
+        virtual SimpleSVGOutput &operator<<(const PolygonView &poly);
         virtual SimpleSVGOutput &operator<<(GerberPolarityToken pol);
         virtual SimpleSVGOutput &operator<<(const FlashToken &tok);
         virtual void header_impl(d2p origin, d2p size);
@@ -370,6 +589,7 @@ namespace gerbolyze {
         KicadSexpOutput(std::ostream &out, std::string mod_name, std::string layer, bool only_polys=false, std::string m_ref_text="", std::string m_val_text="G*****", d2p ref_pos={0,10}, d2p val_pos={0,-10});
         virtual ~KicadSexpOutput() {}
         virtual KicadSexpOutput &operator<<(const Polygon &poly);
+        virtual KicadSexpOutput &operator<<(const PolygonView &poly);
         virtual KicadSexpOutput &operator<<(const LayerNameToken &layer_name);
         virtual KicadSexpOutput &operator<<(const FlashToken &tok);
         virtual KicadSexpOutput &operator<<(GerberPolarityToken pol);
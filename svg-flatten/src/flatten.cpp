@@ -228,3 +228,199 @@ void curve4_div::recursive_bezier(double x1, double y1,
     recursive_bezier(x1234, y1234, x234, y234, x34, y34, x4, y4, level + 1); 
 }
 
+
+static inline ClipperLib::IntPoint to_clipper(double x, double y) {
+    return {
+        (ClipperLib::cInt)round(x * clipper_scale),
+        (ClipperLib::cInt)round(y * clipper_scale)
+    };
+}
+
+void CurveFlattener::run(const d2p &p1, const d2p &p2, const d2p &p3, const d2p &p4, ClipperLib::Path &out) {
+    if (m_fast) {
+        forward_difference(p1, p2, p3, p4, out);
+    } else {
+        subdivide(p1, p2, p3, p4, out);
+    }
+    out.push_back(to_clipper(p4[0], p4[1]));
+}
+
+/* Same as curve4_div::recursive_bezier with angle tolerance and cusp limit disabled (which is how we always use it),
+ * but with an explicit stack. Since we always take the first half first, the stack holds at most one pending second
+ * half per recursion level. */
+void CurveFlattener::subdivide(const d2p &p1, const d2p &p2, const d2p &p3, const d2p &p4, ClipperLib::Path &out) {
+    struct Curve {
+        double x1, y1, x2, y2, x3, y3, x4, y4;
+        unsigned level;
+    };
+
+    Curve stack[curve_recursion_limit + 4];
+    size_t sp = 0;
+    stack[sp++] = {p1[0], p1[1], p2[0], p2[1], p3[0], p3[1], p4[0], p4[1], 0};
+
+    while (sp > 0) {
+        const Curve c = stack[--sp];
+        if (c.level > curve_recursion_limit) {
+            continue;
+        }
+
+        double x12   = (c.x1 + c.x2) / 2;
+        double y12   = (c.y1 + c.y2) / 2;
+        double x23   = (c.x2 + c.x3) / 2;
+        double y23   = (c.y2 + c.y3) / 2;
+        double x34   = (c.x3 + c.x4) / 2;
+        double y34   = (c.y3 + c.y4) / 2;
+        double x123  = (x12 + x23) / 2;
+        double y123  = (y12 + y23) / 2;
+        double x234  = (x23 + x34) / 2;
+        double y234  = (y23 + y34) / 2;
+        double x1234 = (x123 + x234) / 2;
+        double y1234 = (y123 + y234) / 2;
+
+        double dx = c.x4 - c.x1;
+        double dy = c.y4 - c.y1;
+
+        double d2 = fabs(((c.x2 - c.x4) * dy - (c.y2 - c.y4) * dx));
+        double d3 = fabs(((c.x3 - c.x4) * dy - (c.y3 - c.y4) * dx));
+
+        switch ((int(d2 > curve_collinearity_epsilon) << 1) + int(d3 > curve_collinearity_epsilon)) {
+        case 0: { /* All collinear OR p1==p4 */
+            double k = dx*dx + dy*dy;
+            if (k == 0) {
+                d2 = calc_sq_distance(c.x1, c.y1, c.x2, c.y2);
+                d3 = calc_sq_distance(c.x4, c.y4, c.x3, c.y3);
+
+            } else {
+                k = 1 / k;
+                d2 = k * ((c.x2 - c.x1)*dx + (c.y2 - c.y1)*dy);
+                d3 = k * ((c.x3 - c.x1)*dx + (c.y3 - c.y1)*dy);
+
+                if (d2 > 0 && d2 < 1 && d3 > 0 && d3 < 1) {
+                    /* Simple collinear case, 1---2---3---4. We can leave just two endpoints */
+                    continue;
+                }
+
+                if (d2 <= 0) {
+                    d2 = calc_sq_distance(c.x2, c.y2, c.x1, c.y1);
+                } else if (d2 >= 1) {
+                    d2 = calc_sq_distance(c.x2, c.y2, c.x4, c.y4);
+                } else {
+                    d2 = calc_sq_distance(c.x2, c.y2, c.x1 + d2*dx, c.y1 + d2*dy);
+                }
+
+                if (d3 <= 0) {
+                    d3 = calc_sq_distance(c.x3, c.y3, c.x1, c.y1);
+                } else if (d3 >= 1) {
+                    d3 = calc_sq_distance(c.x3, c.y3, c.x4, c.y4);
+                } else {
+                    d3 = calc_sq_distance(c.x3, c.y3, c.x1 + d3*dx, c.y1 + d3*dy);
+                }
+            }
+
+            if (d2 > d3) {
+                if (d2 < m_distance_tolerance_square) {
+                    out.push_back(to_clipper(c.x2, c.y2));
+                    continue;
+                }
+            } else {
+                if (d3 < m_distance_tolerance_square) {
+                    out.push_back(to_clipper(c.x3, c.y3));
+                    continue;
+                }
+            }
+            break;
+        }
+
+        case 1: /* p1,p2,p4 are collinear, p3 is significant */
+            if (d3 * d3 <= m_distance_tolerance_square * (dx*dx + dy*dy)) {
+                out.push_back(to_clipper(x23, y23));
+                continue;
+            }
+            break;
+
+        case 2: /* p1,p3,p4 are collinear, p2 is significant */
+            if (d2 * d2 <= m_distance_tolerance_square * (dx*dx + dy*dy)) {
+                out.push_back(to_clipper(x23, y23));
+                continue;
+            }
+            break;
+
+        case 3: /* Regular case */
+            if ((d2 + d3)*(d2 + d3) <= m_distance_tolerance_square * (dx*dx + dy*dy)) {
+                out.push_back(to_clipper(x23, y23));
+                continue;
+            }
+            break;
+        }
+
+        /* Continue subdivision. Push the second half first so we pop the first half next. */
+        stack[sp++] = {x1234, y1234, x234, y234, x34, y34, c.x4, c.y4, c.level + 1};
+        stack[sp++] = {c.x1, c.y1, x12, y12, x123, y123, x1234, y1234, c.level + 1};
+    }
+}
+
+/* Wang's formula gives us the number of evenly spaced segments n that keeps the polyline within tol of the curve:
+ *
+ *   n = ceil(sqrt(3*2/8 * max(|p1 - 2*p2 + p3|, |p2 - 2*p3 + p4|) / tol))
+ *
+ * We use half the distance tolerance here, which is roughly what the subdivision's flatness test allows.
+ *
+ * We then step along the curve by forward differencing. Since each step depends on the one before, we run several
+ * interleaved streams ("lanes") starting at consecutive points and each stepping over as many points as there are
+ * lanes. The lanes are independent, so the compiler can vectorize the inner loops.
+ */
+void CurveFlattener::forward_difference(const d2p &p1, const d2p &p2, const d2p &p3, const d2p &p4, ClipperLib::Path &out) {
+    constexpr size_t lanes = 4;
+    constexpr size_t max_segments = 1<<16;
+
+    double ddx = fmax(fabs(p1[0] - 2*p2[0] + p3[0]), fabs(p2[0] - 2*p3[0] + p4[0]));
+    double ddy = fmax(fabs(p1[1] - 2*p2[1] + p3[1]), fabs(p2[1] - 2*p3[1] + p4[1]));
+    double n_est = ceil(sqrt(0.75 * sqrt(ddx*ddx + ddy*ddy) / (0.5 * m_distance_tolerance)));
+    if (!(n_est >= 1)) { /* also catches NaN */
+        return;
+    }
+    size_t n = n_est > max_segments ? max_segments : (size_t)n_est;
+
+    /* Curve in polynomial form, B(t) = a*t^3 + b*t^2 + c*t + p1 */
+    double ax = -p1[0] + 3*p2[0] - 3*p3[0] + p4[0], ay = -p1[1] + 3*p2[1] - 3*p3[1] + p4[1];
+    double bx = 3*p1[0] - 6*p2[0] + 3*p3[0], by = 3*p1[1] - 6*p2[1] + 3*p3[1];
+    double cx = 3*(p2[0] - p1[0]), cy = 3*(p2[1] - p1[1]);
+
+    /* Each lane steps by s. Its third difference is constant and the same for all lanes. */
+    double h = 1.0 / n;
+    double s = lanes * h;
+    double d3x = 6*ax*s*s*s, d3y = 6*ay*s*s*s;
+
+    double fx[lanes], fy[lanes], d1x[lanes], d1y[lanes], d2x[lanes], d2y[lanes];
+    for (size_t j=0; j<lanes; j++) {
+        double t = (j+1) * h;
+        fx[j] = ((ax*t + bx)*t + cx)*t + p1[0];
+        fy[j] = ((ay*t + by)*t + cy)*t + p1[1];
+        d1x[j] = ax*(3*t*t*s + 3*t*s*s + s*s*s) + bx*(2*t*s + s*s) + cx*s;
+        d1y[j] = ay*(3*t*t*s + 3*t*s*s + s*s*s) + by*(2*t*s + s*s) + cy*s;
+        d2x[j] = 6*ax*s*s*(t + s) + 2*bx*s*s;
+        d2y[j] = 6*ay*s*s*(t + s) + 2*by*s*s;
+    }
+
+    /* Points 1 to n-1. The caller already has point 0, and run() adds point n exactly. */
+    size_t num_points = n - 1;
+    size_t base = out.size();
+    out.resize(base + num_points);
+    ClipperLib::IntPoint *dst = out.data() + base;
+
+    for (size_t i=0; i<num_points; i+=lanes) {
+        size_t batch = num_points - i < lanes ? num_points - i : lanes;
+        for (size_t j=0; j<batch; j++) {
+            dst[i+j] = to_clipper(fx[j], fy[j]);
+        }
+
+        for (size_t j=0; j<lanes; j++) {
+            fx[j] += d1x[j];
+            fy[j] += d1y[j];
+            d1x[j] += d2x[j];
+            d1y[j] += d2y[j];
+            d2x[j] += d3x;
+            d2y[j] += d3y;
+        }
+    }
+}
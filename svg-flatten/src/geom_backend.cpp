@@ -0,0 +1,293 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "geom_backend.h"
+#include "svg_geom.h"
+
+#ifdef HAVE_CLIPPER2
+#include <clipper2/clipper.h>
+#endif
+
+#ifndef DEFAULT_GEOMETRY_BACKEND
+#define DEFAULT_GEOMETRY_BACKEND "clipper1"
+#endif
+
+using namespace std;
+using namespace gerbolyze;
+
+ClipperLib::PolyNode *gerbolyze::GeomTree::add_child(ClipperLib::PolyNode &parent) {
+    auto *node = m_nodes.emplace_back(make_unique<ClipperLib::PolyNode>()).get();
+    node->Parent = &parent;
+    parent.Childs.push_back(node);
+    return node;
+}
+
+ClipperLib::IntRect gerbolyze::GeometryBackend::bounds(const ClipperLib::Paths &paths) const {
+    return get_paths_bounds(paths);
+}
+
+namespace {
+
+/* The bundled Clipper 6.4.2 */
+class Clipper1Backend : public GeometryBackend {
+public:
+    virtual const char *name() const { return "clipper1"; }
+
+    virtual void boolean_op(ClipperLib::ClipType op, const ClipperLib::Paths &subject, const ClipperLib::Paths &clip,
+            ClipperLib::Paths &out, ClipperLib::PolyFillType fill, const ClipperLib::Paths *open_subject) {
+        ClipperLib::Clipper c;
+        c.StrictlySimple(true);
+        c.AddPaths(subject, ClipperLib::ptSubject, /* closed */ true);
+        c.AddPaths(clip, ClipperLib::ptClip, /* closed */ true);
+
+        if (!open_subject || open_subject->empty()) {
+            c.Execute(op, out, fill, fill);
+            return;
+        }
+
+        /* Clipper only returns open paths through a PolyTree */
+        c.AddPaths(*open_subject, ClipperLib::ptSubject, /* closed */ false);
+        ClipperLib::PolyTree ptree;
+        c.Execute(op, ptree, fill, fill);
+        ClipperLib::Paths open_out;
+        ClipperLib::ClosedPathsFromPolyTree(ptree, out);
+        ClipperLib::OpenPathsFromPolyTree(ptree, open_out);
+        out.insert(out.end(), open_out.begin(), open_out.end());
+    }
+
+    virtual void boolean_op(ClipperLib::ClipType op, const ClipperLib::Paths &subject, const ClipperLib::Paths &clip,
+            GeomTree &out, ClipperLib::PolyFillType fill) {
+        out.Clear();
+        ClipperLib::Clipper c;
+        c.StrictlySimple(true);
+        c.AddPaths(subject, ClipperLib::ptSubject, /* closed */ true);
+        c.AddPaths(clip, ClipperLib::ptClip, /* closed */ true);
+        c.Execute(op, out, fill, fill);
+    }
+
+    virtual void offset(const vector<OffsetInput> &in, double delta, double miter_limit, double arc_tolerance,
+            ClipperLib::Paths &out) {
+        ClipperLib::ClipperOffset offx(miter_limit, arc_tolerance);
+        for (const auto &inp : in) {
+            offx.AddPaths(inp.paths, inp.join_type, inp.end_type);
+        }
+        offx.Execute(out, delta);
+    }
+
+    virtual void offset(const vector<OffsetInput> &in, double delta, double miter_limit, double arc_tolerance,
+            GeomTree &out) {
+        out.Clear();
+        ClipperLib::ClipperOffset offx(miter_limit, arc_tolerance);
+        for (const auto &inp : in) {
+            offx.AddPaths(inp.paths, inp.join_type, inp.end_type);
+        }
+        offx.Execute(out, delta);
+    }
+};
+
+#ifdef HAVE_CLIPPER2
+/* Clipper2, built when the Makefile is pointed at a copy of it through CLIPPER2_DIR. Clipper2 has its own point and
+ * path types with the same 64 bit fixed point representation, so we copy paths across at the interface. */
+class Clipper2Backend : public GeometryBackend {
+public:
+    virtual const char *name() const { return "clipper2"; }
+
+    virtual void boolean_op(ClipperLib::ClipType op, const ClipperLib::Paths &subject, const ClipperLib::Paths &clip,
+            ClipperLib::Paths &out, ClipperLib::PolyFillType fill, const ClipperLib::Paths *open_subject) {
+        Clipper2Lib::Clipper64 c;
+        c.AddSubject(to_c2(subject));
+        c.AddClip(to_c2(clip));
+
+        Clipper2Lib::Paths64 closed_out, open_out;
+        if (open_subject && !open_subject->empty()) {
+            c.AddOpenSubject(to_c2(*open_subject));
+        }
+        c.Execute(clip_type(op), fill_rule(fill), closed_out, open_out);
+
+        out.clear();
+        from_c2(closed_out, out);
+        from_c2(open_out, out);
+    }
+
+    virtual void boolean_op(ClipperLib::ClipType op, const ClipperLib::Paths &subject, const ClipperLib::Paths &clip,
+            GeomTree &out, ClipperLib::PolyFillType fill) {
+        Clipper2Lib::Clipper64 c;
+        c.AddSubject(to_c2(subject));
+        c.AddClip(to_c2(clip));
+
+        Clipper2Lib::PolyTree64 tree;
+        c.Execute(clip_type(op), fill_rule(fill), tree);
+
+        out.Clear();
+        copy_tree(tree, out, out);
+    }
+
+    virtual void offset(const vector<OffsetInput> &in, double delta, double miter_limit, double arc_tolerance,
+            ClipperLib::Paths &out) {
+        Clipper2Lib::ClipperOffset offx(miter_limit, arc_tolerance);
+        for (const auto &inp : in) {
+            offx.AddPaths(to_c2(inp.paths), join_type(inp.join_type), end_type(inp.end_type));
+        }
+
+        Clipper2Lib::Paths64 res;
+        offx.Execute(delta, res);
+        out.clear();
+        from_c2(res, out);
+    }
+
+    virtual void offset(const vector<OffsetInput> &in, double delta, double miter_limit, double arc_tolerance,
+            GeomTree &out) {
+        Clipper2Lib::ClipperOffset offx(miter_limit, arc_tolerance);
+        for (const auto &inp : in) {
+            offx.AddPaths(to_c2(inp.paths), join_type(inp.join_type), end_type(inp.end_type));
+        }
+
+        Clipper2Lib::PolyTree64 tree;
+        offx.Execute(delta, tree);
+        out.Clear();
+        copy_tree(tree, out, out);
+    }
+
+private:
+    static Clipper2Lib::Paths64 to_c2(const ClipperLib::Paths &in) {
+        Clipper2Lib::Paths64 out;
+        out.reserve(in.size());
+        for (const auto &path : in) {
+            auto &p_out = out.emplace_back();
+            p_out.reserve(path.size());
+            for (const auto &p : path) {
+                p_out.emplace_back(p.X, p.Y);
+            }
+        }
+        return out;
+    }
+
+    static void from_c2(const Clipper2Lib::Path64 &in, ClipperLib::Path &out) {
+        out.reserve(in.size());
+        for (const auto &p : in) {
+            out.push_back({p.x, p.y});
+        }
+    }
+
+    static void from_c2(const Clipper2Lib::Paths64 &in, ClipperLib::Paths &out) {
+        out.reserve(out.size() + in.size());
+        for (const auto &path : in) {
+            from_c2(path, out.emplace_back());
+        }
+    }
+
+    static void copy_tree(const Clipper2Lib::PolyPath64 &in, ClipperLib::PolyNode &parent, GeomTree &tree) {
+        for (const auto &child : in) {
+            ClipperLib::PolyNode *node = tree.add_child(parent);
+            from_c2(child->Polygon(), node->Contour);
+            copy_tree(*child, *node, tree);
+        }
+    }
+
+    static Clipper2Lib::ClipType clip_type(ClipperLib::ClipType op) {
+        switch (op) {
+            case ClipperLib::ctIntersection: return Clipper2Lib::ClipType::Intersection;
+            case ClipperLib::ctUnion: return Clipper2Lib::ClipType::Union;
+            case ClipperLib::ctDifference: return Clipper2Lib::ClipType::Difference;
+            default: return Clipper2Lib::ClipType::Xor;
+        }
+    }
+
+    static Clipper2Lib::FillRule fill_rule(ClipperLib::PolyFillType fill) {
+        switch (fill) {
+            case ClipperLib::pftEvenOdd: return Clipper2Lib::FillRule::EvenOdd;
+            case ClipperLib::pftPositive: return Clipper2Lib::FillRule::Positive;
+            case ClipperLib::pftNegative: return Clipper2Lib::FillRule::Negative;
+            default: return Clipper2Lib::FillRule::NonZero;
+        }
+    }
+
+    static Clipper2Lib::JoinType join_type(ClipperLib::JoinType jt) {
+        switch (jt) {
+            case ClipperLib::jtSquare: return Clipper2Lib::JoinType::Square;
+            case ClipperLib::jtRound: return Clipper2Lib::JoinType::Round;
+            default: return Clipper2Lib::JoinType::Miter;
+        }
+    }
+
+    static Clipper2Lib::EndType end_type(ClipperLib::EndType et) {
+        switch (et) {
+            case ClipperLib::etClosedPolygon: return Clipper2Lib::EndType::Polygon;
+            case ClipperLib::etClosedLine: return Clipper2Lib::EndType::Joined;
+            case ClipperLib::etOpenSquare: return Clipper2Lib::EndType::Square;
+            case ClipperLib::etOpenRound: return Clipper2Lib::EndType::Round;
+            default: return Clipper2Lib::EndType::Butt;
+        }
+    }
+};
+#endif /* HAVE_CLIPPER2 */
+
+Clipper1Backend clipper1_backend;
+#ifdef HAVE_CLIPPER2
+Clipper2Backend clipper2_backend;
+#endif
+
+GeometryBackend *all_backends[] = {
+    &clipper1_backend,
+#ifdef HAVE_CLIPPER2
+    &clipper2_backend,
+#endif
+};
+
+GeometryBackend *&current_backend() {
+    static GeometryBackend *current = find_geometry_backend(DEFAULT_GEOMETRY_BACKEND);
+    return current;
+}
+
+} /* anonymous namespace */
+
+GeometryBackend *gerbolyze::find_geometry_backend(const string &name) {
+    for (auto *backend : all_backends) {
+        if (name == backend->name()) {
+            return backend;
+        }
+    }
+    return nullptr;
+}
+
+vector<string> gerbolyze::geometry_backend_names() {
+    vector<string> out;
+    for (auto *backend : all_backends) {
+        out.push_back(backend->name());
+    }
+    return out;
+}
+
+GeometryBackend &gerbolyze::geometry_backend() {
+    GeometryBackend *backend = current_backend();
+    if (!backend) { /* DEFAULT_GEOMETRY_BACKEND was not built in */
+        return clipper1_backend;
+    }
+    return *backend;
+}
+
+bool gerbolyze::set_geometry_backend(const string &name) {
+    GeometryBackend *backend = find_geometry_backend(name);
+    if (!backend) {
+        return false;
+    }
+
+    current_backend() = backend;
+    return true;
+}
+
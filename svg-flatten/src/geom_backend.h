@@ -0,0 +1,83 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <clipper.hpp>
+
+namespace gerbolyze {
+
+/* Clipper's PolyTree that other backends can fill in, too. PolyTree keeps the nodes Clipper creates in a private list,
+ * so we own the nodes we create ourselves here. Always call Clear() and Total() through this class, not through
+ * PolyTree. Nodes created by add_child() do not support GetFirst()/GetNext(), walk Childs instead. */
+class GeomTree : public ClipperLib::PolyTree {
+public:
+    void Clear() { PolyTree::Clear(); m_nodes.clear(); }
+    int Total() const { return m_nodes.empty() ? PolyTree::Total() : (int)m_nodes.size(); }
+    ClipperLib::PolyNode *add_child(ClipperLib::PolyNode &parent);
+
+private:
+    std::vector<std::unique_ptr<ClipperLib::PolyNode>> m_nodes;
+};
+
+struct OffsetInput {
+    const ClipperLib::Paths &paths;
+    ClipperLib::JoinType join_type;
+    ClipperLib::EndType end_type;
+};
+
+/* Polygon boolean operations and offsetting. Paths go in and out in Clipper 1's types and at clipper_scale, so the rest
+ * of svg-flatten does not care which backend does the work. All closed outputs are strictly simple. Backends are
+ * stateless, so a backend can be used from several threads at once. */
+class GeometryBackend {
+public:
+    virtual ~GeometryBackend() {}
+    virtual const char *name() const = 0;
+
+    /* Apply op to the closed subject and clip paths, replacing the contents of out. out may be the same object as
+     * subject. If given, open_subject paths are clipped as polylines and their remaining pieces are appended to out
+     * after the closed results. */
+    virtual void boolean_op(ClipperLib::ClipType op, const ClipperLib::Paths &subject, const ClipperLib::Paths &clip,
+            ClipperLib::Paths &out, ClipperLib::PolyFillType fill=ClipperLib::pftNonZero,
+            const ClipperLib::Paths *open_subject=nullptr) = 0;
+    virtual void boolean_op(ClipperLib::ClipType op, const ClipperLib::Paths &subject, const ClipperLib::Paths &clip,
+            GeomTree &out, ClipperLib::PolyFillType fill=ClipperLib::pftNonZero) = 0;
+
+    /* Offset all inputs together by delta. Like ClipperOffset, an arc_tolerance of 0 selects the default. */
+    virtual void offset(const std::vector<OffsetInput> &in, double delta, double miter_limit, double arc_tolerance,
+            ClipperLib::Paths &out) = 0;
+    virtual void offset(const std::vector<OffsetInput> &in, double delta, double miter_limit, double arc_tolerance,
+            GeomTree &out) = 0;
+
+    /* Bounds work on our own path type, so they are the same for every backend. */
+    ClipperLib::IntRect bounds(const ClipperLib::Paths &paths) const;
+};
+
+/* The backend used for all of svg-flatten's geometry. The default is set at build time through
+ * DEFAULT_GEOMETRY_BACKEND, set_geometry_backend changes it for the whole process. It must not be called while anything
+ * is rendering. */
+GeometryBackend &geometry_backend();
+bool set_geometry_backend(const std::string &name);
+std::vector<std::string> geometry_backend_names();
+GeometryBackend *find_geometry_backend(const std::string &name);
+
+} /* namespace gerbolyze */
+
@@ -1,220 +1,88 @@
 
 #include <cstdlib>
 #include <cstdio>
-#include <filesystem>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <sstream>
+#include <filesystem>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#ifndef WASI
+#include <thread>
+#include <mutex>
+#endif
 #include <argagg.hpp>
 #include <gerbolyze.hpp>
 #include "vec_core.h"
-#include <base64.h>
 #include "util.h"
+#include "server.h"
+#include "render_cache.h"
+#include "geom_backend.h"
+
+#ifndef NOFORK
+#include <signal.h>
+#endif
 
 using argagg::parser_results;
 using argagg::parser;
 using namespace std;
 using namespace gerbolyze;
 
-string temp_file_path(const char *suffix) {
-    ifstream rnd;
-    rnd.open("/dev/urandom", ios::in | ios::binary);
-
-    char fn_buf[8];
-    rnd.read(fn_buf, sizeof(fn_buf));
-
-    if (rnd.rdstate()) {
-        cerr << "Error getting random data for temporary file name" << endl;
-        abort();
-    }
-
-    ostringstream out;
-    out << "tmp_";
-    for (size_t i=0; i<sizeof(fn_buf); i++) {
-        out << setfill('0') << setw(2) << setbase(16) << static_cast<int>(fn_buf[i] & 0xff);
-    }
-    out << suffix;
-
-    //cerr << "out \"" << out.str() << "\"" << endl;
-#ifndef WASI
-    filesystem::path base = filesystem::temp_directory_path();
-    return (base / out.str()).native();
-#else
-    return "/tmp/" + out.str();
-#endif
-}
-
-int main(int argc, char **argv) {
-    parser argparser {{
-            {"help", {"-h", "--help"},
-                "Print help and exit",
-                0},
-            {"version", {"-v", "--version"},
-                "Print version and exit",
-                0},
-            {"ofmt", {"-o", "--format"},
-                "Output format. Supported: gerber, gerber-outline (for board outline layer), svg, s-exp (KiCAD S-Expression)",
-                1},
-            {"precision", {"-p", "--precision"},
-                "Number of decimal places use for exported coordinates (gerber: 1-9, SVG: 0-*)",
-                1},
-            {"svg_clear_color", {"--clear-color"},
-                "SVG color to use for \"clear\" areas (SVG output only; default: white)",
-                1},
-            {"svg_dark_color", {"--dark-color"},
-                "SVG color to use for \"dark\" areas (SVG output only; default: black)",
-                1},
-            {"flip_gerber_polarity", {"-f", "--flip-gerber-polarity"},
-                "Flip polarity of all output gerber primitives for --format gerber.",
-                0},
-            {"flip_svg_color_interpretation", {"-i", "--svg-white-is-gerber-dark"},
-                "Flip polarity of SVG color interpretation. This affects only SVG primitives like paths and NOT embedded bitmaps. With -i: white -> silk there/\"dark\" gerber primitive.",
-                0},
-            {"pattern_complete_tiles_only", {"--pattern-complete-tiles-only"},
-                "Break SVG spec by only rendering complete pattern tiles, i.e. pattern tiles that entirely fit the target area, instead of performing clipping.",
-                0},
-            {"use_apertures_for_patterns", {"--use-apertures-for-patterns"},
-                "Try to use apertures to represent svg patterns where possible.",
-                0},
-            {"min_feature_size", {"-d", "--trace-space"},
-                "Minimum feature size of elements in vectorized graphics (trace/space) in mm. Default: 0.1mm.",
-                1},
-            {"curve_tolerance", {"-c", "--curve-tolerance"},
-                "Tolerance for curve flattening in mm. Default: 0.1mm.",
-                1},
-            {"drill_test_polsby_popper_tolerance", {"--drill-test-tolerance"},
-                "Tolerance for identifying circles as drills in outline mode",
-                1},
-            {"aperture_circle_test_tolerance", {"--circle-test-tolerance"},
-                "Tolerance for identifying circles as apertures in patterns (--use-apertures-for-patterns)",
-                1},
-            {"aperture_rect_test_tolerance", {"--rect-test-tolerance"},
-                "Tolerance for identifying rectangles as apertures in patterns (--use-apertures-for-patterns)",
-                1},
-            {"no_header", {"--no-header"},
-                "Do not export output format header/footer, only export the primitives themselves",
-                0},
-            {"flatten", {"--flatten"},
-                "Flatten output so it only consists of non-overlapping white polygons. This perform composition at the vector level. Potentially slow.",
-                0},
-            {"no_flatten", {"--no-flatten"},
-                "Disable automatic flattening for KiCAD S-Exp export",
-                0},
-            {"dilate", {"--dilate"},
-                "Dilate output gerber primitives by this amount in mm. Used for masking out other layers.",
-                1},
-            {"only_groups", {"-g", "--only-groups"},
-                "Comma-separated list of group IDs to export.",
-                1},
-            {"vectorizer", {"-b", "--vectorizer"},
-                "Vectorizer to use for bitmap images. One of poisson-disc (default), hex-grid, square-grid, binary-contours, dev-null.",
-                1},
-            {"vectorizer_map", {"--vectorizer-map"},
-                "Map from image element id to vectorizer. Overrides --vectorizer. Format: id1=vectorizer,id2=vectorizer,...",
-                1},
-            {"force_svg", {"--force-svg"},
-                "Force SVG input irrespective of file name",
-                0},
-            {"force_png", {"--force-png"},
-                "Force bitmap graphics input irrespective of file name",
-                0},
-            {"size", {"-s", "--size"},
-                "Bitmap mode only: Physical size of output image in mm. Format: 12.34x56.78",
-                1},
-            {"sexp_mod_name", {"--sexp-mod-name"},
-                "Module name for KiCAD S-Exp output",
-                1},
-            {"sexp_layer", {"--sexp-layer"},
-                "Layer for KiCAD S-Exp output. Defaults to auto-detect layers from SVG layer/top-level group names",
-                1},
-            {"preserve_aspect_ratio", {"-a", "--preserve-aspect-ratio"},
-                "Bitmap mode only: Preserve aspect ratio of image. Allowed values are meet, slice. Can also parse full SVG preserveAspectRatio syntax.",
-                1},
-            {"skip_usvg", {"--no-usvg"},
-                "Do not preprocess input using usvg (do not use unless you know *exactly* what you're doing)",
-                0},
-            {"scale", {"--scale"},
-                "Scale input svg lengths by this factor (-o gerber only).",
-                1},
-            {"exclude_groups", {"-e", "--exclude-groups"},
-                "Comma-separated list of group IDs to exclude from export. Takes precedence over --only-groups.",
-                1},
-            /* Forwarded USVG options */
-            {"usvg-dpi", {"--usvg-dpi"},
-                "Passed through to usvg's --dpi, in case the input file has different ideas of DPI than usvg has.",
-                1},
-            {"usvg-font-family",       {"--usvg-font-family"}, "", 1},
-            {"usvg-font-size",         {"--usvg-font-size"}, "", 1},
-            {"usvg-serif-family",      {"--usvg-serif-family"}, "", 1},
-            {"usvg-sans-serif-family", {"--usvg-sans-serif-family"}, "", 1},
-            {"usvg-cursive-family",    {"--usvg-cursive-family"}, "", 1},
-            {"usvg-fantasy-family",    {"--usvg-fantasy-family"}, "", 1},
-            {"usvg-monospace-family",  {"--usvg-monospace-family"}, "", 1},
-            {"usvg-use-font-file",     {"--usvg-use-font-file"}, "", 1},
-            {"usvg-use-fonts-dir",     {"--usvg-use-fonts-dir"}, "", 1},
-            {"usvg-skip-system-fonts", {"--usvg-skip-system-fonts"}, "", 0},
-    }};
-
-
-    ostringstream usage;
-    usage
-        << argv[0] << " " << lib_version << endl
-        << endl
-        << "Usage: " << argv[0] << " [options]... [input_file] [output_file]" << endl
-        << endl
-        << "Specify \"-\" for stdin/stdout." << endl
-        << endl;
-
-    argagg::parser_results args;
-    args = argparser.parse(argc, argv);
-
-    if (args["help"]) {
-        argagg::fmt_ostream fmt(cerr);
-        fmt << usage.str() << argparser;
-        return EXIT_SUCCESS;
-    }
-
-    if (args["version"]) {
-        cerr << lib_version << endl;
-        return EXIT_SUCCESS;
+/* One output file of this run. In the default mode there is exactly one of these, built from --only-groups and the
+ * positional output file argument. With --output-layers, there is one per mapping. */
+struct OutputSpec {
+    vector<string> groups;
+    string filename;
+    string format;
+};
+
+/* Sink chain for one output: Output format sink, optionally followed by a dilater and a flattener. */
+class OutputSinkChain {
+public:
+    ~OutputSinkChain() {
+        if (m_flattener) {
+            delete m_flattener;
+        }
+        if (m_dilater) {
+            delete m_dilater;
+        }
+        if (m_sink) {
+            delete m_sink;
+        }
     }
 
-    string in_f_name;
-    istream *in_f = &cin;
-    ifstream in_f_file;
-    string out_f_name;
-    ostream *out_f = &cout;
-    ofstream out_f_file;
+    bool setup(const string &fmt, ostream &out, parser_results &args);
+    PolygonSink &top() { return *m_top; }
 
-    if (args.pos.size() >= 1) {
-        in_f_name = args.pos[0];
-
-        if (args.pos.size() >= 2) {
-            out_f_name = args.pos[1];
-        }
-    }
+    bool outline_mode = false;
+    bool is_sexp = false;
 
-    if (!in_f_name.empty() && in_f_name != "-") {
-        in_f_file.open(in_f_name);
-        if (!in_f_file) {
-            cerr << "Cannot open input file \"" << in_f_name << "\"" << endl;
-            return EXIT_FAILURE;
+private:
+    PolygonSink *m_sink = nullptr;
+    PolygonSink *m_dilater = nullptr;
+    PolygonSink *m_flattener = nullptr;
+    PolygonSink *m_top = nullptr;
+};
+
+static bool is_known_format(const string &fmt) {
+    for (const char *known : {"svg", "gbr", "grb", "gerber", "gerber-outline", "s-exp", "sexp", "kicad"}) {
+        if (fmt == known) {
+            return true;
         }
-        in_f = &in_f_file;
     }
+    return false;
+}
 
-    if (!out_f_name.empty() && out_f_name != "-") {
-        out_f_file.open(out_f_name);
-        if (!out_f_file) {
-            cerr << "Cannot open output file \"" << out_f_name << "\"" << endl;
-            return EXIT_FAILURE;
-        }
-        out_f = &out_f_file;
-    }
+static bool is_outline_format(const string &fmt) {
+    return fmt == "gerber-outline";
+}
 
+bool OutputSinkChain::setup(const string &fmt, ostream &out, parser_results &args) {
     bool only_polys = args["no_header"];
 
     int precision = 6;
@@ -222,180 +90,339 @@ int main(int argc, char **argv) {
         precision = atoi(args["precision"]);
     }
 
-    string fmt = args["ofmt"] ? args["ofmt"].as<string>() : "gerber";
-    transform(fmt.begin(), fmt.end(), fmt.begin(), [](unsigned char c){ return std::tolower(c); }); /* c++ yeah */
-
     string sexp_layer = args["sexp_layer"] ? args["sexp_layer"].as<string>() : "auto";
 
     bool force_flatten = false;
-    bool is_sexp = false;
-    bool outline_mode = false;
-    PolygonSink *sink = nullptr;
-    PolygonSink *flattener = nullptr;
-    PolygonSink *dilater = nullptr;
     if (fmt == "svg") {
         string dark_color = args["svg_dark_color"] ? args["svg_dark_color"].as<string>() : "#000000";
         string clear_color = args["svg_clear_color"] ? args["svg_clear_color"].as<string>() : "#ffffff";
-        sink = new SimpleSVGOutput(*out_f, only_polys, precision, dark_color, clear_color);
+        m_sink = new SimpleSVGOutput(out, only_polys, precision, dark_color, clear_color);
 
     } else if (fmt == "gbr" || fmt == "grb" || fmt == "gerber" || fmt == "gerber-outline") {
-        outline_mode = fmt == "gerber-outline";
+        outline_mode = is_outline_format(fmt);
 
         double scale = args["scale"].as<double>(1.0);
         if (scale != 1.0) {
             cerr << "Info: Loading scaled input @scale=" << scale << endl;
         }
 
-        sink = new SimpleGerberOutput(*out_f, only_polys, 4, precision, scale, {0,0}, args["flip_gerber_polarity"]);
+        m_sink = new SimpleGerberOutput(out, only_polys, 4, precision, scale, {0,0}, args["flip_gerber_polarity"]);
 
     } else if (fmt == "s-exp" || fmt == "sexp" || fmt == "kicad") {
         if (!args["sexp_mod_name"]) {
             cerr << "Error: --sexp-mod-name must be given for sexp export" << endl;
-            return EXIT_FAILURE;
+            return false;
         }
 
-        sink = new KicadSexpOutput(*out_f, args["sexp_mod_name"], sexp_layer, only_polys);
+        m_sink = new KicadSexpOutput(out, args["sexp_mod_name"], sexp_layer, only_polys);
         force_flatten = true;
         is_sexp = true;
 
     } else {
         cerr << "Error: Unknown output format \"" << fmt << "\"" << endl;
-        return EXIT_FAILURE;
+        return false;
     }
 
-    PolygonSink *top_sink = sink;
+    m_top = m_sink;
 
     if (args["dilate"]) {
-        dilater = new Dilater(*top_sink, args["dilate"].as<double>());
-        top_sink = dilater;
+        m_dilater = new Dilater(*m_top, args["dilate"].as<double>(), args["dilate_merge"]);
+        m_top = m_dilater;
     }
 
     if (args["flatten"] || (force_flatten && !args["no_flatten"])) {
-        flattener = new Flattener(*top_sink);
-        top_sink = flattener;
-    }
-
-    /* Because the C++ stdlib is bullshit */
-    auto id_match = [](string in, vector<string> &out) {
-        stringstream  ss(in);
-        while (getline(ss, out.emplace_back(), ',')) {
+        string engine = args["flatten_engine"] ? args["flatten_engine"].as<string>() : "layered";
+        if (engine == "layered") {
+            m_flattener = new Flattener(*m_top);
+        } else if (engine == "tiled") {
+            m_flattener = new Flattener(*m_top, /* tiled */ true);
+        } else if (engine == "sweep") {
+            m_flattener = new SweepFlattener(*m_top);
+        } else {
+            cerr << "Error: Unknown flatten engine \"" << engine << "\"" << endl;
+            return false;
         }
-        out.pop_back();
-    };
-
-    IDElementSelector sel;
-    if (args["only_groups"])
-        id_match(args["only_groups"], sel.include);
-    if (args["exclude_groups"])
-        id_match(args["exclude_groups"], sel.exclude);
-    if (is_sexp && sexp_layer == "auto") {
-        sel.layers = &gerbolyze::kicad_default_layers;
+        m_top = m_flattener;
     }
 
-    string vectorizer = args["vectorizer"] ? args["vectorizer"].as<string>() : "poisson-disc";
-    /* Check argument */
-    ImageVectorizer *vec = makeVectorizer(vectorizer);
-    if (!vec) {
-        cerr << "Unknown vectorizer \"" << vectorizer << "\"." << endl;
-        argagg::fmt_ostream fmt(cerr);
-        fmt << usage.str() << argparser;
-        return EXIT_FAILURE;
-    }
-    delete vec;
-
-    double min_feature_size = args["min_feature_size"].as<double>(0.1); /* mm */
-    double curve_tolerance = args["curve_tolerance"].as<double>(0.1); /* mm */
-    double drill_test_polsby_popper_tolerance = args["drill_test_polsby_popper_tolerance"].as<double>(0.1);
-    double aperture_rect_test_tolerance = args["aperture_rect_test_tolerance"].as<double>(0.1);
-    double aperture_circle_test_tolerance = args["aperture_circle_test_tolerance"].as<double>(0.1);
+    return true;
+}
 
-    string ending = "";
-    auto idx = in_f_name.rfind(".");
-    if (idx != string::npos) {
-        ending = in_f_name.substr(idx);
-        transform(ending.begin(), ending.end(), ending.begin(), [](unsigned char c){ return std::tolower(c); }); /* c++ yeah */
+/* Because the C++ stdlib is bullshit */
+static void id_match(string in, vector<string> &out) {
+    stringstream  ss(in);
+    while (getline(ss, out.emplace_back(), ',')) {
     }
-    
-    string barf =  temp_file_path(".svg");
-    string frob = temp_file_path(".svg");
+    out.pop_back();
+}
 
-    bool is_svg = args["force_svg"] || (ending == ".svg" && !args["force_png"]);
-    if (!is_svg) {
-        //cerr << "writing bitmap into svg" << endl; 
-        if (!args["size"]) {
-            cerr << "Error: --size must be given when using bitmap input." << endl;
-            return EXIT_FAILURE;
-        }
+static const parser argparser {{
+        {"help", {"-h", "--help"},
+            "Print help and exit",
+            0},
+        {"version", {"-v", "--version"},
+            "Print version and exit",
+            0},
+        {"ofmt", {"-o", "--format"},
+            "Output format. Supported: gerber, gerber-outline (for board outline layer), svg, s-exp (KiCAD S-Expression)",
+            1},
+        {"precision", {"-p", "--precision"},
+            "Number of decimal places use for exported coordinates (gerber: 1-9, SVG: 0-*)",
+            1},
+        {"svg_clear_color", {"--clear-color"},
+            "SVG color to use for \"clear\" areas (SVG output only; default: white)",
+            1},
+        {"svg_dark_color", {"--dark-color"},
+            "SVG color to use for \"dark\" areas (SVG output only; default: black)",
+            1},
+        {"flip_gerber_polarity", {"-f", "--flip-gerber-polarity"},
+            "Flip polarity of all output gerber primitives for --format gerber.",
+            0},
+        {"flip_svg_color_interpretation", {"-i", "--svg-white-is-gerber-dark"},
+            "Flip polarity of SVG color interpretation. This affects only SVG primitives like paths and NOT embedded bitmaps. With -i: white -> silk there/\"dark\" gerber primitive.",
+            0},
+        {"pattern_complete_tiles_only", {"--pattern-complete-tiles-only"},
+            "Break SVG spec by only rendering complete pattern tiles, i.e. pattern tiles that entirely fit the target area, instead of performing clipping.",
+            0},
+        {"use_apertures_for_patterns", {"--use-apertures-for-patterns"},
+            "Try to use apertures to represent svg patterns where possible.",
+            0},
+        {"min_feature_size", {"-d", "--trace-space"},
+            "Minimum feature size of elements in vectorized graphics (trace/space) in mm. Default: 0.1mm.",
+            1},
+        {"curve_tolerance", {"-c", "--curve-tolerance"},
+            "Tolerance for curve flattening in mm. Default: 0.1mm.",
+            1},
+        {"fast_curves", {"--fast-curves"},
+            "Flatten curves into a fixed number of segments calculated up front instead of subdividing them adaptively. Faster, but the output differs slightly.",
+            0},
+        {"geometry_backend", {"--geometry-backend"},
+            "Polygon clipping and offsetting library: \"clipper1\" (bundled) or \"clipper2\" (if svg-flatten was built with it). Default: chosen at build time, usually clipper1.",
+            1},
+        {"drill_test_polsby_popper_tolerance", {"--drill-test-tolerance"},
+            "Tolerance for identifying circles as drills in outline mode",
+            1},
+        {"aperture_circle_test_tolerance", {"--circle-test-tolerance"},
+            "Tolerance for identifying circles as apertures in patterns (--use-apertures-for-patterns)",
+            1},
+        {"aperture_rect_test_tolerance", {"--rect-test-tolerance"},
+            "Tolerance for identifying rectangles as apertures in patterns (--use-apertures-for-patterns)",
+            1},
+        {"no_header", {"--no-header"},
+            "Do not export output format header/footer, only export the primitives themselves",
+            0},
+        {"flatten", {"--flatten"},
+            "Flatten output so it only consists of non-overlapping white polygons. This perform composition at the vector level. Potentially slow.",
+            0},
+        {"flatten_engine", {"--flatten-engine"},
+            "Algorithm used for flattening: \"layered\" (default) subtracts each run of clear polygons from the dark polygons below it as it comes, \"tiled\" does the same but writes out dark polygons as soon as nothing later in the document can reach them, \"sweep\" resolves each layer in one go once it is complete.",
+            1},
+        {"no_flatten", {"--no-flatten"},
+            "Disable automatic flattening for KiCAD S-Exp export",
+            0},
+        {"dilate", {"--dilate"},
+            "Dilate output gerber primitives by this amount in mm. Used for masking out other layers.",
+            1},
+        {"dilate_merge", {"--dilate-merge"},
+            "With --dilate, dilate each run of polygons of the same polarity in one go, merging polygons that overlap after dilation. "
+            "Merged outlines are cut along the cells of a 16x16 grid over the document into pieces that meet along the cell borders.",
+            0},
+        {"only_groups", {"-g", "--only-groups"},
+            "Comma-separated list of group IDs to export.",
+            1},
+        {"vectorizer", {"-b", "--vectorizer"},
+            "Vectorizer to use for bitmap images. One of poisson-disc (default), hex-grid, square-grid, binary-contours, dev-null.",
+            1},
+        {"vectorizer_map", {"--vectorizer-map"},
+            "Map from image element id to vectorizer. Overrides --vectorizer. Format: id1=vectorizer,id2=vectorizer,...",
+            1},
+        {"force_svg", {"--force-svg"},
+            "Force SVG input irrespective of file name",
+            0},
+        {"force_png", {"--force-png"},
+            "Force bitmap graphics input irrespective of file name",
+            0},
+        {"size", {"-s", "--size"},
+            "Bitmap mode only: Physical size of output image in mm. Format: 12.34x56.78",
+            1},
+        {"sexp_mod_name", {"--sexp-mod-name"},
+            "Module name for KiCAD S-Exp output",
+            1},
+        {"sexp_layer", {"--sexp-layer"},
+            "Layer for KiCAD S-Exp output. Defaults to auto-detect layers from SVG layer/top-level group names",
+            1},
+        {"preserve_aspect_ratio", {"-a", "--preserve-aspect-ratio"},
+            "Bitmap mode only: Preserve aspect ratio of image. Allowed values are meet, slice. Can also parse full SVG preserveAspectRatio syntax.",
+            1},
+        {"skip_usvg", {"--no-usvg"},
+            "Do not preprocess input using usvg (do not use unless you know *exactly* what you're doing)",
+            0},
+        {"scale", {"--scale"},
+            "Scale input svg lengths by this factor (-o gerber only).",
+            1},
+        {"serve", {"--serve"},
+            "Run as a server reading JSON-lines requests from stdin and writing one JSON response line per request to stdout. See README for the protocol.",
+            0},
+        {"serve_socket", {"--serve-socket"},
+            "Like --serve, but listen on the Unix domain socket at the given path instead of using stdin/stdout.",
+            1},
+        {"batch", {"--batch"},
+            "Convert many files in one run. Each line of the given manifest file (\"-\" for stdin) holds the options, input and output file of one conversion, just like on the command line. Options given on the command line apply to every line.",
+            1},
+        {"jobs", {"-j", "--jobs"},
+            "Number of worker threads. With --batch, this many files are converted in parallel (default: number of CPU cores). Otherwise, independent elements of the input are rendered in parallel, with output identical to a serial render (default: 1).",
+            1},
+        {"cache_dir", {"--cache-dir"},
+            "Cache rendered output in this directory, and reuse it when the same input is converted again with the same settings.",
+            1},
+        {"cache_size", {"--cache-size"},
+            "Maximum size of the --cache-dir in MB. Least recently used entries are deleted first. Default: 500.",
+            1},
+        {"cache_stats", {"--cache-stats"},
+            "Print render cache and clip path cache hit/miss statistics to stderr.",
+            0},
+        {"exclude_groups", {"-e", "--exclude-groups"},
+            "Comma-separated list of group IDs to exclude from export. Takes precedence over --only-groups.",
+            1},
+        {"output_layers", {"--output-layers"},
+            "Render several top-level groups into separate output files in one pass. Format: id1=file1[:format],id2=file2[:format],... where format defaults to --format. Outline layers do not use --use-apertures-for-patterns. Replaces --only-groups and the output file argument.",
+            1},
+        /* Forwarded USVG options */
+        {"usvg-dpi", {"--usvg-dpi"},
+            "Passed through to usvg's --dpi, in case the input file has different ideas of DPI than usvg has.",
+            1},
+        {"usvg-font-family",       {"--usvg-font-family"}, "", 1},
+        {"usvg-font-size",         {"--usvg-font-size"}, "", 1},
+        {"usvg-serif-family",      {"--usvg-serif-family"}, "", 1},
+        {"usvg-sans-serif-family", {"--usvg-sans-serif-family"}, "", 1},
+        {"usvg-cursive-family",    {"--usvg-cursive-family"}, "", 1},
+        {"usvg-fantasy-family",    {"--usvg-fantasy-family"}, "", 1},
+        {"usvg-monospace-family",  {"--usvg-monospace-family"}, "", 1},
+        {"usvg-use-font-file",     {"--usvg-use-font-file"}, "", 1},
+        {"usvg-use-fonts-dir",     {"--usvg-use-fonts-dir"}, "", 1},
+        {"usvg-skip-system-fonts", {"--usvg-skip-system-fonts"}, "", 0},
+}};
+
+static string prog_name = "svg-flatten";
+
+static void print_usage(ostream &out) {
+    argagg::fmt_ostream fmt(out);
+    fmt << prog_name << " " << lib_version << endl
+        << endl
+        << "Usage: " << prog_name << " [options]... [input_file] [output_file]" << endl
+        << endl
+        << "Specify \"-\" for stdin/stdout." << endl
+        << endl
+        << argparser;
+}
 
-        string sz = args["size"].as<string>();
-        auto pos = sz.find_first_of("x*,");
-        if (pos == string::npos) {
-            cerr << "Error: --size must be of form 12.34x56.78" << endl;
-            return EXIT_FAILURE;
+/* Keeps the most recently loaded document around between requests in --serve mode, so that repeated conversions of
+ * the same input with different output settings skip usvg and XML parsing. */
+class DocumentCache {
+public:
+    ~DocumentCache() {
+        if (doc) {
+            delete doc;
         }
+    }
 
-        string x_str = sz.substr(0, pos);
-        string y_str = sz.substr(pos+1);
+    string key;
+    SVGDocument *doc = nullptr;
+};
 
-        double width = std::strtod(x_str.c_str(), nullptr);
-        double height = std::strtod(y_str.c_str(), nullptr);
+/* Everything that goes into loading the document, but nothing that only affects rendering. Returns an empty string
+ * if the input cannot be identified, e.g. for stdin. Input files are identified by a hash of their contents, since
+ * their modification time and size do not reliably change on every edit. */
+static string document_cache_key(parser_results &args, const string &in_f_name, const string *input_data) {
+    CacheKey key;
 
-        if (width < 1 || height < 1) {
-            cerr << "Error: --size must be of form 12.34x56.78 and values must be positive floating-point numbers in mm" << endl;
-            return EXIT_FAILURE;
+    if (input_data) {
+        key.add(string("inline"));
+        key.add(*input_data);
+
+    } else if (!in_f_name.empty() && in_f_name != "-") {
+        key.add(string("file"));
+        if (!key.add_file(in_f_name)) {
+            return "";
         }
 
-        ofstream svg(barf.c_str());
+    } else {
+        return "";
+    }
 
-        svg << "<svg width=\"" << width << "mm\" height=\"" << height << "mm\" viewBox=\"0 0 "
-            << width << " " << height << "\" "
-            << "xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\">" << endl;
+    for (const char *opt : {"force_svg", "force_png", "skip_usvg", "usvg-skip-system-fonts"}) {
+        key.add(string(opt));
+        key.add((bool)args[opt]);
+    }
 
-        string par_attr = "none";
-        if (args["preserve_aspect_ratio"]) {
-            string aspect_ratio = args["preserve_aspect_ratio"].as<string>();
-            if (aspect_ratio == "meet") {
-                par_attr = "xMidYMid meet";
-            } else if (aspect_ratio == "slice") {
-                par_attr = "xMidYMid slice";
-            } else {
-                par_attr = aspect_ratio;
-            }
+    for (const char *opt : {"usvg-dpi", "usvg-font-family", "usvg-font-size",
+            "usvg-serif-family", "usvg-sans-serif-family", "usvg-cursive-family", "usvg-fantasy-family",
+            "usvg-monospace-family", "usvg-use-font-file", "usvg-use-fonts-dir"}) {
+        if (args[opt]) {
+            key.add(string(opt));
+            key.add(args[opt].as<string>());
         }
-        svg << "<image width=\"" << width << "\" height=\"" << height << "\" x=\"0\" y=\"0\" preserveAspectRatio=\""
-            << par_attr << "\" xlink:href=\"data:image/png;base64,";
-        
-        /* c++ has the best hacks */
-        std::ostringstream sstr;
-        sstr << in_f->rdbuf();
-        string le_data = sstr.str();
+    }
 
-        svg << base64_encode(le_data);
-        svg << "\"/>" << endl;
+    return key.hex_digest();
+}
 
-        svg << "</svg>" << endl;
-        svg.close();
+/* Inline input has no file name, so it is treated as SVG unless --force-png is given. */
+static bool input_is_svg(parser_results &args, const string &in_f_name, const string *input_data) {
+    string ending = "";
+    auto idx = in_f_name.rfind(".");
+    if (idx != string::npos) {
+        ending = in_f_name.substr(idx);
+        transform(ending.begin(), ending.end(), ending.begin(), [](unsigned char c){ return std::tolower(c); }); /* c++ yeah */
+    }
 
-    } else { /* svg file */
-        //cerr << "copying svg input into temp svg" << endl; 
+    return args["force_svg"] || ((ending == ".svg" || input_data) && !args["force_png"]);
+}
 
-        /* c++ has the best hacks */
-        std::ostringstream sstr;
-        sstr << in_f->rdbuf();
+/* Read SVG input (from in_f_name or input_data), run usvg and parse the result into doc. */
+static bool load_document(parser_results &args, const string &in_f_name, string *input_data, SVGDocument &doc) {
+    istream *in_f = &cin;
+    ifstream in_f_file;
 
-        ofstream tmp_out(barf.c_str());
-        tmp_out << sstr.str();
-        tmp_out.close();
+    if (!input_data && !in_f_name.empty() && in_f_name != "-") {
+        in_f_file.open(in_f_name);
+        if (!in_f_file) {
+            cerr << "Cannot open input file \"" << in_f_name << "\"" << endl;
+            return false;
+        }
+        in_f = &in_f_file;
+    }
 
+    /* We keep at most one copy of the input document in memory. For files, usvg reads the input file itself. Otherwise,
+     * we read the input into memory once and pipe it through usvg. We capture usvg's output in memory and parse it in
+     * place. Without usvg, we map the input file directly. */
+    string svg_data;
+    bool is_file = in_f == &in_f_file;
+    if (input_data) {
+        svg_data = std::move(*input_data);
+
+    } else if (!is_file) { /* svg from stdin */
+        if (!read_stream(*in_f, svg_data)) {
+            cerr << "Error reading input file \"" << in_f_name << "\"" << endl;
+            return false;
+        }
     }
+    in_f_file.close();
 
     if (args["skip_usvg"]) {
         cerr << "Info: Skipping usvg" << endl; 
-        frob = barf;
+
+        if (is_file) {
+            if (!doc.load(in_f_name)) {
+                cerr <<  "Error loading input file \"" << in_f_name << "\", exiting." << endl;
+                return false;
+            }
+            return true;
+        }
 
     } else {
 #ifndef NOFORK
-        //cerr << "calling usvg on " << barf << " and " << frob << endl; 
+        bool usvg_reads_file = is_file;
         vector<string> command_line = {"--keep-named-groups"};
 
         string options[] = {
@@ -422,67 +449,680 @@ int main(int argc, char **argv) {
             command_line.push_back("--skip-system-fonts");
         }
 
-        command_line.push_back(barf);
-        command_line.push_back(frob);
-        
-        if (run_cargo_command("usvg", command_line, "USVG")) {
-            return EXIT_FAILURE;
+        /* Input either from file or from stdin ("-"), output to stdout (-c) */
+        command_line.push_back(usvg_reads_file ? in_f_name : "-");
+        command_line.push_back("-c");
+
+        string usvg_out;
+        int rc = run_cargo_command("usvg", command_line, "USVG", usvg_reads_file ? nullptr : &svg_data, &usvg_out);
+        /* Drop usvg's input buffer */
+        string().swap(svg_data);
+        if (rc) {
+            return false;
         }
+
+        /* The document parses usvg's output in place and keeps the buffer, so there is still only one copy of it */
+        if (!doc.load_buffer(std::move(usvg_out))) {
+            cerr <<  "Error loading input file \"" << in_f_name << "\", exiting." << endl;
+            return false;
+        }
+        return true;
 #else
         cerr << "Error: The caller of svg-flatten (you?) must use --no-usvg and run usvg externally since wasi does not yet support fork/exec." << endl;
-        return EXIT_FAILURE;
+        return false;
 #endif
     }
 
+    if (!doc.load_buffer(std::move(svg_data))) {
+        cerr <<  "Error loading input file \"" << in_f_name << "\", exiting." << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Bitmap input is vectorized directly without going through usvg or an SVG document. This sets up the image's
+ * placement in a --size'd document with millimeter units. */
+static bool setup_raster(parser_results &args, RasterImage &raster) {
+    if (!args["size"]) {
+        cerr << "Error: --size must be given when using bitmap input." << endl;
+        return false;
+    }
+
+    string sz = args["size"].as<string>();
+    auto pos = sz.find_first_of("x*,");
+    if (pos == string::npos) {
+        cerr << "Error: --size must be of form 12.34x56.78" << endl;
+        return false;
+    }
+
+    string x_str = sz.substr(0, pos);
+    string y_str = sz.substr(pos+1);
+
+    raster.width = std::strtod(x_str.c_str(), nullptr);
+    raster.height = std::strtod(y_str.c_str(), nullptr);
+
+    if (raster.width < 1 || raster.height < 1) {
+        cerr << "Error: --size must be of form 12.34x56.78 and values must be positive floating-point numbers in mm" << endl;
+        return false;
+    }
+
+    raster.preserve_aspect_ratio = "none";
+    if (args["preserve_aspect_ratio"]) {
+        string aspect_ratio = args["preserve_aspect_ratio"].as<string>();
+        if (aspect_ratio == "meet") {
+            raster.preserve_aspect_ratio = "xMidYMid meet";
+        } else if (aspect_ratio == "slice") {
+            raster.preserve_aspect_ratio = "xMidYMid slice";
+        } else {
+            raster.preserve_aspect_ratio = aspect_ratio;
+        }
+    }
+
+    return true;
+}
+
+/* Everything from the command line that affects the output, for the render cache key. Options that are per output
+ * (format, groups) are added separately by the caller, and those that do not affect the output are skipped. */
+static void add_options_to_key(CacheKey &key, parser_results &args) {
+    key.add(string(lib_version));
+
+    for (const auto &def : argparser.definitions) {
+        const string &name = def.name;
+        if (name == "help" || name == "version" || name == "serve" || name == "serve_socket" || name == "batch"
+                || name == "jobs" || name == "cache_dir" || name == "cache_size" || name == "cache_stats"
+                || name == "ofmt" || name == "only_groups" || name == "output_layers") {
+            continue;
+        }
+
+        const auto &res = args[name];
+        if (!res) {
+            continue;
+        }
+
+        key.add(name);
+        for (const auto &opt : res.all) {
+            key.add(string(opt.arg ? opt.arg : ""));
+        }
+    }
+}
+
+/* One complete svg-flatten run. input_data replaces the input file if given. Output to "-" goes to std_out. If cache is
+ * given, the parsed document is kept in it for the next call. */
+static int run_conversion(parser_results &args, string *input_data, ostream &std_out, DocumentCache *cache=nullptr,
+        bool *doc_cached=nullptr) {
+    string in_f_name;
+    string out_f_name;
+
+    if (args.pos.size() >= 1) {
+        in_f_name = args.pos[0];
+
+        if (args.pos.size() >= 2) {
+            out_f_name = args.pos[1];
+        }
+    }
+
+    string fmt = args["ofmt"] ? args["ofmt"].as<string>() : "gerber";
+    transform(fmt.begin(), fmt.end(), fmt.begin(), [](unsigned char c){ return std::tolower(c); }); /* c++ yeah */
+
+    vector<OutputSpec> outputs;
+    if (args["output_layers"]) {
+        if (args["only_groups"]) {
+            cerr << "Error: --only-groups cannot be combined with --output-layers" << endl;
+            return EXIT_FAILURE;
+        }
+
+        vector<string> mappings;
+        id_match(args["output_layers"], mappings);
+        for (const auto &elem : mappings) {
+            size_t pos = elem.find_first_of("=");
+            if (pos == string::npos || pos == 0 || pos+1 == elem.size()) {
+                cerr << "Error parsing --output-layers at element \"" << elem << "\"" << endl;
+                return EXIT_FAILURE;
+            }
+
+            OutputSpec &spec = outputs.emplace_back();
+            spec.groups.push_back(elem.substr(0, pos));
+            spec.filename = elem.substr(pos+1);
+            spec.format = fmt;
+
+            /* Only treat the part after the last colon as a format if it names one, so file names may contain
+             * colons. */
+            size_t fmt_pos = spec.filename.rfind(":");
+            if (fmt_pos != string::npos) {
+                string layer_fmt = spec.filename.substr(fmt_pos+1);
+                transform(layer_fmt.begin(), layer_fmt.end(), layer_fmt.begin(), [](unsigned char c){ return std::tolower(c); });
+                if (is_known_format(layer_fmt)) {
+                    spec.format = layer_fmt;
+                    spec.filename = spec.filename.substr(0, fmt_pos);
+                }
+            }
+        }
+
+    } else {
+        OutputSpec &spec = outputs.emplace_back();
+        if (args["only_groups"])
+            id_match(args["only_groups"], spec.groups);
+        spec.filename = out_f_name;
+        spec.format = fmt;
+    }
+
+    /* Check formats now so we fail before running usvg */
+    for (const auto &spec : outputs) {
+        if (!is_known_format(spec.format)) {
+            cerr << "Error: Unknown output format \"" << spec.format << "\"" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    vector<string> exclude_groups;
+    if (args["exclude_groups"])
+        id_match(args["exclude_groups"], exclude_groups);
+
+    string vectorizer = args["vectorizer"] ? args["vectorizer"].as<string>() : "poisson-disc";
+    /* Check argument */
+    ImageVectorizer *vec = makeVectorizer(vectorizer);
+    if (!vec) {
+        cerr << "Unknown vectorizer \"" << vectorizer << "\"." << endl;
+        print_usage(cerr);
+        return EXIT_FAILURE;
+    }
+    delete vec;
+
+    double min_feature_size = args["min_feature_size"].as<double>(0.1); /* mm */
+    double curve_tolerance = args["curve_tolerance"].as<double>(0.1); /* mm */
+    double drill_test_polsby_popper_tolerance = args["drill_test_polsby_popper_tolerance"].as<double>(0.1);
+    double aperture_rect_test_tolerance = args["aperture_rect_test_tolerance"].as<double>(0.1);
+    double aperture_circle_test_tolerance = args["aperture_circle_test_tolerance"].as<double>(0.1);
+
+
     VectorizerSelectorizer vec_sel(vectorizer, args["vectorizer_map"] ? args["vectorizer_map"].as<string>() : "");
     bool flip_svg_colors = args["flip_svg_color_interpretation"];
     bool pattern_complete_tiles_only = args["pattern_complete_tiles_only"];
     bool use_apertures_for_patterns = args["use_apertures_for_patterns"];
 
-    RenderSettings rset {
-        min_feature_size,
-        curve_tolerance,
-        drill_test_polsby_popper_tolerance,
-        aperture_circle_test_tolerance,
-        aperture_rect_test_tolerance,
-        vec_sel,
-        outline_mode,
-        flip_svg_colors,
-        pattern_complete_tiles_only,
-        use_apertures_for_patterns,
+    /* With --cache-dir, look up every output in the render cache first. We only run usvg and parse the document
+     * once we know at least one of them is missing. */
+    RenderCache *render_cache = nullptr;
+    CacheKey input_key;
+    if (args["cache_dir"]) {
+        bool have_key = false;
+        if (input_data) {
+            input_key.add(*input_data);
+            have_key = true;
+
+        } else if (!in_f_name.empty() && in_f_name != "-") {
+            have_key = input_key.add_file(in_f_name);
+
+        } else {
+            cerr << "Info: Not using render cache for input from stdin" << endl;
+        }
+
+        if (have_key) {
+            add_options_to_key(input_key, args);
+            uintmax_t max_size = args["cache_size"].as<double>(500.0) * 1e6;
+            render_cache = new RenderCache(args["cache_dir"].as<string>(), max_size);
+        }
+    }
+
+    bool is_svg = input_is_svg(args, in_f_name, input_data);
+    RasterImage raster;
+    if (!is_svg && !setup_raster(args, raster)) {
+        if (render_cache) {
+            delete render_cache;
+        }
+        return EXIT_FAILURE;
+    }
+
+    /* Bitmap input is read into memory as-is, stb decodes it straight from this buffer. */
+    string raster_data;
+    bool raster_loaded = false;
+    auto load_raster = [&]() -> bool {
+        if (raster_loaded) {
+            return true;
+        }
+
+        if (input_data) {
+            raster_data = std::move(*input_data);
+
+        } else {
+            istream *in_f = &cin;
+            ifstream in_f_file;
+            if (!in_f_name.empty() && in_f_name != "-") {
+                in_f_file.open(in_f_name, ios::binary);
+                if (!in_f_file) {
+                    cerr << "Cannot open input file \"" << in_f_name << "\"" << endl;
+                    return false;
+                }
+                in_f = &in_f_file;
+            }
+
+            if (!read_stream(*in_f, raster_data)) {
+                cerr << "Error reading input file \"" << in_f_name << "\"" << endl;
+                return false;
+            }
+        }
+
+        raster.data = raster_data.data();
+        raster.size = raster_data.size();
+        return raster_loaded = true;
     };
 
-    SVGDocument doc;
-    //cerr << "Loading temporary file " << frob << endl;
-    ifstream load_f(frob);
-    if (!doc.load(load_f)) {
-        cerr <<  "Error loading input file \"" << in_f_name << "\", exiting." << endl;
+    SVGDocument local_doc;
+    SVGDocument *doc = nullptr;
+    bool doc_failed = false;
+    /* Parse and normalize the document only once, even when rendering several outputs from it. */
+    auto get_doc = [&]() -> SVGDocument * {
+        if (doc || doc_failed) {
+            return doc;
+        }
+
+        if (cache) {
+            string key = document_cache_key(args, in_f_name, input_data);
+            if (!key.empty() && key == cache->key) {
+                if (doc_cached) {
+                    *doc_cached = true;
+                }
+                return doc = cache->doc;
+            }
+
+            if (cache->doc) {
+                delete cache->doc;
+            }
+            cache->doc = new SVGDocument();
+            cache->key = "";
+
+            if (!load_document(args, in_f_name, input_data, *cache->doc)) {
+                doc_failed = true;
+                return nullptr;
+            }
+            cache->key = key;
+            return doc = cache->doc;
+        }
+
+        if (!load_document(args, in_f_name, input_data, local_doc)) {
+            doc_failed = true;
+            return nullptr;
+        }
+        return doc = &local_doc;
+    };
+
+    int rc = EXIT_SUCCESS;
+    string sexp_layer = args["sexp_layer"] ? args["sexp_layer"].as<string>() : "auto";
+    for (const auto &spec : outputs) {
+        ostream *out_f = &std_out;
+        ofstream out_f_file;
+        if (!spec.filename.empty() && spec.filename != "-") {
+            out_f_file.open(spec.filename);
+            if (!out_f_file) {
+                cerr << "Cannot open output file \"" << spec.filename << "\"" << endl;
+                rc = EXIT_FAILURE;
+                break;
+            }
+            out_f = &out_f_file;
+        }
+
+        bool outline_mode = is_outline_format(spec.format);
+        RenderSettings rset {
+            min_feature_size,
+            curve_tolerance,
+            drill_test_polsby_popper_tolerance,
+            aperture_circle_test_tolerance,
+            aperture_rect_test_tolerance,
+            vec_sel,
+            outline_mode,
+            flip_svg_colors,
+            pattern_complete_tiles_only,
+            use_apertures_for_patterns && !(args["output_layers"] && outline_mode),
+        };
+        rset.jobs = args["jobs"] ? args["jobs"].as<int>() : 1;
+        rset.fast_curves = args["fast_curves"];
+
+        string cache_key;
+        if (render_cache) {
+            CacheKey key = input_key;
+            key.add(spec.format);
+            for (const auto &group : spec.groups) {
+                key.add(group);
+            }
+            key.add(string(vectorizer));
+            key.add(rset.m_minimum_feature_size_mm);
+            key.add(rset.curve_tolerance_mm);
+            key.add(rset.fast_curves);
+            key.add(string(geometry_backend().name()));
+            key.add(rset.drill_test_polsby_popper_tolerance);
+            key.add(rset.aperture_circle_test_tolerance);
+            key.add(rset.aperture_rect_test_tolerance);
+            key.add(rset.outline_mode);
+            key.add(rset.flip_color_interpretation);
+            key.add(rset.pattern_complete_tiles_only);
+            key.add(rset.use_apertures_for_patterns);
+            cache_key = key.hex_digest();
+
+            if (render_cache->lookup(cache_key, *out_f)) {
+                continue;
+            }
+        }
+
+        if (is_svg ? !get_doc() : !load_raster()) {
+            rc = EXIT_FAILURE;
+            break;
+        }
+
+        /* When caching, render into memory first so we can write the result to both the cache and the output. */
+        ostringstream cache_buf;
+        {
+            OutputSinkChain chain;
+            if (!chain.setup(spec.format, render_cache ? cache_buf : *out_f, args)) {
+                rc = EXIT_FAILURE;
+                break;
+            }
+
+            IDElementSelector sel;
+            sel.include.insert(spec.groups.begin(), spec.groups.end());
+            sel.exclude.insert(exclude_groups.begin(), exclude_groups.end());
+            unordered_set<string> kicad_layers(gerbolyze::kicad_default_layers.begin(),
+                    gerbolyze::kicad_default_layers.end());
+            if (chain.is_sexp && sexp_layer == "auto") {
+                sel.layers = &kicad_layers;
+            }
+
+            if (is_svg) {
+                doc->render(rset, chain.top(), sel);
+            } else {
+                render_raster_image(rset, chain.top(), raster);
+            }
+        }
+
+        if (render_cache) {
+            string data = cache_buf.str();
+            *out_f << data;
+            render_cache->store(cache_key, data);
+        }
+    }
+
+    if (render_cache) {
+        delete render_cache;
+    }
+
+    if (args["cache_stats"]) {
+        RenderCache::print_stats(cerr);
+        if (doc) {
+            doc->print_clip_cache_stats(cerr);
+        }
+    }
+
+    return rc;
+}
+
+/* Parse and run one conversion given as a list of command line arguments, for --serve and --batch. Reading from stdin
+ * is not allowed since it is taken by the server or the batch manifest, and writing to stdout only if allow_stdout
+ * is set. */
+static int run_arg_list(const vector<string> &arg_list, string *input_data, ostream &std_out, bool allow_stdout,
+        DocumentCache *cache=nullptr, bool *doc_cached=nullptr) {
+    vector<const char *> argv = {prog_name.c_str()};
+    for (const auto &arg : arg_list) {
+        argv.push_back(arg.c_str());
+    }
+
+#ifndef NOTHROW
+    try {
+#endif
+        parser_results args = argparser.parse((int)argv.size(), argv.data());
+
+        if (args["serve"] || args["serve_socket"] || args["batch"] || args["help"] || args["version"]
+                || args["geometry_backend"]) {
+            cerr << "Error: --serve, --serve-socket, --batch, --geometry-backend, --help and --version cannot be used here" << endl;
+            return EXIT_FAILURE;
+        }
+
+        if (!input_data && (args.pos.empty() || string(args.pos[0]) == "-")) {
+            cerr << "Error: An input file must be given" << endl;
+            return EXIT_FAILURE;
+        }
+
+        if (!allow_stdout && !args["output_layers"] && (args.pos.size() < 2 || string(args.pos[1]) == "-")) {
+            cerr << "Error: An output file must be given" << endl;
+            return EXIT_FAILURE;
+        }
+
+        return run_conversion(args, input_data, std_out, cache, doc_cached);
+
+#ifndef NOTHROW
+    } catch (const std::exception &e) {
+        cerr << "Error: " << e.what() << endl;
         return EXIT_FAILURE;
     }
+#endif
+}
+
+static int serve(parser_results &args) {
+    DocumentCache cache;
+
+    auto handler = [&cache](ServerRequest &req, ServerResponse &resp) {
+        ostringstream out;
+        resp.exit_code = run_arg_list(req.args, req.has_input_data ? &req.input_data : nullptr, out, true, &cache,
+                &resp.doc_cached);
+        resp.output_data = out.str();
+    };
 
-    /*
-    cerr << "Selectors:" << endl;
-    for (auto &elem : sel.include) {
-        cerr << " + " << elem << endl;
+    if (args["serve_socket"]) {
+        return serve_unix_socket(args["serve_socket"].as<string>(), handler);
+    } else {
+        return serve_stream(cin, cout, handler);
+    }
+}
+
+/* Split a manifest line into arguments like a shell would, minus all the fancy parts: Whitespace separates arguments,
+ * quotes group them and a backslash escapes the next character. */
+static bool split_args(const string &line, vector<string> &out) {
+    out.clear();
+
+    bool in_arg = false;
+    char quote = 0;
+    for (size_t i=0; i<line.size(); i++) {
+        char c = line[i];
+
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i+1 < line.size()) {
+                out.back() += line[++i];
+            } else {
+                out.back() += c;
+            }
+
+        } else if (c == ' ' || c == '\t' || c == '\r') {
+            in_arg = false;
+
+        } else {
+            if (!in_arg) {
+                out.emplace_back();
+                in_arg = true;
+            }
+
+            if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '\\' && i+1 < line.size()) {
+                out.back() += line[++i];
+            } else {
+                out.back() += c;
+            }
+        }
     }
-    for (auto &elem : sel.exclude) {
-        cerr << " - " << elem << endl;
+
+    return !quote;
+}
+
+struct BatchJob {
+    size_t line_no;
+    vector<string> args;
+    int exit_code = EXIT_FAILURE;
+    double time_ms = 0.0;
+};
+
+/* Run every line of the manifest as a separate conversion, on --jobs worker threads. Each job gets its own document
+ * and sink chain, so there is no shared state between jobs apart from stderr. Conversion options given on the --batch
+ * command line apply to every job. */
+static int run_batch(parser_results &args) {
+    if (!args.pos.empty()) {
+        cerr << "Error: Input and output files for --batch go into the manifest" << endl;
+        return EXIT_FAILURE;
     }
-    */
-    doc.render(rset, *top_sink, sel);
 
-    remove(frob.c_str());
-    remove(barf.c_str());
+    /* These go in front of each line's own arguments, so that the line can override them. --jobs and --cache-stats are
+     * handled by the batch itself, and the geometry backend was already set for the whole process. */
+    vector<string> common_args;
+    for (const auto &def : argparser.definitions) {
+        const string &name = def.name;
+        if (name == "batch" || name == "jobs" || name == "cache_stats" || name == "geometry_backend") {
+            continue;
+        }
 
-    if (flattener) {
-        delete flattener;
+        for (const auto &opt : args[name].all) {
+            common_args.push_back(def.flags.back());
+            if (def.num_args) {
+                common_args.push_back(opt.arg);
+            }
+        }
     }
-    if (dilater) {
-        delete dilater;
+
+    string manifest_name = args["batch"].as<string>();
+    istream *manifest = &cin;
+    ifstream manifest_file;
+    if (manifest_name != "-") {
+        manifest_file.open(manifest_name);
+        if (!manifest_file) {
+            cerr << "Cannot open manifest file \"" << manifest_name << "\"" << endl;
+            return EXIT_FAILURE;
+        }
+        manifest = &manifest_file;
     }
-    if (sink) {
-        delete sink;
+
+    vector<BatchJob> jobs;
+    string line;
+    for (size_t line_no=1; getline(*manifest, line); line_no++) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') {
+            continue;
+        }
+
+        BatchJob &job = jobs.emplace_back();
+        job.line_no = line_no;
+        if (!split_args(line, job.args)) {
+            cerr << "Error: Unterminated quote in manifest line " << line_no << endl;
+            return EXIT_FAILURE;
+        }
+        job.args.insert(job.args.begin(), common_args.begin(), common_args.end());
     }
-    return EXIT_SUCCESS;
+
+#ifndef WASI
+    int num_threads = args["jobs"] ? args["jobs"].as<int>() : (int)thread::hardware_concurrency();
+    num_threads = max(1, min(num_threads, (int)jobs.size()));
+    mutex status_mutex;
+#else
+    int num_threads = 1;
+#endif
+
+    auto t_start = chrono::steady_clock::now();
+    atomic<size_t> next_job {0};
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next_job++) < jobs.size()) {
+            BatchJob &job = jobs[i];
+            auto t_job = chrono::steady_clock::now();
+
+            ostringstream out;
+            job.exit_code = run_arg_list(job.args, nullptr, out, false);
+            job.time_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t_job).count();
+
+#ifndef WASI
+            lock_guard<mutex> lock(status_mutex);
+#endif
+            cerr << (job.exit_code ? "[FAIL] " : "[ok] ") << manifest_name << ":" << job.line_no
+                << " (" << fixed << setprecision(1) << job.time_ms << " ms)" << defaultfloat << endl;
+        }
+    };
+
+#ifndef WASI
+    vector<thread> pool;
+    for (int i=1; i<num_threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : pool) {
+        t.join();
+    }
+#else
+    /* No threads on wasi */
+    worker();
+#endif
+
+    size_t failed = 0;
+    for (const auto &job : jobs) {
+        if (job.exit_code) {
+            failed++;
+        }
+    }
+
+    double total_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count();
+    cerr << "Batch: " << jobs.size() - failed << " ok, " << failed << " failed, " << fixed << setprecision(1)
+        << total_ms << " ms on " << num_threads << " thread(s)" << defaultfloat << endl;
+    for (const auto &job : jobs) {
+        if (job.exit_code) {
+            cerr << "Failed: " << manifest_name << ":" << job.line_no << endl;
+        }
+    }
+
+    if (args["cache_stats"]) {
+        RenderCache::print_stats(cerr);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+int main(int argc, char **argv) {
+    prog_name = argv[0];
+
+#ifndef NOFORK
+    /* usvg subprocesses may die before reading all of their input. Writing to their stdin then has to fail with EPIPE
+     * instead of killing us. This is process-wide, so set it once here instead of around every write, since with
+     * --jobs, --batch or --serve several threads may be talking to subprocesses at once. */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    argagg::parser_results args;
+    args = argparser.parse(argc, argv);
+
+    if (args["help"]) {
+        print_usage(cerr);
+        return EXIT_SUCCESS;
+    }
+
+    if (args["version"]) {
+        cerr << lib_version << endl;
+        return EXIT_SUCCESS;
+    }
+
+    /* The backend is global, so it can only be chosen once for the whole process. */
+    if (args["geometry_backend"]) {
+        string name = args["geometry_backend"].as<string>();
+        if (!set_geometry_backend(name)) {
+            cerr << "Error: Unknown geometry backend \"" << name << "\". Available backends:";
+            for (const auto &avail : geometry_backend_names()) {
+                cerr << " " << avail;
+            }
+            cerr << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (args["serve"] || args["serve_socket"]) {
+        return serve(args);
+    }
+
+    if (args["batch"]) {
+        return run_batch(args);
+    }
+
+    return run_conversion(args, nullptr, cout);
+}
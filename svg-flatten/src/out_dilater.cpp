@@ -25,26 +25,38 @@
 #include <clipper.hpp>
 #include <svg_import_defs.h>
 #include <svg_geom.h>
-#include "polylinecombine.hpp"
+#include <geom_backend.h>
 
 using namespace gerbolyze;
 using namespace std;
 
+/* Merge mode buckets per side of the document, and the number of points we collect before we start writing out
+ * buckets early. */
+static constexpr int merge_grid_size = 16;
+static constexpr size_t merge_max_points = 1 << 18;
+
 void Dilater::header(d2p origin, d2p size) {
+    m_origin = origin;
+    m_size = size;
     m_sink.header(origin, size);
 }
 
 void Dilater::footer() {
+    flush();
     m_sink.footer();
 }
 
 Dilater &Dilater::operator<<(const LayerNameToken &layer_name) {
+    flush();
     m_sink << layer_name;
 
     return *this;
 }
 
 Dilater &Dilater::operator<<(GerberPolarityToken pol) {
+    /* Polygons we are still holding back must go out before the token, in the polarity they came in with. */
+    flush();
+
     m_current_polarity = pol;
     m_sink << pol;
 
@@ -52,39 +64,186 @@ Dilater &Dilater::operator<<(GerberPolarityToken pol) {
 }
 
 Dilater &Dilater::operator<<(const Polygon &poly) {
-    ClipperLib::Path poly_c;
-    for (auto &p : poly) {
-        poly_c.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+    return *this << PolygonView(poly);
+}
+
+Dilater &Dilater::operator<<(const PolygonView &poly) {
+    ClipperLib::Paths poly_c(1);
+    poly_c[0].reserve(poly.size());
+    for (d2p p : poly) {
+        poly_c[0].push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+    }
+
+    /* Polygons drawn with an aperture are stroked outlines, which we cannot merge with anything. */
+    if (!m_merge || m_aperture_set) {
+        dilate(poly_c);
+        return *this;
+    }
+
+    if (poly_c[0].size() < 3) {
+        return *this;
+    }
+
+    /* ClipperOffset takes the orientation of the polygon with the lowest point for all of them and treats everything
+     * oriented the other way as a hole. */
+    if (!ClipperLib::Orientation(poly_c[0])) {
+        ClipperLib::ReversePath(poly_c[0]);
+    }
+
+    if (m_buckets.empty()) {
+        m_buckets.resize(merge_grid_size * merge_grid_size);
+        m_bucket_points.resize(m_buckets.size(), 0);
+        m_bucket_spills.resize(m_buckets.size(), false);
+    }
+
+    /* Put the polygon into every cell its dilated bounding box overlaps, with a little slack for rounding. Each cell's
+     * result is later cut to the cell, so that the pieces of outlines spanning several cells abut instead of overlapping.
+     */
+    ClipperLib::IntRect bounds = get_paths_bounds(poly_c);
+    double reach = fabs(m_dilation) + 2.0 / clipper_scale;
+    auto cell = [](double v, double origin, double size) {
+        if (!(size > 0)) {
+            return 0;
+        }
+        return (int)fmax(0, fmin(merge_grid_size - 1, floor((v - origin) / size * merge_grid_size)));
+    };
+    int x0 = cell(bounds.left / clipper_scale - reach, m_origin[0], m_size[0]);
+    int x1 = cell(bounds.right / clipper_scale + reach, m_origin[0], m_size[0]);
+    int y0 = cell(bounds.top / clipper_scale - reach, m_origin[1], m_size[1]);
+    int y1 = cell(bounds.bottom / clipper_scale + reach, m_origin[1], m_size[1]);
+    bool spills = x0 != x1 || y0 != y1;
+
+    for (int y=y0; y<=y1; y++) {
+        for (int x=x0; x<=x1; x++) {
+            size_t i = y * merge_grid_size + x;
+            m_num_points += poly_c[0].size();
+            m_bucket_points[i] += poly_c[0].size();
+            m_bucket_spills[i] = m_bucket_spills[i] || spills;
+            m_buckets[i].push_back(poly_c[0]);
+        }
     }
 
-    ClipperLib::ClipperOffset offx;
-    offx.ArcTolerance = 0.05 * clipper_scale; /* 10µm; TODO: Make this configurable */
-    offx.AddPath(poly_c, ClipperLib::jtRound, ClipperLib::etClosedPolygon);
+    if (m_num_points > merge_max_points) {
+        flush_bucket(max_element(m_bucket_points.begin(), m_bucket_points.end()) - m_bucket_points.begin());
+    }
+
+    return *this;
+}
+
+static void add_subtree_contours(const ClipperLib::PolyNode &nod, ClipperLib::Paths &out) {
+    out.push_back(nod.Contour);
+    for (const auto *child : nod.Childs) {
+        add_subtree_contours(*child, out);
+    }
+}
+
+void Dilater::dilate(const ClipperLib::Paths &paths, const ClipperLib::IntRect *clip) {
     double dilation = m_dilation;
     if (m_current_polarity == GRB_POL_CLEAR) {
         dilation = -dilation;
     }
 
-    ClipperLib::PolyTree solution; 
-    offx.Execute(solution, dilation * clipper_scale);
+    /* ClipperOffset offsets every path on its own before it merges the results. Growing polygons that way gives the
+     * same as growing their union, but when shrinking, the edges of one polygon that lie inside another one would eat
+     * into it. */
+    const ClipperLib::Paths *input = &paths;
+    ClipperLib::Paths merged;
+    if (dilation < 0 && paths.size() > 1) {
+        geometry_backend().boolean_op(ClipperLib::ctUnion, paths, {}, merged);
+        input = &merged;
+    }
+
+    GeomTree solution; 
+    geometry_backend().offset({{*input, ClipperLib::jtRound, ClipperLib::etClosedPolygon}}, dilation * clipper_scale,
+            /* miter limit */ 2.0, 0.05 * clipper_scale /* 10µm; TODO: Make this configurable */, solution);
 
     ClipperLib::Paths c_nice_polys;
-    dehole_polytree(solution, c_nice_polys);
+    if (clip) {
+        /* Most outlines lie entirely inside or entirely outside of the cell. Only cut the few that cross its border, and
+         * take them out of the tree before we dehole what is left. */
+        ClipperLib::Paths crossing;
+        vector<ClipperLib::PolyNode *> inside;
+        for (auto *nod : solution.Childs) {
+            ClipperLib::IntRect bounds = get_paths_bounds({nod->Contour});
+            if (rect_contains(*clip, bounds)) {
+                inside.push_back(nod);
+            } else if (!rects_disjoint(*clip, bounds)) {
+                add_subtree_contours(*nod, crossing);
+            }
+        }
+        solution.Childs.swap(inside);
 
-    for (auto &nice_poly : c_nice_polys) {
-        Polygon new_poly;
-        for (auto &p : nice_poly) {
-            new_poly.push_back({
-                    (double)p.X / clipper_scale,
-                    (double)p.Y / clipper_scale });
+        if (!crossing.empty()) {
+            ClipperLib::Path rect = {{clip->left, clip->top}, {clip->right, clip->top}, {clip->right, clip->bottom},
+                {clip->left, clip->bottom}};
+            GeomTree cut;
+            geometry_backend().boolean_op(ClipperLib::ctIntersection, crossing, {rect}, cut);
+            dehole_polytree(cut, c_nice_polys);
         }
-        m_sink << new_poly;
     }
 
-    return *this;
+    dehole_polytree(solution, c_nice_polys);
+    m_sink << c_nice_polys;
+}
+
+void Dilater::flush_bucket(size_t i) {
+    if (m_buckets[i].empty()) {
+        return;
+    }
+
+    if (m_bucket_spills[i]) {
+        auto grid_line = [](int k, double origin, double size) {
+            return (ClipperLib::cInt)round((origin + size * k / merge_grid_size) * clipper_scale);
+        };
+
+        /* The outermost cells also hold everything beyond the document's edges. */
+        ClipperLib::IntRect content = get_paths_bounds(m_buckets[i]);
+        ClipperLib::cInt margin = (ClipperLib::cInt)ceil(fabs(m_dilation) * clipper_scale) + 1;
+        int x = i % merge_grid_size, y = i / merge_grid_size;
+
+        ClipperLib::IntRect rect;
+        rect.left = grid_line(x, m_origin[0], m_size[0]);
+        rect.right = grid_line(x+1, m_origin[0], m_size[0]);
+        rect.top = grid_line(y, m_origin[1], m_size[1]);
+        rect.bottom = grid_line(y+1, m_origin[1], m_size[1]);
+        if (x == 0)
+            rect.left = min(rect.left, content.left - margin);
+        if (x == merge_grid_size-1)
+            rect.right = max(rect.right, content.right + margin);
+        if (y == 0)
+            rect.top = min(rect.top, content.top - margin);
+        if (y == merge_grid_size-1)
+            rect.bottom = max(rect.bottom, content.bottom + margin);
+
+        dilate(m_buckets[i], &rect);
+
+    } else {
+        dilate(m_buckets[i]);
+    }
+
+    ClipperLib::Paths().swap(m_buckets[i]);
+    m_num_points -= m_bucket_points[i];
+    m_bucket_points[i] = 0;
+    m_bucket_spills[i] = false;
+}
+
+/* Offset each grid cell's polygons in one go. Overlapping polygons get merged by ClipperOffset. We do not offset
+ * everything at once since clipper's run time grows much faster than linearly with the size of the merged outlines and
+ * the number of holes in them. Instead, polygons near a cell's border go into all cells they reach, and those cells
+ * cut their result to the cell. Merged outlines spanning several cells thus come out as several pieces that meet
+ * along the cell borders. The only overlaps left come from cells that we had to write out early to bound memory use.
+ */
+void Dilater::flush() {
+    for (size_t i=0; i<m_buckets.size(); i++) {
+        flush_bucket(i);
+    }
 }
 
 Dilater &Dilater::operator<<(const ApertureToken &ap) {
+    /* The sink would draw held back fills as stroked outlines after this */
+    flush();
+    m_aperture_set = ap.m_has_aperture;
+
     if (ap.m_has_aperture)
         m_sink << ApertureToken(ap.m_size + 2*m_dilation);
     else
@@ -93,6 +252,18 @@ Dilater &Dilater::operator<<(const ApertureToken &ap) {
 }
 
 Dilater &Dilater::operator<<(const FlashToken &tok) {
+    flush();
     m_sink << tok;
     return *this;
 }
+
+Dilater &Dilater::operator<<(const LookaheadToken &tok) {
+    /* In merge mode, we are still holding back polygons that may lie anywhere */
+    if (m_merge) {
+        return *this;
+    }
+
+    double d = fabs(m_dilation);
+    m_sink << LookaheadToken({tok.m_min[0] - d, tok.m_min[1] - d}, {tok.m_max[0] + d, tok.m_max[1] + d});
+    return *this;
+}
@@ -21,45 +21,415 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <unordered_map>
 #include <gerbolyze.hpp>
 #include <svg_import_defs.h>
 #include <svg_geom.h>
-#include "polylinecombine.hpp"
+#include <geom_backend.h>
 
 using namespace gerbolyze;
 using namespace std;
 
-static void polygon_to_cavc (const Polygon &in, cavc::Polyline<double> &out) {
-    for (auto &p : in) {
-        out.addVertex(p[0], p[1], 0);
+static void polygon_to_clipper (const PolygonView &in, ClipperLib::Path &out) {
+    out.reserve(in.size());
+    for (d2p p : in) {
+        out.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
     }
-    out.isClosed() = true; /* sic! */
 }
 
-static void cavc_to_polygon (const cavc::Polyline<double> &in, Polygon &out) {
-    for (auto &p : in.vertexes()) {
-        out.emplace_back(d2p{p.x(), p.y()});
-    }
+namespace {
+    /* Uniform grid over the bounding boxes of a list of polygons, so that we only have to look at polygons that might
+     * actually overlap a query box. Entries are numbered in the order they were added. */
+    class BoundsGrid {
+    public:
+        void set_extents(d2p origin, d2p size) {
+            grid_origin = {(ClipperLib::cInt)round(origin[0] * clipper_scale), (ClipperLib::cInt)round(origin[1] * clipper_scale)};
+            double max_size = fmax(size[0], size[1]);
+            if (max_size > 0 && isfinite(max_size)) {
+                cell_size = fmax(1.0, max_size * clipper_scale / grid_cells);
+            }
+
+            vector<ClipperLib::IntRect> old_bounds;
+            old_bounds.swap(m_bounds);
+            clear();
+            for (const auto &box : old_bounds) {
+                add(box);
+            }
+        }
+
+        size_t add(const ClipperLib::IntRect &box) {
+            size_t i = m_bounds.size();
+            m_bounds.push_back(box);
+
+            long long x0, y0, x1, y1;
+            cell_range(box, x0, y0, x1, y1);
+            if ((x1 - x0 + 1) * (y1 - y0 + 1) > large_poly_cells) {
+                large_polys.push_back(i);
+                return i;
+            }
+
+            for (long long y=y0; y<=y1; y++) {
+                for (long long x=x0; x<=x1; x++) {
+                    grid[cell_key(x, y)].push_back(i);
+                }
+            }
+            return i;
+        }
+
+        const ClipperLib::IntRect &bounds(size_t i) const { return m_bounds[i]; }
+        size_t size() const { return m_bounds.size(); }
+
+        /* Indices of all entries whose bounding boxes overlap box and for which keep(index) is true, in ascending
+         * order */
+        template<typename F>
+        void find_overlapping(const ClipperLib::IntRect &box, vector<size_t> &out, F keep) {
+            out.clear();
+
+            long long x0, y0, x1, y1;
+            cell_range(box, x0, y0, x1, y1);
+            if ((x1 - x0 + 1) * (y1 - y0 + 1) > max_query_cells) {
+                for (size_t i=0; i<m_bounds.size(); i++) {
+                    if (!rects_disjoint(box, m_bounds[i]) && keep(i)) {
+                        out.push_back(i);
+                    }
+                }
+                return;
+            }
+
+            query_stamp++;
+            query_marks.resize(m_bounds.size(), 0);
+            auto visit = [&](const vector<size_t> &candidates) {
+                for (size_t i : candidates) {
+                    if (query_marks[i] == query_stamp) {
+                        continue;
+                    }
+                    query_marks[i] = query_stamp;
+
+                    if (!rects_disjoint(box, m_bounds[i]) && keep(i)) {
+                        out.push_back(i);
+                    }
+                }
+            };
+
+            visit(large_polys);
+            for (long long y=y0; y<=y1; y++) {
+                for (long long x=x0; x<=x1; x++) {
+                    auto it = grid.find(cell_key(x, y));
+                    if (it != grid.end()) {
+                        visit(it->second);
+                    }
+                }
+            }
+            sort(out.begin(), out.end());
+        }
+
+        void clear() {
+            m_bounds.clear();
+            grid.clear();
+            large_polys.clear();
+            query_marks.clear();
+        }
+
+    private:
+        /* A grid cell is this fraction of the document's size. Polygons spanning more than large_poly_cells cells are
+         * not put into the grid, but checked against every query. Queries spanning more than max_query_cells cells just
+         * scan all polygons. */
+        static constexpr double grid_cells = 256;
+        static constexpr long long large_poly_cells = 64;
+        static constexpr long long max_query_cells = 4096;
+
+        void cell_range(const ClipperLib::IntRect &box, long long &x0, long long &y0, long long &x1, long long &y1) const {
+            auto cell = [this](ClipperLib::cInt v, ClipperLib::cInt origin) {
+                return (long long)fmax(-1e9, fmin(1e9, floor((double)(v - origin) / cell_size)));
+            };
+            x0 = cell(box.left, grid_origin.X);
+            y0 = cell(box.top, grid_origin.Y);
+            x1 = cell(box.right, grid_origin.X);
+            y1 = cell(box.bottom, grid_origin.Y);
+        }
+
+        static uint64_t cell_key(long long x, long long y) {
+            return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+        }
+
+        vector<ClipperLib::IntRect> m_bounds;
+        ClipperLib::IntPoint grid_origin {0, 0};
+        double cell_size = clipper_scale; /* 1mm until we get a header */
+        unordered_map<uint64_t, vector<size_t>> grid;
+        vector<size_t> large_polys;
+        vector<uint32_t> query_marks;
+        uint32_t query_stamp = 0;
+    };
 }
 
 namespace gerbolyze {
+    /* The dark polygons we have accumulated so far, indexed by their bounding boxes so that we only have to subtract
+     * clear polygons from the dark polygons they might actually overlap. Removed polygons leave an empty slot behind
+     * that stays in the index until the next compaction. */
     class Flattener_D {
     public:
-        vector<cavc::Polyline<double>> dark_polys;
-        vector<cavc::Polyline<double>> clear_polys;
+        vector<ClipperLib::Path> dark_polys;
+        BoundsGrid dark_index;
+        ClipperLib::Paths clear_polys; /* since the last polarity change */
+
+        void set_extents(d2p origin, d2p size) {
+            dark_index.set_extents(origin, size);
+
+            tile_origin = {(ClipperLib::cInt)round(origin[0] * clipper_scale), (ClipperLib::cInt)round(origin[1] * clipper_scale)};
+            double max_size = fmax(size[0], size[1]);
+            if (max_size > 0 && isfinite(max_size)) {
+                tile_size = fmax(1.0, max_size * clipper_scale / num_tiles);
+            }
+            reset_tiles();
+        }
+
+        void add_dark_polygon(ClipperLib::Path &&poly) {
+            if (poly.size() < 3) {
+                return;
+            }
+
+            size_t i = dark_index.add(get_paths_bounds({poly}));
+            dark_polys.push_back(std::move(poly));
+            if (tiled) {
+                route(i);
+            }
+        }
+
+        void remove_dark_polygon(size_t i) {
+            dark_polys[i] = ClipperLib::Path();
+            num_removed++;
+        }
+
+        /* Indices of all dark polygons whose bounding boxes overlap box, in ascending order */
+        void find_overlapping(const ClipperLib::IntRect &box, vector<size_t> &out) {
+            dark_index.find_overlapping(box, out, [this](size_t i) { return !dark_polys[i].empty(); });
+        }
+
+        /* Drop the slots of removed polygons once they make up most of the list */
+        void maybe_compact() {
+            if (num_removed < 1024 || num_removed < dark_polys.size() / 2) {
+                return;
+            }
+
+            vector<ClipperLib::IntRect> bounds;
+            size_t j = 0;
+            for (size_t i=0; i<dark_polys.size(); i++) {
+                if (!dark_polys[i].empty()) {
+                    if (i != j) {
+                        dark_polys[j] = std::move(dark_polys[i]);
+                    }
+                    bounds.push_back(dark_index.bounds(i));
+                    j++;
+                }
+            }
+            dark_polys.resize(j);
+
+            dark_index.clear();
+            for (const auto &box : bounds) {
+                dark_index.add(box);
+            }
+            num_removed = 0;
+
+            if (tiled) {
+                for (auto &tile : tiles) {
+                    vector<size_t>().swap(tile);
+                }
+                large_polys.clear();
+                for (size_t i=0; i<dark_polys.size(); i++) {
+                    route(i);
+                }
+            }
+        }
+
+        void clear() {
+            dark_polys.clear();
+            dark_index.clear();
+            clear_polys.clear();
+            num_removed = 0;
+            reset_tiles();
+        }
+
+        /* Tiled mode. We split the document into tiles and route each dark polygon to the tiles its bounding box
+         * overlaps. LookaheadTokens shrink the box later polygons can still reach. Whenever a tile falls out of that box,
+         * we hand out the dark polygons listed in it that no later polygon can reach anymore. Each tile falls out at most
+         * once per layer, so this is linear in the number of polygons no matter how many LookaheadTokens we get. */
+        void set_tiled(bool enable) {
+            tiled = enable;
+            reset_tiles();
+        }
+
+        /* Narrow the reachable area down to box (empty if left > right). Returns true if any tiles fell out of it. */
+        bool update_lookahead(ClipperLib::IntRect box) {
+            if (has_lookahead) {
+                box = {max(box.left, lookahead.left), max(box.top, lookahead.top),
+                    min(box.right, lookahead.right), min(box.bottom, lookahead.bottom)};
+            }
+            bool empty = box.left > box.right || box.top > box.bottom;
+            lookahead = box;
+            has_lookahead = true;
+
+            int x0 = num_tiles, y0 = num_tiles, x1 = -1, y1 = -1;
+            if (!empty) {
+                x0 = tile_index(box.left, tile_origin.X);
+                y0 = tile_index(box.top, tile_origin.Y);
+                x1 = tile_index(box.right, tile_origin.X);
+                y1 = tile_index(box.bottom, tile_origin.Y);
+            }
+            /* The box only ever shrinks, but stay on the safe side */
+            x0 = max(x0, reach_x0); y0 = max(y0, reach_y0);
+            x1 = min(x1, reach_x1); y1 = min(y1, reach_y1);
+
+            if (x0 == reach_x0 && y0 == reach_y0 && x1 == reach_x1 && y1 == reach_y1) {
+                return false;
+            }
+
+            new_x0 = x0; new_y0 = y0;
+            new_x1 = x1; new_y1 = y1;
+            return true;
+        }
+
+        /* After update_lookahead returned true, move the polygons in the tiles that fell out that nothing can reach
+         * anymore to out. */
+        void take_unreachable(vector<ClipperLib::Path> &out) {
+            out.clear();
+            const auto &box = lookahead;
+            bool empty = box.left > box.right || box.top > box.bottom;
+
+            auto take = [&](vector<size_t> &candidates) {
+                for (size_t i : candidates) {
+                    if (dark_polys[i].empty()) { /* removed, or already taken through another tile */
+                        continue;
+                    }
+
+                    if (empty || rects_disjoint(dark_index.bounds(i), box)) {
+                        out.push_back(std::move(dark_polys[i]));
+                        remove_dark_polygon(i);
+                    }
+                }
+            };
+
+            for (int y=reach_y0; y<=reach_y1; y++) {
+                for (int x=reach_x0; x<=reach_x1; x++) {
+                    if (x >= new_x0 && x <= new_x1 && y >= new_y0 && y <= new_y1) {
+                        continue;
+                    }
+
+                    auto &tile = tiles[y*num_tiles + x];
+                    take(tile);
+                    vector<size_t>().swap(tile);
+                }
+            }
+            take(large_polys);
+
+            reach_x0 = new_x0; reach_y0 = new_y0;
+            reach_x1 = new_x1; reach_y1 = new_y1;
+        }
+
+    private:
+        /* Tiles per side of the document. Polygons spanning more than large_poly_tiles tiles are not put into tiles,
+         * but checked every time any tile falls out. */
+        static constexpr int num_tiles = 64;
+        static constexpr long long large_poly_tiles = 64;
+
+        int tile_index(ClipperLib::cInt v, ClipperLib::cInt origin) const {
+            /* Everything outside of the document goes into the tiles along its edges */
+            return (int)fmax(0, fmin(num_tiles - 1, floor((double)(v - origin) / tile_size)));
+        }
+
+        void route(size_t i) {
+            const auto &box = dark_index.bounds(i);
+            int x0 = tile_index(box.left, tile_origin.X), y0 = tile_index(box.top, tile_origin.Y);
+            int x1 = tile_index(box.right, tile_origin.X), y1 = tile_index(box.bottom, tile_origin.Y);
+            if ((long long)(x1 - x0 + 1) * (y1 - y0 + 1) > large_poly_tiles) {
+                large_polys.push_back(i);
+                return;
+            }
+
+            for (int y=y0; y<=y1; y++) {
+                for (int x=x0; x<=x1; x++) {
+                    tiles[y*num_tiles + x].push_back(i);
+                }
+            }
+        }
+
+        void reset_tiles() {
+            tiles.clear();
+            large_polys.clear();
+            if (tiled) {
+                tiles.resize(num_tiles * num_tiles);
+            }
+            has_lookahead = false;
+            reach_x0 = reach_y0 = 0;
+            reach_x1 = reach_y1 = num_tiles - 1;
+        }
 
-        void add_dark_polygon(const Polygon &in) {
-            polygon_to_cavc(in, dark_polys.emplace_back());
+        bool tiled = false;
+        size_t num_removed = 0;
+
+        ClipperLib::IntPoint tile_origin {0, 0};
+        double tile_size = 10 * clipper_scale; /* 1cm until we get a header */
+        vector<vector<size_t>> tiles; /* dark polygon indices, row by row */
+        vector<size_t> large_polys;
+        ClipperLib::IntRect lookahead;
+        bool has_lookahead = false;
+        int reach_x0 = 0, reach_y0 = 0, reach_x1 = num_tiles - 1, reach_y1 = num_tiles - 1; /* tiles still reachable */
+        int new_x0 = 0, new_y0 = 0, new_x1 = num_tiles - 1, new_y1 = num_tiles - 1; /* ...after take_unreachable */
+    };
+
+    /* The whole polygon stream of the current layer in drawing order, for SweepFlattener, indexed by bounding boxes.
+     * A polygon's index is its position in the stream. */
+    class SweepFlattener_D {
+    public:
+        vector<ClipperLib::Path> polys;
+        vector<bool> dark;
+        BoundsGrid index;
+
+        void clear() {
+            polys.clear();
+            dark.clear();
+            index.clear();
         }
 
-        void add_clear_polygon(const Polygon &in) {
-            polygon_to_cavc(in, clear_polys.emplace_back());
+        /* Subtract the polygons in above that reach into region from polygon i, and append what is left of polygon i
+         * inside region to out. If cut is false, region must contain all of polygon i. */
+        void subtract_above(size_t i, const ClipperLib::IntRect &region, const vector<size_t> &above, bool cut,
+                ClipperLib::Paths &out) {
+            ClipperLib::Paths clip;
+            for (size_t j : above) {
+                const ClipperLib::IntRect &b = index.bounds(j);
+                if (rects_disjoint(b, region)) {
+                    continue;
+                }
+
+                /* Rectangles covering the whole region are common when later elements paint over earlier ones */
+                ClipperLib::IntRect rect;
+                if (rect_contains(b, region) && paths_are_rect({polys[j]}, rect)) {
+                    return;
+                }
+                clip.push_back(polys[j]);
+            }
+
+            ClipperLib::Paths subject = {polys[i]};
+            if (cut) {
+                ClipperLib::Path region_path = {{region.left, region.top}, {region.right, region.top},
+                    {region.right, region.bottom}, {region.left, region.bottom}};
+                geometry_backend().boolean_op(ClipperLib::ctIntersection, subject, {region_path}, subject);
+            }
+
+            GeomTree ptree;
+            geometry_backend().boolean_op(ClipperLib::ctDifference, subject, clip, ptree);
+            dehole_polytree(ptree, out);
         }
+
+        /* Clipper's run time grows with the square of the number of edges crossing a scanline, so we cut polygons
+         * lying under more than this many others into tiles and clip each tile on its own. */
+        static constexpr size_t max_clip = 64;
     };
 }
 
-Flattener::Flattener(PolygonSink &sink) : m_sink(sink) {
+Flattener::Flattener(PolygonSink &sink, bool tiled) : m_sink(sink), m_tiled(tiled) {
     d = new Flattener_D();
+    d->set_tiled(tiled);
 }
 
 Flattener::~Flattener() {
@@ -67,69 +437,70 @@ Flattener::~Flattener() {
 }
 
 void Flattener::header(d2p origin, d2p size) {
+    d->set_extents(origin, size);
     m_sink.header(origin, size);
 }
 
+/* Collect the outline of a top-level polygon of a clipper PolyTree and all of its descendants */
+static void collect_region(const ClipperLib::PolyNode &node, ClipperLib::Paths &out) {
+    out.push_back(node.Contour);
+    for (const auto *child : node.Childs) {
+        collect_region(*child, out);
+    }
+}
+
+/* Subtract all clear polygons since the last polarity change from the dark polygons in one go. We first union the clear
+ * polygons, then subtract each connected region of that union from the dark polygons it overlaps. Each affected dark
+ * polygon only goes through clipper once, no matter how many clear polygons overlap it. */
 void Flattener::render_out_clear_polys() {
-    for (auto &sub : d->clear_polys) {
-        vector<cavc::Polyline<double>> new_dark_polys;
-        new_dark_polys.reserve(d->dark_polys.size());
+    if (d->clear_polys.empty()) {
+        return;
+    }
 
-        for (cavc::Polyline<double> cavc_in : d->dark_polys) {
-            auto res = cavc::combinePolylines(cavc_in, sub, cavc::PlineCombineMode::Exclude);
+    GeomTree clear_union;
+    geometry_backend().boolean_op(ClipperLib::ctUnion, d->clear_polys, {}, clear_union);
+    d->clear_polys.clear();
 
-            if (res.subtracted.size() == 0) {
-                for (auto &rem : res.remaining) {
-                    new_dark_polys.push_back(std::move(rem));
-                }
+    /* Regions of the union along with the dark polygons they overlap */
+    vector<ClipperLib::Paths> regions;
+    vector<pair<size_t, size_t>> affected; /* (dark polygon, region) */
+    vector<size_t> overlapping;
+    for (const auto *node : clear_union.Childs) {
+        ClipperLib::Paths &region = regions.emplace_back();
+        collect_region(*node, region);
+
+        d->find_overlapping(get_paths_bounds({node->Contour}), overlapping);
+        for (size_t i : overlapping) {
+            affected.emplace_back(i, regions.size() - 1);
+        }
+    }
+    sort(affected.begin(), affected.end());
 
-            } else { /* custom one-hole deholing code */
-                assert (res.remaining.size() == 1);
-                assert (res.subtracted.size() == 1);
-
-                auto &rem = res.remaining[0];
-                auto &sub = res.subtracted[0];
-                auto bbox = getExtents(rem);
-
-                cavc::Polyline<double> quad;
-                quad.addVertex(bbox.xMin, bbox.yMin, 0);
-                if (sub.vertexes()[0].x() < sub.vertexes()[1].x()) {
-                    quad.addVertex(sub.vertexes()[0]);
-                    quad.addVertex(sub.vertexes()[1]);
-                } else {
-                    quad.addVertex(sub.vertexes()[1]);
-                    quad.addVertex(sub.vertexes()[0]);
-                }
-                quad.addVertex(bbox.xMax, bbox.yMin, 0);
-                quad.isClosed() = true; /* sic! */
+    ClipperLib::Paths clip;
+    ClipperLib::Paths remaining;
+    for (size_t k=0; k<affected.size(); ) {
+        size_t i = affected[k].first;
 
-                auto res2 = cavc::combinePolylines(rem, quad, cavc::PlineCombineMode::Exclude);
-                assert (res2.subtracted.size() == 0);
+        clip.clear();
+        for (; k<affected.size() && affected[k].first == i; k++) {
+            const auto &region = regions[affected[k].second];
+            clip.insert(clip.end(), region.begin(), region.end());
+        }
 
-                for (auto &rem : res2.remaining) {
-                    auto res3 = cavc::combinePolylines(rem, sub, cavc::PlineCombineMode::Exclude);
-                    assert (res3.subtracted.size() == 0);
-                    for (auto &p : res3.remaining) {
-                        new_dark_polys.push_back(std::move(p));
-                    }
-                }
+        /* Nonzero fill is fine for both, the clip is clipper's output and the dark polygon is simple. */
+        GeomTree ptree;
+        geometry_backend().boolean_op(ClipperLib::ctDifference, {d->dark_polys[i]}, clip, ptree);
 
-                auto res4 = cavc::combinePolylines(rem, quad, cavc::PlineCombineMode::Intersect);
-                assert (res4.subtracted.size() == 0);
+        /* Clear polygons can punch any number of holes into a dark polygon. Cut those into its outline. */
+        remaining.clear();
+        dehole_polytree(ptree, remaining);
 
-                for (auto &rem : res4.remaining) {
-                    auto res5 = cavc::combinePolylines(rem, sub, cavc::PlineCombineMode::Exclude);
-                    assert (res5.subtracted.size() == 0);
-                    for (auto &p : res5.remaining) {
-                        new_dark_polys.push_back(std::move(p));
-                    }
-                }
-            }
+        d->remove_dark_polygon(i);
+        for (auto &rem : remaining) {
+            d->add_dark_polygon(std::move(rem));
         }
-
-        d->dark_polys = std::move(new_dark_polys);
     }
-    d->clear_polys.clear();
+    d->maybe_compact();
 }
 
 Flattener &Flattener::operator<<(GerberPolarityToken pol) {
@@ -162,13 +533,54 @@ Flattener &Flattener::operator<<(const ApertureToken &tok) {
     return *this;
 }
 
+Flattener &Flattener::operator<<(const LookaheadToken &tok) {
+    if (!m_tiled) {
+        return *this;
+    }
+
+    ClipperLib::IntRect box {
+        (ClipperLib::cInt)floor(tok.m_min[0] * clipper_scale), (ClipperLib::cInt)floor(tok.m_min[1] * clipper_scale),
+        (ClipperLib::cInt)ceil(tok.m_max[0] * clipper_scale), (ClipperLib::cInt)ceil(tok.m_max[1] * clipper_scale)};
+    if (!d->update_lookahead(box)) {
+        return *this;
+    }
+
+    /* Clear polygons we are still holding back might cut into the dark polygons we are about to write out */
+    render_out_clear_polys();
+
+    vector<ClipperLib::Path> done;
+    d->take_unreachable(done);
+    if (done.empty()) {
+        return *this;
+    }
+
+    m_sink << GRB_POL_DARK;
+    for (const auto &path : done) {
+        m_sink << path;
+    }
+    m_sink << m_current_polarity;
+
+    d->maybe_compact();
+    return *this;
+}
+
 Flattener &Flattener::operator<<(const Polygon &poly) {
+    return *this << PolygonView(poly);
+}
+
+Flattener &Flattener::operator<<(const PolygonView &poly) {
+    ClipperLib::Path path;
+    polygon_to_clipper(poly, path);
+
     if (m_current_polarity == GRB_POL_DARK) {
-        d->add_dark_polygon(poly);
+        d->add_dark_polygon(std::move(path));
 
-    } else { /* clear */
-        d->add_clear_polygon(poly);
-        render_out_clear_polys();
+    } else { /* clear. Collect until the next polarity change. */
+        /* Orient all of them the same way, or overlapping clear polygons might cancel out in their union. */
+        if (!ClipperLib::Orientation(path)) {
+            ClipperLib::ReversePath(path);
+        }
+        d->clear_polys.push_back(std::move(path));
     }
 
     return *this;
@@ -179,15 +591,14 @@ void Flattener::flush_polys_to_sink() {
     m_sink << GRB_POL_DARK;
 
     for (auto &poly : d->dark_polys) {
-        Polygon poly_out;
-        for (auto &p : poly.vertexes()) {
-            poly_out.emplace_back(d2p{p.x(), p.y()});
+        if (poly.empty()) { /* removed */
+            continue;
         }
-        m_sink << poly_out;
+
+        m_sink << poly;
     }
 
-    d->clear_polys.clear();
-    d->dark_polys.clear();
+    d->clear();
 }
 
 void Flattener::footer() {
@@ -195,3 +606,115 @@ void Flattener::footer() {
     m_sink.footer();
 }
 
+SweepFlattener::SweepFlattener(PolygonSink &sink) : m_sink(sink) {
+    d = new SweepFlattener_D();
+}
+
+SweepFlattener::~SweepFlattener() {
+    delete d;
+}
+
+void SweepFlattener::header(d2p origin, d2p size) {
+    d->index.set_extents(origin, size);
+    m_sink.header(origin, size);
+}
+
+SweepFlattener &SweepFlattener::operator<<(GerberPolarityToken pol) {
+    m_current_polarity = pol;
+    return *this;
+}
+
+SweepFlattener &SweepFlattener::operator<<(const LayerNameToken &layer_name) {
+    flush_polys_to_sink();
+    m_sink << layer_name;
+    return *this;
+}
+
+SweepFlattener &SweepFlattener::operator<<(const FlashToken &tok) {
+    m_sink << tok;
+    return *this;
+}
+
+SweepFlattener &SweepFlattener::operator<<(const ApertureToken &tok) {
+    m_sink << tok;
+    return *this;
+}
+
+SweepFlattener &SweepFlattener::operator<<(const Polygon &poly) {
+    return *this << PolygonView(poly);
+}
+
+SweepFlattener &SweepFlattener::operator<<(const PolygonView &poly) {
+    ClipperLib::Path path;
+    polygon_to_clipper(poly, path);
+    if (path.size() < 3) {
+        return *this;
+    }
+
+    /* Orient everything the same way, or overlapping polygons might cancel out when we subtract them below */
+    if (!ClipperLib::Orientation(path)) {
+        ClipperLib::ReversePath(path);
+    }
+
+    d->index.add(get_paths_bounds({path}));
+    d->polys.push_back(std::move(path));
+    d->dark.push_back(m_current_polarity == GRB_POL_DARK);
+
+    return *this;
+}
+
+/* A point ends up dark if the topmost polygon covering it is dark. We go through the dark polygons in drawing order and
+ * subtract from each one all polygons drawn after it that overlap it, dark or clear. What is left is exactly the area
+ * where that dark polygon is the topmost one, so the pieces of different dark polygons never overlap and can go out as
+ * they are. Unlike Flattener, this clips each dark polygon only once however many runs of clear polygons it is hit by,
+ * and the output needs no final union. */
+void SweepFlattener::flush_polys_to_sink() {
+    vector<size_t> above;
+    ClipperLib::Paths visible;
+    bool polarity_sent = false;
+
+    for (size_t i=0; i<d->polys.size(); i++) {
+        if (!d->dark[i]) {
+            continue;
+        }
+
+        /* Polygons are numbered in drawing order, so this only keeps the ones above this one */
+        const ClipperLib::IntRect bounds = d->index.bounds(i);
+        d->index.find_overlapping(bounds, above, [i](size_t j) { return j > i; });
+
+        visible.clear();
+        if (above.empty()) {
+            visible.push_back(std::move(d->polys[i]));
+
+        } else if (above.size() <= SweepFlattener_D::max_clip) {
+            d->subtract_above(i, bounds, above, false, visible);
+
+        } else {
+            int k = (int)ceil(sqrt((double)above.size() / SweepFlattener_D::max_clip));
+            for (int ty=0; ty<k; ty++) {
+                for (int tx=0; tx<k; tx++) {
+                    ClipperLib::IntRect tile;
+                    tile.left = bounds.left + (bounds.right - bounds.left) * tx / k;
+                    tile.right = bounds.left + (bounds.right - bounds.left) * (tx+1) / k;
+                    tile.top = bounds.top + (bounds.bottom - bounds.top) * ty / k;
+                    tile.bottom = bounds.top + (bounds.bottom - bounds.top) * (ty+1) / k;
+                    d->subtract_above(i, tile, above, true, visible);
+                }
+            }
+        }
+
+        if (!visible.empty() && !polarity_sent) {
+            m_sink << GRB_POL_DARK;
+            polarity_sent = true;
+        }
+        for (const auto &path : visible) {
+            m_sink << path;
+        }
+    }
+    d->clear();
+}
+
+void SweepFlattener::footer() {
+    flush_polys_to_sink();
+    m_sink.footer();
+}
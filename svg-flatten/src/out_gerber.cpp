@@ -92,15 +92,21 @@ SimpleGerberOutput& SimpleGerberOutput::operator<<(GerberPolarityToken pol) {
 
     return *this;
 }
-SimpleGerberOutput& SimpleGerberOutput::operator<<(const Polygon &poly) {
+
+SimpleGerberOutput &SimpleGerberOutput::operator<<(const Polygon &poly) {
+    return *this << PolygonView(poly);
+}
+
+SimpleGerberOutput &SimpleGerberOutput::operator<<(const PolygonView &poly) {
     if (poly.size() < 3 && !m_aperture_set) {
         cerr << "Warning: " << poly.size() << "-element polygon passed to SimpleGerberOutput in region mode" << endl;
         return *this;
     }
 
-    /* NOTE: Clipper and gerber both have different fixed-point scales. We get points in double mm. */
-    double x = round((poly[0][0] * m_scale + m_offset[0]) * m_gerber_scale);
-    double y = round((m_height - poly[0][1] * m_scale + m_offset[1]) * m_gerber_scale);
+    /* NOTE: Clipper and gerber both have different fixed-point scales. The view gives us points in double mm. */
+    d2p p = poly[0];
+    double x = round((p[0] * m_scale + m_offset[0]) * m_gerber_scale);
+    double y = round((m_height - p[1] * m_scale + m_offset[1]) * m_gerber_scale);
     if (!m_aperture_set) {
         m_out << "G36*" << endl;
     }
@@ -111,8 +117,9 @@ SimpleGerberOutput& SimpleGerberOutput::operator<<(const Polygon &poly) {
     m_out << "G01*" << endl;
 
     for (size_t i=1; i<poly.size(); i++) {
-        double x = round((poly[i][0] * m_scale + m_offset[0]) * m_gerber_scale);
-        double y = round((m_height - poly[i][1] * m_scale + m_offset[1]) * m_gerber_scale);
+        d2p p = poly[i];
+        double x = round((p[0] * m_scale + m_offset[0]) * m_gerber_scale);
+        double y = round((m_height - p[1] * m_scale + m_offset[1]) * m_gerber_scale);
         m_out << "X" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)x
               << "Y" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)y
               << "D01*" << endl;
@@ -42,6 +42,10 @@ bool PolygonScaler::can_do_apertures() {
     return m_sink.can_do_apertures();
 }
 
+bool PolygonScaler::wants_lookahead() {
+    return m_sink.wants_lookahead();
+}
+
 PolygonScaler &PolygonScaler::operator<<(const LayerNameToken &layer_name) {
     m_sink << layer_name;
 
@@ -62,12 +66,11 @@ PolygonScaler &PolygonScaler::operator<<(const ApertureToken &tok) {
 }
 
 PolygonScaler &PolygonScaler::operator<<(const Polygon &poly) {
-    Polygon new_poly;
-    for (auto &p : poly) {
-        new_poly.push_back({ p[0] * m_scale, p[1] * m_scale });
-    }
-    m_sink << new_poly;
+    return *this << PolygonView(poly);
+}
 
+PolygonScaler &PolygonScaler::operator<<(const PolygonView &poly) {
+    m_sink << poly.scaled(m_scale);
     return *this;
 }
 
@@ -77,6 +80,11 @@ PolygonScaler &PolygonScaler::operator<<(const FlashToken &tok) {
     return *this;
 }
 
+PolygonScaler &PolygonScaler::operator<<(const LookaheadToken &tok) {
+    m_sink << LookaheadToken({tok.m_min[0] * m_scale, tok.m_min[1] * m_scale}, {tok.m_max[0] * m_scale, tok.m_max[1] * m_scale});
+    return *this;
+}
+
 PolygonScaler &PolygonScaler::operator<<(const PatternToken &tok) {
     vector<pair<Polygon, GerberPolarityToken>> new_polys;
     for (size_t i=0; i<tok.m_polys.size(); i++) {
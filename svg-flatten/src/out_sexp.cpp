@@ -113,6 +113,10 @@ KicadSexpOutput &KicadSexpOutput::operator<<(const LayerNameToken &layer_name) {
 }
 
 KicadSexpOutput &KicadSexpOutput::operator<<(const Polygon &poly) {
+    return *this << PolygonView(poly);
+}
+
+KicadSexpOutput &KicadSexpOutput::operator<<(const PolygonView &poly) {
     if (m_auto_layer) {
         if (std::find(m_export_layers->begin(), m_export_layers->end(), m_layer) == m_export_layers->end()) {
             cerr << "Rejecting S-Exp export layer \"" << m_layer << "\"" << endl;
@@ -126,7 +130,7 @@ KicadSexpOutput &KicadSexpOutput::operator<<(const Polygon &poly) {
     }
 
     m_out << "  (fp_poly (pts";
-    for (auto &p : poly) {
+    for (d2p p : poly) {
         m_out << " (xy " << p[0] << " " << p[1] << ")";
     }
     m_out << ")";
@@ -58,6 +58,10 @@ SimpleSVGOutput &SimpleSVGOutput::operator<<(GerberPolarityToken pol) {
 }
 
 SimpleSVGOutput &SimpleSVGOutput::operator<<(const Polygon &poly) {
+    return *this << PolygonView(poly);
+}
+
+SimpleSVGOutput &SimpleSVGOutput::operator<<(const PolygonView &poly) {
     //cerr << "svg: got poly of size " << poly.size() << endl;
     if (poly.size() < 3) {
         cerr << "Warning: " << poly.size() << "-element polygon passed to SimpleGerberOutput" << endl;
@@ -65,11 +69,13 @@ SimpleSVGOutput &SimpleSVGOutput::operator<<(const Polygon &poly) {
     }
 
     m_out << "<path fill=\"" << m_current_color << "\" d=\"";
-    m_out << "M " << setprecision(m_digits_frac) << (poly[0][0] + m_offset[0])
-          << " " << setprecision(m_digits_frac) << (poly[0][1] + m_offset[1]);
+    d2p p = poly[0];
+    m_out << "M " << setprecision(m_digits_frac) << (p[0] + m_offset[0])
+          << " " << setprecision(m_digits_frac) << (p[1] + m_offset[1]);
     for (size_t i=1; i<poly.size(); i++) {
-        m_out << " L " << setprecision(m_digits_frac) << (poly[i][0] + m_offset[0])
-              << " " << setprecision(m_digits_frac) << (poly[i][1] + m_offset[1]);
+        p = poly[i];
+        m_out << " L " << setprecision(m_digits_frac) << (p[0] + m_offset[0])
+              << " " << setprecision(m_digits_frac) << (p[1] + m_offset[1]);
     }
     m_out << " Z";
     m_out << "\"/>" << endl;
@@ -0,0 +1,233 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* WASI has no threads, so there we always render serially. */
+#ifndef WASI
+
+#include "parallel_render.h"
+
+using namespace std;
+using namespace gerbolyze;
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(const Polygon &poly) {
+    m_tokens.emplace_back(poly);
+    return *this;
+}
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(const LayerNameToken &layer_name) {
+    m_tokens.emplace_back(layer_name);
+    return *this;
+}
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(GerberPolarityToken pol) {
+    m_tokens.emplace_back(pol);
+    return *this;
+}
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(const ApertureToken &tok) {
+    m_tokens.emplace_back(tok);
+    return *this;
+}
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(const FlashToken &tok) {
+    m_tokens.emplace_back(tok);
+    return *this;
+}
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(const LookaheadToken &tok) {
+    m_tokens.emplace_back(tok);
+    return *this;
+}
+
+BufferedPolygonSink &gerbolyze::BufferedPolygonSink::operator<<(const PatternToken &tok) {
+    m_tokens.emplace_back(PatternPolys(tok.m_polys));
+    return *this;
+}
+
+void gerbolyze::BufferedPolygonSink::replay(PolygonSink &sink) {
+    for (auto &tok : m_tokens) {
+        visit([&sink](auto &arg) {
+                if constexpr (is_same_v<decay_t<decltype(arg)>, PatternPolys>) {
+                    sink << PatternToken(arg);
+                } else {
+                    sink << arg;
+                }
+            }, tok);
+    }
+}
+
+gerbolyze::ParallelRenderer::ParallelRenderer(PolygonSink &sink, int num_threads) :
+    m_sink(sink),
+    m_can_do_apertures(sink.can_do_apertures()),
+    m_wants_lookahead(sink.wants_lookahead()),
+    m_max_pending(4 * num_threads)
+{
+    for (int i=0; i<num_threads; i++) {
+        m_threads.emplace_back([this]() { worker(); });
+    }
+}
+
+gerbolyze::ParallelRenderer::~ParallelRenderer() {
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_shutdown = true;
+    }
+    m_work_cv.notify_all();
+
+    for (auto &t : m_threads) {
+        t.join();
+    }
+}
+
+void gerbolyze::ParallelRenderer::worker() {
+    while (true) {
+        Segment *seg;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_work_cv.wait(lock, [this]{ return m_shutdown || !m_work.empty(); });
+            if (m_work.empty()) {
+                return;
+            }
+            seg = m_work.front();
+            m_work.pop_front();
+        }
+
+#ifndef NOTHROW
+        try {
+            seg->fun(seg->buf);
+        } catch (...) {
+            seg->error = current_exception();
+        }
+#else
+        seg->fun(seg->buf);
+#endif
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            seg->done = true;
+        }
+        m_done_cv.notify_all();
+    }
+}
+
+void gerbolyze::ParallelRenderer::submit(task_fun fun) {
+    auto &seg = m_segments.emplace_back(make_unique<Segment>(m_can_do_apertures));
+    seg->fun = std::move(fun);
+    m_tail_is_serial = false;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_work.push_back(seg.get());
+    }
+    m_work_cv.notify_one();
+
+    flush(m_segments.size() > m_max_pending);
+}
+
+/* Replay all segments at the front of the queue that are complete. If wait_for_one is set, block until at least the
+ * first one is. */
+void gerbolyze::ParallelRenderer::flush(bool wait_for_one) {
+    while (!m_segments.empty()) {
+        Segment *seg = m_segments.front().get();
+        {
+            unique_lock<mutex> lock(m_mutex);
+            if (wait_for_one) {
+                m_done_cv.wait(lock, [seg]{ return seg->done; });
+            } else if (!seg->done) {
+                return;
+            }
+        }
+        wait_for_one = false;
+
+#ifndef NOTHROW
+        if (seg->error) {
+            auto err = seg->error;
+            m_segments.pop_front();
+            rethrow_exception(err);
+        }
+#endif
+
+        seg->buf.replay(m_sink);
+        m_segments.pop_front();
+    }
+    m_tail_is_serial = false;
+}
+
+void gerbolyze::ParallelRenderer::finish() {
+    while (!m_segments.empty()) {
+        flush(true);
+    }
+}
+
+/* Tokens written to us directly come from the serial traversal. As long as nothing is outstanding they can go straight
+ * through, otherwise they have to queue up behind the running tasks. */
+PolygonSink &gerbolyze::ParallelRenderer::serial_sink() {
+    if (m_segments.empty()) {
+        return m_sink;
+    }
+
+    if (!m_tail_is_serial) {
+        auto &seg = m_segments.emplace_back(make_unique<Segment>(m_can_do_apertures));
+        seg->done = true;
+        m_tail_is_serial = true;
+    }
+    return m_segments.back()->buf;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const Polygon &poly) {
+    serial_sink() << poly;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const PolygonView &poly) {
+    serial_sink() << poly;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const LayerNameToken &layer_name) {
+    serial_sink() << layer_name;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(GerberPolarityToken pol) {
+    serial_sink() << pol;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const ApertureToken &tok) {
+    serial_sink() << tok;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const FlashToken &tok) {
+    serial_sink() << tok;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const LookaheadToken &tok) {
+    serial_sink() << tok;
+    return *this;
+}
+
+ParallelRenderer &gerbolyze::ParallelRenderer::operator<<(const PatternToken &tok) {
+    serial_sink() << tok;
+    return *this;
+}
+
+#endif /* WASI */
+
@@ -0,0 +1,125 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <variant>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <gerbolyze.hpp>
+
+namespace gerbolyze {
+
+/* Records everything written into it so that it can be replayed into another sink later. Paths are converted to
+ * Polygons on the way in, which is what PolygonSink does by default anyway. */
+class BufferedPolygonSink : public PolygonSink {
+public:
+    BufferedPolygonSink(bool can_do_apertures=false) : m_can_do_apertures(can_do_apertures) {}
+    virtual bool can_do_apertures() { return m_can_do_apertures; }
+    virtual BufferedPolygonSink &operator<<(const Polygon &poly);
+    virtual BufferedPolygonSink &operator<<(const LayerNameToken &layer_name);
+    virtual BufferedPolygonSink &operator<<(GerberPolarityToken pol);
+    virtual BufferedPolygonSink &operator<<(const ApertureToken &tok);
+    virtual BufferedPolygonSink &operator<<(const FlashToken &tok);
+    virtual BufferedPolygonSink &operator<<(const LookaheadToken &tok);
+    virtual BufferedPolygonSink &operator<<(const PatternToken &tok);
+
+    void replay(PolygonSink &sink);
+    void clear() { m_tokens.clear(); }
+
+private:
+    /* PatternToken only holds a reference, so we have to keep our own copy of its polygons. */
+    typedef std::vector<std::pair<Polygon, GerberPolarityToken>> PatternPolys;
+    typedef std::variant<Polygon, GerberPolarityToken, LayerNameToken, ApertureToken, FlashToken, LookaheadToken,
+            PatternPolys> Token;
+
+    bool m_can_do_apertures;
+    std::vector<Token> m_tokens;
+};
+
+/* Renders independent parts of a document on a thread pool while keeping the output in document order.
+ *
+ * The document is still traversed serially. Expensive leaf elements are handed to submit(), which runs them on a
+ * worker thread into their own BufferedPolygonSink. Anything written into the ParallelRenderer itself in the
+ * meantime is buffered, too. All buffers are replayed into the real sink strictly in the order they were created, so
+ * the output is identical to a serial render. Only the thread calling submit() ever touches the real sink.
+ *
+ * The number of outstanding buffers is bounded so we don't end up holding the entire document's output in memory when
+ * the traversal runs ahead of the workers. */
+class ParallelRenderer : public PolygonSink {
+public:
+    typedef std::function<void(PolygonSink &)> task_fun;
+
+    ParallelRenderer(PolygonSink &sink, int num_threads);
+    virtual ~ParallelRenderer();
+
+    void submit(task_fun fun);
+    /* Wait for all outstanding tasks and flush their output to the sink. */
+    void finish();
+
+    virtual bool can_do_apertures() { return m_can_do_apertures; }
+    virtual bool wants_lookahead() { return m_wants_lookahead; }
+    virtual ParallelRenderer &operator<<(const Polygon &poly);
+    virtual ParallelRenderer &operator<<(const PolygonView &poly);
+    virtual ParallelRenderer &operator<<(const LayerNameToken &layer_name);
+    virtual ParallelRenderer &operator<<(GerberPolarityToken pol);
+    virtual ParallelRenderer &operator<<(const ApertureToken &tok);
+    virtual ParallelRenderer &operator<<(const FlashToken &tok);
+    virtual ParallelRenderer &operator<<(const LookaheadToken &tok);
+    virtual ParallelRenderer &operator<<(const PatternToken &tok);
+
+private:
+    struct Segment {
+        Segment(bool can_do_apertures) : buf(can_do_apertures) {}
+        BufferedPolygonSink buf;
+        task_fun fun;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    PolygonSink &serial_sink();
+    void flush(bool wait_for_one);
+    void worker();
+
+    PolygonSink &m_sink;
+    bool m_can_do_apertures;
+    bool m_wants_lookahead;
+    size_t m_max_pending;
+
+    /* Only touched by the submitting thread */
+    std::deque<std::unique_ptr<Segment>> m_segments;
+    bool m_tail_is_serial = false;
+
+    /* Shared with the workers */
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    std::deque<Segment *> m_work;
+    bool m_shutdown = false;
+    std::vector<std::thread> m_threads;
+};
+
+} /* namespace gerbolyze */
+
@@ -0,0 +1,382 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <chrono>
+#include <functional>
+#include <map>
+#ifndef WASI
+#include <thread>
+#include <mutex>
+#endif
+
+#include "render_cache.h"
+
+using namespace std;
+using namespace gerbolyze;
+
+namespace fs = std::filesystem;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+gerbolyze::CacheKey::CacheKey() : m_buf_len(0), m_total_len(0) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(m_state, init, sizeof(m_state));
+}
+
+void gerbolyze::CacheKey::process_block(const uint8_t *block) {
+    uint32_t w[64];
+    for (int i=0; i<16; i++) {
+        w[i] = (uint32_t)block[i*4] << 24 | (uint32_t)block[i*4+1] << 16 | (uint32_t)block[i*4+2] << 8 | block[i*4+3];
+    }
+    for (int i=16; i<64; i++) {
+        uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i=0; i<64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+void gerbolyze::CacheKey::add_raw(const void *data, size_t len) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    m_total_len += len;
+
+    if (m_buf_len) {
+        size_t n = min(len, sizeof(m_buf) - m_buf_len);
+        memcpy(m_buf + m_buf_len, p, n);
+        m_buf_len += n;
+        p += n;
+        len -= n;
+
+        if (m_buf_len < sizeof(m_buf)) {
+            return;
+        }
+        process_block(m_buf);
+        m_buf_len = 0;
+    }
+
+    while (len >= sizeof(m_buf)) {
+        process_block(p);
+        p += sizeof(m_buf);
+        len -= sizeof(m_buf);
+    }
+
+    memcpy(m_buf, p, len);
+    m_buf_len = len;
+}
+
+void gerbolyze::CacheKey::add(const string &s) {
+    uint64_t len = s.size();
+    add_raw(&len, sizeof(len));
+    add_raw(s.data(), s.size());
+}
+
+void gerbolyze::CacheKey::add(double d) {
+    add_raw(&d, sizeof(d));
+}
+
+void gerbolyze::CacheKey::add(bool b) {
+    uint8_t v = b;
+    add_raw(&v, sizeof(v));
+}
+
+bool gerbolyze::CacheKey::add_file(const string &filename) {
+    ifstream in(filename, ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    char buf[65536];
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+        add_raw(buf, in.gcount());
+    }
+    /* Terminate so that the file contents cannot run into whatever is added next */
+    add(string("EOF"));
+    return !in.bad();
+}
+
+string gerbolyze::CacheKey::hex_digest() const {
+    CacheKey tmp = *this;
+
+    uint64_t bit_len = m_total_len * 8;
+    uint8_t pad = 0x80;
+    tmp.add_raw(&pad, 1);
+    pad = 0;
+    while (tmp.m_buf_len != 56) {
+        tmp.add_raw(&pad, 1);
+    }
+
+    uint8_t len_be[8];
+    for (int i=0; i<8; i++) {
+        len_be[i] = bit_len >> (56 - 8*i);
+    }
+    tmp.add_raw(len_be, sizeof(len_be));
+
+    static const char hex[] = "0123456789abcdef";
+    string out;
+    for (uint32_t word : tmp.m_state) {
+        for (int i=28; i>=0; i-=4) {
+            out += hex[(word >> i) & 0xf];
+        }
+    }
+    return out;
+}
+
+atomic<uint64_t> gerbolyze::RenderCache::s_hits {0};
+atomic<uint64_t> gerbolyze::RenderCache::s_misses {0};
+atomic<uint64_t> gerbolyze::RenderCache::s_evictions {0};
+
+/* Running total of each cache directory's size, shared by all RenderCache instances in this process since --batch and
+ * --serve create one per job. Initialized by scanning the directory on the first store. Entries written or deleted by
+ * other processes only show up on the next scan, which happens whenever we evict. */
+namespace {
+    struct CacheDirState {
+        bool scanned = false;
+        uintmax_t size = 0;
+    };
+}
+
+static map<string, CacheDirState> cache_dirs;
+#ifndef WASI
+static mutex cache_dirs_mutex;
+#endif
+
+/* Entries live in a subdirectory of --cache-dir that belongs to us alone, so that eviction never touches any of the
+ * user's own files when they point --cache-dir at e.g. ~/.cache. */
+static const char *cache_subdir = "svg-flatten-cache";
+
+/* Temporary files this much older than their last write are left over from a crashed process */
+static constexpr auto stale_tmp_age = chrono::hours(1);
+
+static bool is_hex(const string &s, size_t len) {
+    return s.size() == len && all_of(s.begin(), s.end(), [](char c) {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+/* Fan out into subdirectories like git does so that no single directory gets too large. */
+string gerbolyze::RenderCache::entry_path(const string &key) const {
+    return (fs::path(m_dir) / cache_subdir / key.substr(0, 2) / key.substr(2)).string();
+}
+
+bool gerbolyze::RenderCache::lookup(const string &key, ostream &out) {
+    string path = entry_path(key);
+    ifstream in(path, ios::binary);
+    if (!in) {
+        s_misses++;
+        return false;
+    }
+
+    /* operator<< on an empty streambuf sets failbit on out. */
+    if (in.peek() != ifstream::traits_type::eof()) {
+        out << in.rdbuf();
+    }
+    if (!out) {
+        cerr << "Error writing output from render cache" << endl;
+        s_misses++;
+        return false;
+    }
+
+    /* Mark as recently used */
+    error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+    s_hits++;
+    return true;
+}
+
+void gerbolyze::RenderCache::store(const string &key, const string &data) {
+    string path = entry_path(key);
+
+    error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    if (ec) {
+        cerr << "Warning: Cannot create render cache directory: " << ec.message() << endl;
+        return;
+    }
+
+    /* Write to a temporary file and atomically rename it into place so that concurrent readers in other threads or
+     * processes never see a half-written entry. */
+    static atomic<uint64_t> tmp_counter {0};
+    string tmp_path = path + ".tmp."
+#ifndef WASI
+        + to_string(hash<thread::id>{}(this_thread::get_id())) + "."
+#endif
+        + to_string(chrono::steady_clock::now().time_since_epoch().count()) + "."
+        + to_string(tmp_counter++);
+
+    {
+        ofstream out(tmp_path, ios::binary);
+        out.write(data.data(), data.size());
+        if (!out) {
+            cerr << "Warning: Cannot write render cache entry \"" << tmp_path << "\"" << endl;
+            out.close();
+            fs::remove(tmp_path, ec);
+            return;
+        }
+    }
+
+    /* We might be replacing an existing entry */
+    uintmax_t old_size = fs::file_size(path, ec);
+    if (ec) {
+        old_size = 0;
+        ec.clear();
+    }
+
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        cerr << "Warning: Cannot write render cache entry \"" << path << "\": " << ec.message() << endl;
+        fs::remove(tmp_path, ec);
+        return;
+    }
+
+#ifndef WASI
+    lock_guard<mutex> lock(cache_dirs_mutex);
+#endif
+    CacheDirState &state = cache_dirs[m_dir];
+    if (!state.scanned) {
+        state.size = evict(UINTMAX_MAX);
+        state.scanned = true;
+    } else {
+        state.size = (state.size + data.size() > old_size) ? state.size + data.size() - old_size : 0;
+    }
+
+    /* Evict down to somewhat below the limit so that we do not have to scan the whole cache again on the next store */
+    if (state.size > m_max_size) {
+        state.size = evict(m_max_size / 10 * 9);
+    }
+}
+
+/* Scan the cache and delete least recently used entries until at most target_size bytes are left. Returns the size of
+ * what is left. Only files that match the layout of entry_path() and store()'s temporary files are considered. */
+uintmax_t gerbolyze::RenderCache::evict(uintmax_t target_size) {
+    struct Entry {
+        fs::path path;
+        uintmax_t size;
+        fs::file_time_type mtime;
+    };
+
+    vector<Entry> entries;
+    uintmax_t total = 0;
+    auto now = fs::file_time_type::clock::now();
+
+    error_code ec;
+    for (auto dir = fs::directory_iterator(fs::path(m_dir) / cache_subdir, ec); !ec && dir != fs::directory_iterator();
+            dir.increment(ec)) {
+        if (!is_hex(dir->path().filename().string(), 2) || !dir->is_directory(ec) || dir->is_symlink(ec)) {
+            ec.clear();
+            continue;
+        }
+
+        error_code dir_ec;
+        for (auto it = fs::directory_iterator(dir->path(), dir_ec); !dir_ec && it != fs::directory_iterator();
+                it.increment(dir_ec)) {
+            if (!it->is_regular_file(dir_ec) || it->is_symlink(dir_ec)) {
+                dir_ec.clear();
+                continue;
+            }
+
+            string name = it->path().filename().string();
+            Entry e {it->path(), it->file_size(dir_ec), it->last_write_time(dir_ec)};
+            if (dir_ec) {
+                /* Deleted by someone else in the meantime */
+                dir_ec.clear();
+                continue;
+            }
+
+            if (name.size() > 62 && is_hex(name.substr(0, 62), 62) && name.compare(62, 5, ".tmp.") == 0) {
+                if (now - e.mtime > stale_tmp_age) {
+                    fs::remove(e.path, dir_ec);
+                    dir_ec.clear();
+                }
+                continue;
+            }
+
+            if (!is_hex(name, 62)) {
+                continue;
+            }
+
+            total += e.size;
+            entries.push_back(e);
+        }
+    }
+
+    if (total <= target_size) {
+        return total;
+    }
+
+    sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+    for (const auto &e : entries) {
+        if (total <= target_size) {
+            break;
+        }
+
+        if (fs::remove(e.path, ec)) {
+            s_evictions++;
+        }
+        total -= e.size;
+    }
+    return total;
+}
+
+void gerbolyze::RenderCache::print_stats(ostream &out) {
+    uint64_t hits = s_hits, misses = s_misses;
+    out << "Render cache: " << hits << " hits, " << misses << " misses";
+    if (hits + misses > 0) {
+        out << " (" << (100 * hits / (hits + misses)) << "% hit rate)";
+    }
+    out << ", " << s_evictions << " evictions" << endl;
+}
+
@@ -0,0 +1,80 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <ostream>
+#include <atomic>
+
+namespace gerbolyze {
+
+/* Incremental SHA-256 for building render cache keys. Strings are hashed with their length so that the concatenation
+ * of several fields is unambiguous. */
+class CacheKey {
+public:
+    CacheKey();
+
+    void add_raw(const void *data, size_t len);
+    void add(const std::string &s);
+    void add(double d);
+    void add(bool b);
+    bool add_file(const std::string &filename);
+
+    /* Does not modify the key, so you can continue adding to a copy. */
+    std::string hex_digest() const;
+
+private:
+    void process_block(const uint8_t *block);
+
+    uint32_t m_state[8];
+    uint8_t m_buf[64];
+    size_t m_buf_len;
+    uint64_t m_total_len;
+};
+
+/* Content-addressed on-disk cache of rendered output files. Entries are plain files named after their key (a
+ * hex_digest()), in a subdirectory of the given directory that nothing else writes to. Their modification time is
+ * bumped on every hit, and when the cache grows beyond max_size bytes the least recently used entries are deleted until
+ * it is back at 90% of max_size. Safe to use from several threads and processes at once. */
+class RenderCache {
+public:
+    RenderCache(const std::string &dir, uintmax_t max_size) : m_dir(dir), m_max_size(max_size) {}
+
+    /* true -> hit, entry has been copied to out */
+    bool lookup(const std::string &key, std::ostream &out);
+    void store(const std::string &key, const std::string &data);
+
+    static void print_stats(std::ostream &out);
+
+private:
+    std::string entry_path(const std::string &key) const;
+    uintmax_t evict(uintmax_t target_size);
+
+    std::string m_dir;
+    uintmax_t m_max_size;
+
+    static std::atomic<uint64_t> s_hits;
+    static std::atomic<uint64_t> s_misses;
+    static std::atomic<uint64_t> s_evictions;
+};
+
+}
+
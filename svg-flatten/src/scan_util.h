@@ -0,0 +1,63 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <charconv>
+#include <system_error>
+
+namespace gerbolyze {
+
+/* Skip whitespace and commas, which SVG allows interchangeably between numbers. */
+inline const char *scan_skip_sep(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+/* Parse one number at p and advance p past it. Unlike istream >> double, this neither allocates nor cares about the
+ * locale. p must point into a NUL-terminated string. */
+inline bool scan_double(const char *&p, const char *end, double &out) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    /* from_chars does not accept the leading '+' that SVG allows */
+    const char *q = (p < end && *p == '+') ? p+1 : p;
+    auto res = std::from_chars(q, end, out);
+    if (res.ec != std::errc()) {
+        return false;
+    }
+    p = res.ptr;
+    return true;
+
+#else
+    /* Older standard libraries (e.g. wasi-sdk's libc++) lack floating-point from_chars. We never call setlocale, so
+     * strtod always uses the C locale here. */
+    (void) end;
+    char *endp;
+    out = strtod(p, &endp);
+    if (endp == p) {
+        return false;
+    }
+    p = endp;
+    return true;
+#endif
+}
+
+} /* namespace gerbolyze */
+
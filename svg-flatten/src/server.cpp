@@ -0,0 +1,533 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <streambuf>
+
+#ifndef WASI
+#include <mutex>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <base64.h>
+#include "server.h"
+
+using namespace std;
+using namespace gerbolyze;
+
+namespace {
+
+/* Just enough JSON to read requests: We parse the top-level object and its string and string array members, and skip
+ * over everything else. */
+class JSONReader {
+public:
+    JSONReader(const string &s) : s(s), pos(0) {}
+
+    bool parse_request(ServerRequest &req, string &err);
+
+private:
+    void skip_ws() {
+        while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r' || s[pos] == '\n')) {
+            pos++;
+        }
+    }
+
+    bool expect(char c) {
+        skip_ws();
+        if (pos < s.size() && s[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_hex4(unsigned &out);
+    bool parse_string(string &out);
+    bool parse_string_array(vector<string> &out);
+    bool skip_value();
+
+    const string &s;
+    size_t pos;
+};
+
+bool JSONReader::parse_hex4(unsigned &out) {
+    if (pos + 4 > s.size()) {
+        return false;
+    }
+
+    out = 0;
+    for (int i=0; i<4; i++) {
+        char c = s[pos++];
+        out <<= 4;
+        if (c >= '0' && c <= '9') {
+            out |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            out |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            out |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void append_utf8(string &out, unsigned cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xc0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char)(0xe0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else {
+        out += (char)(0xf0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3f));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+bool JSONReader::parse_string(string &out) {
+    if (!expect('"')) {
+        return false;
+    }
+
+    out.clear();
+    while (pos < s.size()) {
+        /* Copy runs of unescaped characters in one go, inline SVG data can be large. */
+        size_t end = s.find_first_of("\"\\", pos);
+        if (end == string::npos) {
+            return false;
+        }
+        out.append(s, pos, end - pos);
+        pos = end;
+
+        if (s[pos] == '"') {
+            pos++;
+            return true;
+        }
+
+        pos++; /* backslash */
+        if (pos >= s.size()) {
+            return false;
+        }
+
+        char c = s[pos++];
+        switch (c) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned cp;
+                if (!parse_hex4(cp)) {
+                    return false;
+                }
+
+                /* Surrogate pair */
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    unsigned lo;
+                    if (pos + 2 > s.size() || s[pos] != '\\' || s[pos+1] != 'u') {
+                        return false;
+                    }
+                    pos += 2;
+                    if (!parse_hex4(lo) || lo < 0xdc00 || lo >= 0xe000) {
+                        return false;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+bool JSONReader::parse_string_array(vector<string> &out) {
+    if (!expect('[')) {
+        return false;
+    }
+
+    out.clear();
+    if (expect(']')) {
+        return true;
+    }
+
+    do {
+        if (!parse_string(out.emplace_back())) {
+            return false;
+        }
+    } while (expect(','));
+
+    return expect(']');
+}
+
+bool JSONReader::skip_value() {
+    skip_ws();
+    if (pos >= s.size()) {
+        return false;
+    }
+
+    char c = s[pos];
+    if (c == '"') {
+        string dummy;
+        return parse_string(dummy);
+
+    } else if (c == '{' || c == '[') {
+        char close = (c == '{') ? '}' : ']';
+        pos++;
+        if (expect(close)) {
+            return true;
+        }
+
+        do {
+            if (c == '{') {
+                string dummy;
+                if (!parse_string(dummy) || !expect(':')) {
+                    return false;
+                }
+            }
+            if (!skip_value()) {
+                return false;
+            }
+        } while (expect(','));
+
+        return expect(close);
+
+    } else { /* number, true, false, null */
+        size_t start = pos;
+        while (pos < s.size() && (isalnum((unsigned char)s[pos]) || s[pos] == '-' || s[pos] == '+' || s[pos] == '.')) {
+            pos++;
+        }
+        return pos > start;
+    }
+}
+
+bool JSONReader::parse_request(ServerRequest &req, string &err) {
+    if (!expect('{')) {
+        err = "Request is not a JSON object";
+        return false;
+    }
+
+    if (expect('}')) {
+        return true;
+    }
+
+    do {
+        string key;
+        if (!parse_string(key) || !expect(':')) {
+            err = "Syntax error in request";
+            return false;
+        }
+
+        if (key == "id") {
+            skip_ws();
+            size_t start = pos;
+            if (!skip_value()) {
+                err = "Syntax error in request id";
+                return false;
+            }
+            req.id = s.substr(start, pos - start);
+
+        } else if (key == "args") {
+            if (!parse_string_array(req.args)) {
+                err = "\"args\" must be an array of strings";
+                return false;
+            }
+
+        } else if (key == "input_data" || key == "input_base64") {
+            if (!parse_string(req.input_data)) {
+                err = "\"" + key + "\" must be a string";
+                return false;
+            }
+            if (key == "input_base64") {
+                req.input_data = base64_decode(req.input_data);
+            }
+            req.has_input_data = true;
+
+        } else if (!skip_value()) {
+            err = "Syntax error in request";
+            return false;
+        }
+    } while (expect(','));
+
+    if (!expect('}')) {
+        err = "Syntax error in request";
+        return false;
+    }
+
+    skip_ws();
+    if (pos != s.size()) {
+        err = "Trailing garbage after request";
+        return false;
+    }
+    return true;
+}
+
+/* Collects everything written to cerr during a request. With --jobs, the ParallelRenderer's worker threads print their
+ * warnings while the handler runs, so this has no put area of its own and appends every write under a lock. */
+class MessageBuffer : public streambuf {
+public:
+    string str() {
+#ifndef WASI
+        lock_guard<mutex> lock(m_mutex);
+#endif
+        return m_data;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+#ifndef WASI
+            lock_guard<mutex> lock(m_mutex);
+#endif
+            m_data.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char *data, streamsize n) override {
+#ifndef WASI
+        lock_guard<mutex> lock(m_mutex);
+#endif
+        m_data.append(data, n);
+        return n;
+    }
+
+private:
+    string m_data;
+#ifndef WASI
+    mutex m_mutex;
+#endif
+};
+
+} /* namespace */
+
+static void write_json_string(ostream &out, const string &str) {
+    out << '"';
+    for (unsigned char c : str) {
+        switch (c) {
+            case '"': out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            case '\r': out << "\\r"; break;
+            case '\t': out << "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out << buf;
+                } else {
+                    out << c;
+                }
+        }
+    }
+    out << '"';
+}
+
+/* Run one request line and return the response line, without trailing newline. Anything the handler prints to cerr is
+ * captured and returned in the response's "messages" field so that it ends up with the right request. */
+static string handle_line(const string &line, request_handler &handler) {
+    auto t_start = chrono::steady_clock::now();
+
+    ServerRequest req;
+    ServerResponse resp;
+    string err;
+    MessageBuffer messages;
+
+    JSONReader reader(line);
+    if (reader.parse_request(req, err)) {
+        auto *old_cerr = cerr.rdbuf(&messages);
+        handler(req, resp);
+        cerr.rdbuf(old_cerr);
+
+    } else {
+        resp.exit_code = EXIT_FAILURE;
+    }
+
+    double time_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count();
+
+    ostringstream out;
+    out << "{\"id\":" << req.id
+        << ",\"status\":" << (resp.exit_code ? "\"error\"" : "\"ok\"")
+        << ",\"exit_code\":" << resp.exit_code
+        << ",\"time_ms\":" << time_ms
+        << ",\"doc_cached\":" << (resp.doc_cached ? "true" : "false");
+    if (!err.empty()) {
+        out << ",\"error\":";
+        write_json_string(out, err);
+    }
+    string message_str = messages.str();
+    if (!message_str.empty()) {
+        out << ",\"messages\":";
+        write_json_string(out, message_str);
+    }
+    if (!resp.output_data.empty()) {
+        out << ",\"output_data\":";
+        write_json_string(out, resp.output_data);
+    }
+    out << "}";
+    return out.str();
+}
+
+int gerbolyze::serve_stream(istream &in, ostream &out, request_handler handler) {
+    string line;
+    while (getline(in, line)) {
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+
+        out << handle_line(line, handler) << endl;
+        if (!out) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return in.bad() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#ifndef WASI
+static bool write_all(int fd, const string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t rc = write(fd, data.data() + written, data.size() - written);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += rc;
+    }
+    return true;
+}
+
+int gerbolyze::serve_unix_socket(const string &path, request_handler handler) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "Error: Socket path \"" << path << "\" is too long" << endl;
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        cerr << "Error creating socket: " << strerror(errno) << endl;
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    /* Fits including the terminating null byte, see above */
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    /* Remove stale socket left behind by a previous instance, but nothing else that might live at that path */
+    struct stat st;
+    if (!lstat(path.c_str(), &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            cerr << "Error: \"" << path << "\" exists and is not a socket" << endl;
+            close(sock);
+            return EXIT_FAILURE;
+        }
+        unlink(path.c_str());
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 16)) {
+        cerr << "Error binding socket \"" << path << "\": " << strerror(errno) << endl;
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    /* Clients hanging up on us mid-response must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    cerr << "Info: Listening on " << path << endl;
+    while (true) {
+        int conn = accept(sock, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << "Error accepting connection: " << strerror(errno) << endl;
+            close(sock);
+            return EXIT_FAILURE;
+        }
+
+        string buf;
+        char chunk[65536];
+        bool conn_ok = true;
+        while (conn_ok) {
+            ssize_t rc = read(conn, chunk, sizeof(chunk));
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc <= 0) {
+                break;
+            }
+            buf.append(chunk, rc);
+
+            size_t start = 0, end;
+            while ((end = buf.find('\n', start)) != string::npos) {
+                string line = buf.substr(start, end - start);
+                start = end + 1;
+
+                if (line.find_first_not_of(" \t\r") == string::npos) {
+                    continue;
+                }
+
+                if (!write_all(conn, handle_line(line, handler) + "\n")) {
+                    conn_ok = false;
+                    break;
+                }
+            }
+            buf.erase(0, start);
+        }
+
+        close(conn);
+    }
+}
+
+#else
+int gerbolyze::serve_unix_socket(const string &path, request_handler handler) {
+    (void) path, (void) handler;
+    cerr << "Error: --serve-socket is not supported on wasi, use --serve instead." << endl;
+    return EXIT_FAILURE;
+}
+#endif
+
@@ -0,0 +1,56 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <functional>
+
+namespace gerbolyze {
+
+/* One line of input in --serve mode, e.g.
+ *
+ *   {"id": 23, "args": ["--format", "gerber", "in.svg", "out.gbr"]}
+ *   {"id": "foo", "args": ["--format", "svg", "-", "-"], "input_data": "<svg>...</svg>"}
+ *
+ * args are the same as on the command line. "input_data" (raw string) or "input_base64" (for bitmaps) replace the input
+ * file. Output written to "-" is returned in the response's "output_data" field. */
+struct ServerRequest {
+    std::string id = "null"; /* raw JSON, echoed back verbatim */
+    std::vector<std::string> args;
+    bool has_input_data = false;
+    std::string input_data;
+};
+
+struct ServerResponse {
+    int exit_code = 0;
+    bool doc_cached = false;
+    std::string output_data;
+};
+
+typedef std::function<void(ServerRequest &, ServerResponse &)> request_handler;
+
+/* Both of these process one request at a time until EOF (stream) or until killed (socket). */
+int serve_stream(std::istream &in, std::ostream &out, request_handler handler);
+int serve_unix_socket(const std::string &path, request_handler handler);
+
+}
+
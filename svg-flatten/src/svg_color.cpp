@@ -19,7 +19,9 @@
 #include "svg_color.h"
 
 #include <assert.h>
+#include <string.h>
 #include <string>
+#include <unordered_map>
 #include <cmath>
 
 using namespace gerbolyze;
@@ -30,32 +32,27 @@ using namespace std;
  * This function handles transparency: Transparent SVG colors are mapped such that no gerber output is generated for
  * them.
  */
-enum gerber_color gerbolyze::svg_color_to_gerber(string color, string opacity, enum gerber_color default_val, const RenderSettings &rset) {
-    //cerr << "resolving svg color spec color=\"" << color << "\", opacity=\"" << opacity << "\", default=" << default_val << endl;
+static enum gerber_color resolve_svg_color(const char *color, const char *opacity, const RenderSettings &rset) {
+    //cerr << "resolving svg color spec color=\"" << color << "\", opacity=\"" << opacity << "\"" << endl;
     float alpha = 1.0;
-    if (!opacity.empty() && opacity[0] != '\0') {
+    if (opacity[0] != '\0') {
         char *endptr = nullptr;
-        alpha = strtof(opacity.data(), &endptr);
+        alpha = strtof(opacity, &endptr);
         assert(endptr);
         assert(*endptr == '\0');
     }
 
-    if (color.empty()) {
-        //cerr << "  -> default" << endl;
-        return default_val;
-    }
-
-    if (color == "none") {
+    if (!strcmp(color, "none")) {
         //cerr << "  -> none" << endl;
         return GRB_NONE;
     }
 
-    if (color.rfind("url(#", 0) != string::npos) {
+    if (!strncmp(color, "url(#", 5)) {
         //cerr << "  -> pattern" << endl;
         return GRB_PATTERN_FILL;
     }
 
-    if ((color.length() == 7 && color[0] == '#') || color.rfind("rgba", 0) != string::npos) {
+    if ((color[0] == '#' && strlen(color) == 7) || !strncmp(color, "rgba", 4)) {
         RGBAColor rgba(color);
         HSVColor hsv(rgba);
 
@@ -80,29 +77,77 @@ enum gerber_color gerbolyze::svg_color_to_gerber(string color, string opacity, e
     return GRB_DARK;
 }
 
-gerbolyze::RGBAColor::RGBAColor(string spec) {
-    /* resvg/usvg v0.18.0 added support for rgba(...) color specs */
-    if (spec.rfind("rgba(", 0) != string::npos) {
-        /* "rgba(127, 127, 200, 255)" */
-        std::regex reg("rgba\\(([0-9]+),([0-9]+),([0-9]+),([0-9]+)\\)");
-        std::smatch match;
+namespace {
+    /* Documents usually have a ton of paths, but only a handful of distinct colors. Remember what we resolved each
+     * color/opacity pair to so we only have to parse it once. */
+    struct ColorMemo {
+        bool flip = false;
+        string key;
+        unordered_map<string, enum gerber_color> table;
+    };
+}
 
-        assert(std::regex_match(spec, match, reg));
+/* With --jobs, paths get rendered on several threads at once. WASI has no threads. */
+#ifndef WASI
+static thread_local ColorMemo color_memo;
+#else
+static ColorMemo color_memo;
+#endif
+
+enum gerber_color gerbolyze::svg_color_to_gerber(const char *color, const char *opacity, enum gerber_color default_val, const RenderSettings &rset) {
+    if (color[0] == '\0') {
+        //cerr << "  -> default" << endl;
+        return default_val;
+    }
+
+    /* Don't let this grow without bounds on documents with lots of different colors */
+    if (color_memo.flip != rset.flip_color_interpretation || color_memo.table.size() > 1024) {
+        color_memo.table.clear();
+        color_memo.flip = rset.flip_color_interpretation;
+    }
 
+    color_memo.key.assign(color);
+    color_memo.key.push_back('\0');
+    color_memo.key.append(opacity);
+
+    auto it = color_memo.table.find(color_memo.key);
+    if (it != color_memo.table.end()) {
+        return it->second;
+    }
+
+    enum gerber_color rv = resolve_svg_color(color, opacity, rset);
+    color_memo.table.emplace(color_memo.key, rv);
+    return rv;
+}
+
+/* Parse a decimal color channel value between 0 and 255 with optional whitespace around it */
+static int parse_color_channel(const char *&p) {
+    while (*p == ' ')
+        p++;
+
+    char *endptr = nullptr;
+    long val = strtol(p, &endptr, 10);
+    assert(endptr && endptr != p);
+    assert(0 <= val && val <= 255);
+    p = endptr;
+
+    while (*p == ' ')
+        p++;
+    return val;
+}
+
+gerbolyze::RGBAColor::RGBAColor(const char *spec) {
+    /* resvg/usvg v0.18.0 added support for rgba(...) color specs */
+    if (!strncmp(spec, "rgba(", 5)) {
+        /* "rgba(127,127,200,255)" */
+        const char *p = spec + 5;
         int c[4];
         for (size_t i=0; i<4; i++) {
-            assert (match.size() == 5);
-            char *endptr = nullptr;
-            string span = match[i+1].str();
-            c[i] = strtoul(span.data(), &endptr, 10);
-            assert(endptr && endptr != span.data());
-            assert(*endptr == '\0');
+            c[i] = parse_color_channel(p);
+            assert(*p == (i < 3 ? ',' : ')'));
+            p++;
         }
-
-        assert (0 <= c[0] && c[0] <= 255);
-        assert (0 <= c[1] && c[1] <= 255);
-        assert (0 <= c[2] && c[2] <= 255);
-        assert (0 <= c[3] && c[3] <= 255);
+        assert(*p == '\0');
 
         r = c[0]/255.0f;
         g = c[1]/255.0f;
@@ -113,10 +158,9 @@ gerbolyze::RGBAColor::RGBAColor(string spec) {
         /* "#FF00E3" */
         assert(spec[0] == '#');
         char *endptr = nullptr;
-        const char *c = spec.data();
-        int rgb = strtol(c + 1, &endptr, 16);
+        int rgb = strtol(spec + 1, &endptr, 16);
         assert(endptr);
-        assert(endptr == c + 7);
+        assert(endptr == spec + 7);
         assert(*endptr == '\0');
         r = ((rgb >> 16) & 0xff) / 255.0f;
         g = ((rgb >>  8) & 0xff) / 255.0f;
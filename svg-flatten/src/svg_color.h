@@ -34,7 +34,7 @@ enum gerber_color {
 class RGBAColor {
 public:
     float r, g, b, a;
-    RGBAColor(std::string spec);
+    RGBAColor(const char *spec);
 };
 
 class HSVColor {
@@ -43,7 +43,7 @@ public:
     HSVColor(const RGBAColor &color);
 };
 
-enum gerber_color svg_color_to_gerber(std::string color, std::string opacity, enum gerber_color default_val, const RenderSettings &rset);
+enum gerber_color svg_color_to_gerber(const char *color, const char *opacity, enum gerber_color default_val, const RenderSettings &rset);
 enum gerber_color gerber_color_invert(enum gerber_color color);
 enum gerber_color gerber_fill_color(const pugi::xml_node &node, const RenderSettings &rset);
 enum gerber_color gerber_stroke_color(const pugi::xml_node &node, const RenderSettings &rset);
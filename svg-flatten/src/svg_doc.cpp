@@ -19,34 +19,72 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <memory>
 
 #include <gerbolyze.hpp>
 #include "svg_import_defs.h"
 #include "svg_color.h"
 #include "svg_geom.h"
+#include "geom_backend.h"
 #include "svg_path.h"
 #include "vec_core.h"
 #include "nopencv.hpp"
+#include "util.h"
+#ifndef WASI
+#include "parallel_render.h"
+#endif
 
 using namespace gerbolyze;
 using namespace std;
 using namespace ClipperLib;
 
+/* usvg's output has no comments, processing instructions, CDATA sections or meaningful whitespace text, so we can
+ * tell pugixml to not bother with any of that. */
+static const unsigned int svg_parse_flags = pugi::parse_escapes | pugi::parse_wconv_attribute;
+
+gerbolyze::SVGDocument::SVGDocument() : _valid(false) {}
+gerbolyze::SVGDocument::~SVGDocument() {}
+
 bool gerbolyze::SVGDocument::load(string filename) {
-    ifstream in_f;
-    in_f.open(filename);
+    auto mapping = make_unique<MappedFile>();
+    if (!mapping->open(filename)) {
+        return false;
+    }
 
-    return in_f && load(in_f);
+    m_mapping = std::move(mapping);
+    string().swap(m_buffer);
+    return parse_buffer(m_mapping->data(), m_mapping->size());
 }
 
 bool gerbolyze::SVGDocument::load(istream &in) {
     /* Load XML document */
-    auto res = svg_doc.load(in);
+    auto res = svg_doc.load(in, svg_parse_flags);
     if (!res) {
         cerr << "Cannot parse input file" << endl;
         return false;
     }
 
+    return setup_document();
+}
+
+bool gerbolyze::SVGDocument::load_buffer(string &&buf) {
+    m_buffer = std::move(buf);
+    m_mapping.reset();
+    return parse_buffer(m_buffer.data(), m_buffer.size());
+}
+
+/* Parse in place, so large attributes such as embedded images stay where they are in the buffer. */
+bool gerbolyze::SVGDocument::parse_buffer(char *data, size_t size) {
+    auto res = svg_doc.load_buffer_inplace(data, size, svg_parse_flags);
+    if (!res) {
+        cerr << "Cannot parse input file: " << res.description() << endl;
+        return false;
+    }
+
+    return setup_document();
+}
+
+bool gerbolyze::SVGDocument::setup_document() {
     root_elem = svg_doc.child("svg");
     if (!root_elem) {
         cerr << "Input file is missing root <svg> element" << endl;
@@ -85,19 +123,22 @@ bool gerbolyze::SVGDocument::load(istream &in) {
     return true;
 }
 
+/* These two get called from several render threads at once with --jobs, so they must not use map::operator[]. */
 const Paths *gerbolyze::SVGDocument::lookup_clip_path(const pugi::xml_node &node) {
     string id(usvg_id_url(node.attribute("clip-path").value()));
-    if (id.empty() || clip_path_map.count(id) == 0) {
+    auto it = clip_path_map.find(id);
+    if (id.empty() || it == clip_path_map.end()) {
         return nullptr;
     }
-    return &clip_path_map[id];
+    return &it->second;
 }
 
 Pattern *gerbolyze::SVGDocument::lookup_pattern(const string id) {
-    if (id.empty() || pattern_map.count(id) == 0) {
+    auto it = pattern_map.find(id);
+    if (id.empty() || it == pattern_map.end()) {
         return nullptr;
     }
-    return &pattern_map[id];
+    return &it->second;
 };
 
 /* Used to convert mm values from configuration such as the minimum feature size into document units. */
@@ -113,7 +154,7 @@ bool IDElementSelector::match(const pugi::xml_node &node, bool is_toplevel, bool
     string id = node.attribute("id").value();
     //cerr << "match id=" << id << " toplevel=" << is_toplevel << " parent=" << parent_include << endl;
     if (is_toplevel && layers) {
-        bool layer_match = std::find(layers->begin(), layers->end(), id) != layers->end();
+        bool layer_match = layers->count(id);
         if (!layer_match) {
             //cerr << "Rejecting layer \"" << id << "\"" << endl;
             return false;
@@ -123,8 +164,8 @@ bool IDElementSelector::match(const pugi::xml_node &node, bool is_toplevel, bool
     if (include.empty() && exclude.empty())
         return true;
 
-    bool include_match = std::find(include.begin(), include.end(), id) != include.end();
-    bool exclude_match = std::find(exclude.begin(), exclude.end(), id) != exclude.end();
+    bool include_match = include.count(id);
+    bool exclude_match = exclude.count(id);
     //cerr << "  excl=" << exclude_match << " incl=" << include_match << endl;
 
     if (is_toplevel) {
@@ -145,11 +186,48 @@ bool IDElementSelector::match(const pugi::xml_node &node, bool is_toplevel, bool
     return parent_include;
 }
 
-/* Recursively export all SVG elements in the given group. */
-void gerbolyze::SVGDocument::export_svg_group(RenderContext &ctx, const pugi::xml_node &group) {
+/* Collect the ancestors of all included elements in one pass over the document, so that descendants_may_match does
+ * not have to search each group's subtree again. */
+void IDElementSelector::prepare(const pugi::xml_node &root) const {
+    m_include_ancestors.clear();
+    m_prepared = true;
+    if (include.empty())
+        return;
 
-    /* Fetch clip path from global registry and transform it into document coordinates. */
-    Paths clip_path;
+    root.find_node([this](const pugi::xml_node &desc) {
+            string id = desc.attribute("id").value();
+            if (include.count(id) && !exclude.count(id)) {
+                /* Stop once we reach a part of the tree that an earlier match already marked */
+                for (auto anc = desc.parent(); anc && m_include_ancestors.insert(anc.internal_object()).second;
+                        anc = anc.parent()) {
+                }
+            }
+            return false;
+        });
+}
+
+bool IDElementSelector::descendants_may_match(const pugi::xml_node &node) const {
+    /* Below the top level, everything matches if we have neither includes nor excludes. */
+    if (include.empty() && exclude.empty())
+        return true;
+
+    /* Below a group that did not match, only explicitly included elements produce any output. */
+    if (include.empty())
+        return false;
+
+    if (m_prepared) {
+        return m_include_ancestors.count(node.internal_object());
+    }
+
+    return !node.find_node([this](const pugi::xml_node &desc) {
+            string id = desc.attribute("id").value();
+            return include.count(id) && !exclude.count(id);
+        }).empty();
+}
+
+/* Fetch a group's clip path from the global registry, transform it into document coordinates and clip it against the
+ * parent's clip path. */
+void gerbolyze::SVGDocument::load_group_clip(const pugi::xml_node &group, const Paths &parent_clip, const IntRect *parent_rect, xform2d &mat, Paths &out) {
     auto *lookup = lookup_clip_path(group);
     if (!lookup) {
         string id(usvg_id_url(group.attribute("clip-path").value()));
@@ -158,29 +236,138 @@ void gerbolyze::SVGDocument::export_svg_group(RenderContext &ctx, const pugi::xm
         }
 
     } else {
-        clip_path = *lookup;
-        ctx.mat().transform_paths(clip_path);
+        out = *lookup;
+        mat.transform_paths(out);
     }
 
     /* Clip against parent's clip path (both are now in document coordinates) */
-    if (!ctx.clip().empty()) {
-        if (!clip_path.empty()) {
-            Clipper c;
-            c.StrictlySimple(true);
-            c.AddPaths(ctx.clip(), ptClip, /* closed */ true);
-            c.AddPaths(clip_path, ptSubject, /* closed */ true);
-            /* Nonzero fill since both input clip paths must already have been preprocessed by clipper. */
-            c.Execute(ctIntersection, clip_path, pftNonZero);
-        } else {
-            clip_path = ctx.clip();
+    if (parent_clip.empty()) {
+        return;
+    }
+
+    if (out.empty()) {
+        out = parent_clip;
+        return;
+    }
+
+    /* Most clips end up being intersected with just the viewport rect */
+    if (parent_rect) {
+        IntRect bounds = get_paths_bounds(out);
+        if (rect_contains(*parent_rect, bounds)) {
+            return;
+        }
+
+        if (rects_disjoint(*parent_rect, bounds)) {
+            out.clear();
+            return;
+        }
+    }
+
+    /* Nonzero fill since both input clip paths must already have been preprocessed by clipper. */
+    geometry_backend().boolean_op(ctIntersection, out, parent_clip, out);
+}
+
+/* Look up a group's clip path in the clip cache, or load it and put it there. */
+const InternedClip *gerbolyze::SVGDocument::intern_clip(const pugi::xml_node &group, const InternedClip &parent, xform2d &mat) {
+    string id(usvg_id_url(group.attribute("clip-path").value()));
+    if (id.empty()) { /* Most groups don't have a clip path of their own */
+        return &parent;
+    }
+
+    ClipCacheKey key {id, &parent, mat.coefficients()};
+    auto it = clip_cache.find(key);
+    if (it != clip_cache.end()) {
+        clip_cache_hits++;
+        return &it->second;
+    }
+
+    clip_cache_misses++;
+    InternedClip &entry = clip_cache[key];
+    load_group_clip(group, parent.paths, parent.is_rect ? &parent.bounds : nullptr, mat, entry.paths);
+    entry.bounds = get_paths_bounds(entry.paths);
+    entry.is_rect = paths_are_rect(entry.paths, entry.bounds);
+    return &entry;
+}
+
+void gerbolyze::SVGDocument::print_clip_cache_stats(ostream &out) const {
+    uint64_t total = clip_cache_hits + clip_cache_misses;
+    out << "Clip cache: " << clip_cache_hits << " hits, " << clip_cache_misses << " misses";
+    if (total > 0) {
+        out << " (" << (100 * clip_cache_hits / total) << "% hit rate)";
+    }
+    out << ", " << clip_cache.size() << " entries" << endl;
+}
+
+/* Recursively export all SVG elements in the given group. */
+void gerbolyze::SVGDocument::export_svg_group(RenderContext &ctx, const pugi::xml_node &group) {
+    /* Inside patterns we don't have an interned clip to use as a cache key. There, we always have to do the work. */
+    const InternedClip *interned = nullptr;
+    Paths local_clip;
+    if (ctx.interned_clip()) {
+        interned = intern_clip(group, *ctx.interned_clip(), ctx.mat());
+    } else {
+        load_group_clip(group, ctx.clip(), ctx.clip_rect(), ctx.mat(), local_clip);
+    }
+
+    /* With --jobs, paths and images are rendered on the ParallelRenderer's worker threads. Those can outlive this
+     * function's stack frame, so unless the clip is interned they get their own reference-counted copy of it. */
+    shared_ptr<Paths> shared_clip;
+
+    /* If our sink wants lookahead, for each child find the bounds of everything that is rendered after it until the end
+     * of the layer. */
+    vector<IntRect> following;
+    if (ctx.lookahead()) {
+        vector<pugi::xml_node> children(group.children().begin(), group.children().end());
+        following.resize(children.size());
+        IntRect acc = *ctx.lookahead();
+        for (size_t i=children.size(); i-- > 0; ) {
+            following[i] = acc;
+            rect_extend(acc, element_bounds(children[i], ctx.mat()));
         }
     }
+    IntRect last_lookahead {1, 1, 0, 0};
 
     /* Iterate over the group's children, exporting them one by one. */
+    size_t child_index = 0;
     for (const auto &node : group.children()) {
+        size_t i = child_index++;
         string name(node.name());
         bool match = ctx.match(node);
-        RenderContext elem_ctx(ctx, xform2d(node.attribute("transform").value()), clip_path, match);
+
+        /* Don't bother setting up anything for elements the selector rules out. For groups, this skips the entire
+         * subtree, so e.g. rendering a single layer only costs as much as that layer. */
+        if (!match) {
+            if (name == "path" || name == "image")
+                continue;
+
+            if (name == "g" && !ctx.sel().descendants_may_match(node))
+                continue;
+        }
+
+        xform2d elem_xf(node.attribute("transform").value());
+        RenderContext elem_ctx = interned
+            ? RenderContext(ctx, elem_xf, *interned, match)
+            : RenderContext(ctx, elem_xf, local_clip, match);
+
+        IntRect elem_following {1, 1, 0, 0};
+        if (!following.empty()) {
+            /* Top-level groups are layers of their own, so for them nothing follows. */
+            if (!(ctx.root() && name == "g")) {
+                elem_following = following[i];
+            }
+            elem_ctx.set_lookahead(&elem_following);
+
+            /* Groups send their own when they get to their first path or image */
+            if (name == "path" || name == "image") {
+                IntRect box = element_bounds(node, ctx.mat());
+                rect_extend(box, elem_following);
+                if (box.left != last_lookahead.left || box.top != last_lookahead.top
+                        || box.right != last_lookahead.right || box.bottom != last_lookahead.bottom) {
+                    ctx.send_lookahead(box);
+                    last_lookahead = box;
+                }
+            }
+        }
 
         if (name == "g") {
             if (ctx.root()) { /* Treat top-level groups as "layers" like inkscape does. */
@@ -195,25 +382,36 @@ void gerbolyze::SVGDocument::export_svg_group(RenderContext &ctx, const pugi::xm
                 elem_ctx.sink() << tok;
             }
 
-        } else if (name == "path") {
-            if (!match)
-                continue;
-
-            export_svg_path(elem_ctx, node);
-
-        } else if (name == "image") {
-            if (!match)
-                continue;
-
-            ImageVectorizer *vec = ctx.settings().m_vec_sel.select(node);
-            if (!vec) {
-                cerr << "Cannot resolve vectorizer for node \"" << node.attribute("id").value() << "\"" << endl;
+        } else if (name == "path" || name == "image") {
+#ifndef WASI
+            if (ParallelRenderer *par = ctx.parallel()) {
+                if (!interned && !shared_clip) {
+                    shared_clip = make_shared<Paths>(local_clip);
+                }
+                const Paths *task_clip = interned ? &interned->paths : shared_clip.get();
+
+                bool has_lookahead = elem_ctx.lookahead();
+                par->submit([this, node, shared_clip, task_clip, mat=elem_ctx.mat(), included=elem_ctx.included(),
+                        has_lookahead, elem_following, &settings=ctx.settings(), &sel=ctx.sel()](PolygonSink &sink) {
+                    RenderContext task_ctx(settings, sink, sel, *task_clip, mat, included);
+                    if (has_lookahead) {
+                        task_ctx.set_lookahead(&elem_following);
+                    }
+                    if (string(node.name()) == "path") {
+                        export_svg_path(task_ctx, node);
+                    } else {
+                        export_svg_image(task_ctx, node);
+                    }
+                });
                 continue;
             }
+#endif
 
-            double min_feature_size_px = mm_to_doc_units(ctx.settings().m_minimum_feature_size_mm);
-            vec->vectorize_image(elem_ctx, node, min_feature_size_px);
-            delete vec;
+            if (name == "path") {
+                export_svg_path(elem_ctx, node);
+            } else {
+                export_svg_image(elem_ctx, node);
+            }
 
         } else if (name == "defs") {
             /* ignore */
@@ -223,6 +421,119 @@ void gerbolyze::SVGDocument::export_svg_group(RenderContext &ctx, const pugi::xm
     }
 }
 
+/* Conservative bounding box of everything an element renders in physical coordinates, for lookahead. mat is the
+ * element's parent's transform. */
+IntRect gerbolyze::SVGDocument::element_bounds(const pugi::xml_node &node, xform2d &mat) {
+    ElementBoundsKey key {node.internal_object(), mat.coefficients()};
+    {
+#ifndef WASI
+        lock_guard<mutex> lock(element_bounds_mutex);
+#endif
+        auto it = element_bounds_cache.find(key);
+        if (it != element_bounds_cache.end()) {
+            return it->second;
+        }
+    }
+
+    xform2d elem_mat(mat);
+    xform2d elem_xf(node.attribute("transform").value());
+    elem_mat.transform(elem_xf);
+
+    /* Everything, for things we can't predict */
+    IntRect unknown {-hiRange / 4, -hiRange / 4, hiRange / 4, hiRange / 4};
+
+    IntRect out {1, 1, 0, 0};
+    string name(node.name());
+    if (name == "g") {
+        for (const auto &child : node.children()) {
+            rect_extend(out, element_bounds(child, elem_mat));
+        }
+
+    } else if (name == "path") {
+        if (path_data_bounds(elem_mat, node.attribute("d").value(), out)) {
+            string stroke = node.attribute("stroke").value();
+            if (!stroke.empty() && stroke != "none") {
+                /* Miter joins reach out up to miterlimit times half the stroke width, square caps sqrt(2) times. */
+                double stroke_width = usvg_double_attr(node, "stroke-width", /* default */ 1.0);
+                double miter_limit = usvg_double_attr(node, "stroke-miterlimit", /* default */ 4.0);
+                cInt margin = (cInt)ceil(elem_mat.doc2phys_dist(stroke_width) * fmax(miter_limit, sqrt(2)) / 2.0
+                        * clipper_scale) + 1;
+                out = {out.left - margin, out.top - margin, out.right + margin, out.bottom + margin};
+            }
+        }
+
+    } else if (name == "image") {
+        /* With slice, vectorizers may draw outside of the image's box up to the clip. */
+        if (string(node.attribute("preserveAspectRatio").value()).find("slice") != string::npos) {
+            out = unknown;
+
+        } else {
+            double x = usvg_double_attr(node, "x", 0.0), y = usvg_double_attr(node, "y", 0.0);
+            double w = usvg_double_attr(node, "width", 0.0), h = usvg_double_attr(node, "height", 0.0);
+            Paths corners(1);
+            for (const d2p &p : {d2p{x, y}, d2p{x+w, y}, d2p{x+w, y+h}, d2p{x, y+h}}) {
+                d2p q = elem_mat.doc2phys(p);
+                corners[0].push_back({(cInt)round(q[0] * clipper_scale), (cInt)round(q[1] * clipper_scale)});
+            }
+            out = get_paths_bounds(corners);
+        }
+    }
+
+    /* Not held across the recursion above, so another thread may have beaten us to it. It got the same result. */
+#ifndef WASI
+    lock_guard<mutex> lock(element_bounds_mutex);
+#endif
+    element_bounds_cache[key] = out;
+    return out;
+}
+
+void gerbolyze::SVGDocument::export_svg_image(RenderContext &ctx, const pugi::xml_node &node) {
+    ImageVectorizer *vec = ctx.settings().m_vec_sel.select(node);
+    if (!vec) {
+        cerr << "Cannot resolve vectorizer for node \"" << node.attribute("id").value() << "\"" << endl;
+        return;
+    }
+
+    double min_feature_size_px = mm_to_doc_units(ctx.settings().m_minimum_feature_size_mm);
+    vec->vectorize_image(ctx, node, min_feature_size_px);
+    delete vec;
+}
+
+/* Cheap bounding box test of paths against the context's clip for the common case where the clip is an axis-aligned
+ * rectangle, which it usually is since by default it's just the viewport. margin shrinks the clip rect on all sides.
+ * If this returns CLIP_UNKNOWN, ask clipper. */
+enum clip_test_result { CLIP_UNKNOWN, CLIP_INSIDE, CLIP_OUTSIDE };
+static clip_test_result quick_clip_test(RenderContext &ctx, const Paths &paths, cInt margin=0) {
+    const IntRect *rect = ctx.clip_rect();
+    if (!rect) {
+        return CLIP_UNKNOWN;
+    }
+
+    if (paths.empty()) {
+        return CLIP_INSIDE;
+    }
+
+    if (paths[0].empty()) { /* get_paths_bounds can't handle this */
+        return CLIP_UNKNOWN;
+    }
+
+    IntRect shrunk {rect->left + margin, rect->top + margin, rect->right - margin, rect->bottom - margin};
+    if (shrunk.left > shrunk.right || shrunk.top > shrunk.bottom) {
+        return CLIP_UNKNOWN;
+    }
+
+    IntRect bounds = get_paths_bounds(paths);
+    if (rect_contains(shrunk, bounds)) {
+        return CLIP_INSIDE;
+    }
+
+    if (rects_disjoint(shrunk, bounds)) {
+        return CLIP_OUTSIDE;
+    }
+
+    return CLIP_UNKNOWN;
+}
+
 /* Export an SVG path element to gerber. Apply patterns and clip on the fly. */
 void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml_node &node) {
     enum gerber_color fill_color = gerber_fill_color(node, ctx.settings());
@@ -246,9 +557,10 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
     stroke_width = ctx.mat().doc2phys_dist(stroke_width);
 
     Paths stroke_open, stroke_closed;
-    PolyTree ptree_fill;
-    PolyTree ptree;
-    load_svg_path(ctx.mat(), node, stroke_open, stroke_closed, ptree_fill, ctx.settings().curve_tolerance_mm);
+    GeomTree ptree_fill;
+    GeomTree ptree;
+    load_svg_path(ctx.mat(), node, stroke_open, stroke_closed, ptree_fill, ctx.settings().curve_tolerance_mm,
+            ctx.settings().fast_curves);
 
     Paths fill_paths;
     PolyTreeToPaths(ptree_fill, fill_paths);
@@ -270,13 +582,16 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
             polsby_popper = fabs(fabs(polsby_popper) - 1.0);
             if (polsby_popper < ctx.settings().drill_test_polsby_popper_tolerance) {
                 if (!ctx.clip().empty()) {
-                    Clipper c;
-                    c.AddPath(p, ptSubject, /* closed */ true);
-                    c.AddPaths(ctx.clip(), ptClip, /* closed */ true);
-                    c.StrictlySimple(true);
-                    c.Execute(ctDifference, ptree_fill, pftNonZero, pftNonZero);
-                    if (ptree_fill.Total() > 0)
+                    clip_test_result res = quick_clip_test(ctx, Paths{p});
+                    if (res == CLIP_OUTSIDE)
                         continue;
+
+                    if (res == CLIP_UNKNOWN) {
+                        Paths outside;
+                        geometry_backend().boolean_op(ctDifference, {p}, ctx.clip(), outside);
+                        if (!outside.empty())
+                            continue;
+                    }
                 }
 
                 d2p centroid = nopencv::polygon_centroid(geom_poly);
@@ -295,14 +610,13 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
      */
     if (has_fill && !(ctx.settings().outline_mode && has_stroke)) {
         /* Clip paths. Consider all paths closed for filling. */
-        if (!ctx.clip().empty()) {
-            Clipper c;
-            c.AddPaths(fill_paths, ptSubject, /* closed */ true);
-            c.AddPaths(ctx.clip(), ptClip, /* closed */ true);
-            c.StrictlySimple(true);
+        clip_test_result fill_clip_res = ctx.clip().empty() ? CLIP_INSIDE : quick_clip_test(ctx, fill_paths);
+        if (fill_clip_res == CLIP_OUTSIDE) {
+            ptree_fill.Clear();
 
+        } else if (fill_clip_res == CLIP_UNKNOWN) {
             /* fill rules are nonzero since both subject and clip have already been normalized by clipper. */ 
-            c.Execute(ctIntersection, ptree_fill, pftNonZero, pftNonZero);
+            geometry_backend().boolean_op(ctIntersection, fill_paths, ctx.clip(), ptree_fill);
         }
 
         /* Call out to pattern tiler for pattern fills. The path becomes the clip here. */
@@ -330,15 +644,11 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
 
             /* export gerber */
             for (const auto &poly : f_polys) {
-                vector<array<double, 2>> out;
-                for (const auto &p : poly)
-                    out.push_back(std::array<double, 2>{
-                            ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                            });
+                PolygonView out(poly);
 
                 /* In outline mode, manually close polys */
-                if (ctx.settings().outline_mode && !out.empty())
-                    out.push_back(out[0]);
+                if (ctx.settings().outline_mode)
+                    out = out.closed();
 
                 ctx.sink() << (fill_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR) << ApertureToken() << out;
             }
@@ -346,10 +656,6 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
     }
 
     if (has_stroke) {
-        Clipper stroke_clip;
-        stroke_clip.StrictlySimple(true);
-        stroke_clip.AddPaths(ctx.clip(), ptClip, /* closed */ true);
-
         /* We forward strokes as regular gerber interpolations instead of tracing their outline using clipper when one
          * of these is true:
          *
@@ -386,26 +692,6 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
             // cerr << "  stroke_open.size() = " << stroke_open.size() << endl;
             ctx.sink() << (stroke_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR);
 
-            ClipperOffset offx;
-            offx.ArcTolerance = 0.01 * clipper_scale; /* see below. */
-            offx.MiterLimit = 10;
-            offx.AddPaths(ctx.clip(), jtRound, etClosedPolygon);
-            PolyTree clip_ptree;
-            offx.Execute(clip_ptree, -0.5 * stroke_width * clipper_scale);
-
-            Paths dilated_clip;
-            ClosedPathsFromPolyTree(clip_ptree, dilated_clip);
-
-            Clipper stroke_clip;
-            stroke_clip.StrictlySimple(true);
-            stroke_clip.AddPaths(dilated_clip, ptClip, /* closed */ true);
-            stroke_clip.AddPaths(stroke_closed, ptSubject, /* closed */ true);
-            stroke_clip.AddPaths(stroke_open, ptSubject, /* closed */ false);
-            stroke_clip.Execute(ctDifference, ptree, pftNonZero, pftNonZero);
-            
-            /* Did any part of the path clip the clip path (which defaults to the document border)? */
-            bool nothing_clipped = ptree.Total() == 0;
-
             /* Can all joins be mapped? True if either jtRound, or if there are no joins. */
             bool joins_can_be_mapped = true;
             if (join_type != ClipperLib::jtRound) {
@@ -418,6 +704,35 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
 
             /* Can all ends be mapped? True if either etOpenRound or if there are no ends (we only have closed paths) */
             bool ends_can_be_mapped = (end_type == ClipperLib::etOpenRound) || (stroke_open.size() == 0);
+
+            /* Did any part of the path clip the clip path (which defaults to the document border)? This is the
+             * expensive part, so only check it when the answer actually matters. */
+            bool nothing_clipped = false;
+            if (ctx.sink().can_do_apertures() && !ctx.settings().outline_mode && ends_can_be_mapped && joins_can_be_mapped) {
+                cInt margin = (cInt)ceil(0.5 * stroke_width * clipper_scale);
+                clip_test_result res_closed = quick_clip_test(ctx, stroke_closed, margin);
+                clip_test_result res_open = quick_clip_test(ctx, stroke_open, margin);
+
+                if (res_closed == CLIP_INSIDE && res_open == CLIP_INSIDE) {
+                    nothing_clipped = true;
+
+                } else if ((res_closed == CLIP_OUTSIDE && !stroke_closed.empty())
+                        || (res_open == CLIP_OUTSIDE && !stroke_open.empty())) {
+                    nothing_clipped = false;
+
+                } else {
+                    Paths dilated_clip;
+                    geometry_backend().offset({{ctx.clip(), jtRound, etClosedPolygon}},
+                            -0.5 * stroke_width * clipper_scale, /* miter limit */ 10,
+                            0.01 * clipper_scale /* see below. */, dilated_clip);
+
+                    Paths outside;
+                    geometry_backend().boolean_op(ctDifference, stroke_closed, dilated_clip, outside, pftNonZero,
+                            &stroke_open);
+                    nothing_clipped = outside.empty();
+                }
+            }
+
             /* Can gerber losslessly express this path? */
             bool gerber_lossless = nothing_clipped && ends_can_be_mapped && joins_can_be_mapped;
             
@@ -443,29 +758,26 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
             /* else fall through to normal processing */
         }
 
-        ClipperOffset offx;
-        offx.ArcTolerance = 0.01 * clipper_scale; /* 10µm; TODO: Make this configurable */
-        offx.MiterLimit = stroke_miterlimit;
-
         //cerr << "offsetting " << stroke_closed.size() << " closed and " << stroke_open.size() << " open paths" << endl;
         /* For stroking we have to separately handle open and closed paths since coincident start and end points may
-         * render differently than joined start and end points. */
-        offx.AddPaths(stroke_closed, join_type, etClosedLine);
-        offx.AddPaths(stroke_open, join_type, end_type);
-        /* Execute clipper offset operation to generate stroke outlines */
-        offx.Execute(ptree, 0.5 * stroke_width * clipper_scale);
+         * render differently than joined start and end points. Arc tolerance is 10µm; TODO: Make this configurable */
+        geometry_backend().offset({{stroke_closed, join_type, etClosedLine}, {stroke_open, join_type, end_type}},
+                0.5 * stroke_width * clipper_scale, stroke_miterlimit, 0.01 * clipper_scale, ptree);
 
         /* Clip. Note that (outside of outline mode) after the clipper outline operation, all we have is closed paths as
          * any open path's stroke outline is itself a closed path. */
         if (!ctx.clip().empty()) {
             Paths outline_paths;
             PolyTreeToPaths(ptree, outline_paths);
-            Clipper stroke_clip;
-            stroke_clip.StrictlySimple(true);
-            stroke_clip.AddPaths(ctx.clip(), ptClip, /* closed */ true);
-            stroke_clip.AddPaths(outline_paths, ptSubject, /* closed */ true);
-            /* fill rules are nonzero since both subject and clip have already been normalized by clipper. */ 
-            stroke_clip.Execute(ctIntersection, ptree, pftNonZero, pftNonZero);
+
+            clip_test_result res = quick_clip_test(ctx, outline_paths);
+            if (res == CLIP_OUTSIDE) {
+                ptree.Clear();
+
+            } else if (res == CLIP_UNKNOWN) {
+                /* fill rules are nonzero since both subject and clip have already been normalized by clipper. */ 
+                geometry_backend().boolean_op(ctIntersection, outline_paths, ctx.clip(), ptree);
+            }
         }
 
         /* Call out to pattern tiler for pattern strokes. The stroke's outline becomes the clip here. */
@@ -500,13 +812,35 @@ void gerbolyze::SVGDocument::render(const RenderSettings &rset, PolygonSink &sin
 
     /* Scale document pixels to mm for sinks */
     PolygonScaler scaler(sink, doc_units_to_mm(1.0));
-    RenderContext ctx(rset, scaler, sel, vb_paths);
 
     /* Load clip paths from defs with given bezier flattening tolerance and unit scale */
     load_clips(rset);
+    for (auto &[id, pattern] : pattern_map) {
+        pattern.clear_cache();
+    }
+    element_bounds_cache.clear();
+    sel.prepare(root_elem);
+
+    /* Nothing follows the root group */
+    IntRect root_lookahead {1, 1, 0, 0};
+    const IntRect *lookahead = scaler.wants_lookahead() ? &root_lookahead : nullptr;
 
     scaler.header({vb_x, vb_y}, {vb_w, vb_h});
-    export_svg_group(ctx, root_elem);
+#ifndef WASI
+    if (rset.jobs > 1) {
+        ParallelRenderer par(scaler, rset.jobs);
+        RenderContext ctx(rset, par, sel, vb_clip, &par);
+        ctx.set_lookahead(lookahead);
+        export_svg_group(ctx, root_elem);
+        par.finish();
+
+    } else
+#endif
+    {
+        RenderContext ctx(rset, scaler, sel, vb_clip);
+        ctx.set_lookahead(lookahead);
+        export_svg_group(ctx, root_elem);
+    }
     scaler.footer();
 }
 
@@ -527,7 +861,9 @@ void gerbolyze::SVGDocument::setup_viewport_clip() {
             {vb_x,      vb_y+vb_h}}) {
         vb_path.push_back({ (cInt)round(p[0] * clipper_scale), (cInt)round(p[1] * clipper_scale) });
     }
-    vb_paths.push_back(vb_path);
+    vb_clip.paths.push_back(vb_path);
+    vb_clip.bounds = get_paths_bounds(vb_clip.paths);
+    vb_clip.is_rect = paths_are_rect(vb_clip.paths, vb_clip.bounds);
 }
 
 void gerbolyze::SVGDocument::load_patterns() {
@@ -538,13 +874,24 @@ void gerbolyze::SVGDocument::load_patterns() {
 }
 
 void gerbolyze::SVGDocument::load_clips(const RenderSettings &rset) {
+    /* Clip paths only depend on how we flatten curves. When rendering several outputs from one document, only load them
+     * once. */
+    if (clips_loaded && clips_curve_tolerance == rset.curve_tolerance_mm && clips_fast_curves == rset.fast_curves) {
+        return;
+    }
+    clip_path_map.clear();
+    clip_cache.clear();
+    clips_loaded = true;
+    clips_curve_tolerance = rset.curve_tolerance_mm;
+    clips_fast_curves = rset.fast_curves;
+
     /* Set up document-wide clip path registry: Extract clip path definitions from <defs> element */
     for (const auto &node : defs_node.children("clipPath")) {
 
         xform2d local_xf(node.attribute("transform").value());
 
         string meta_clip_path_id(usvg_id_url(node.attribute("clip-path").value()));
-        Clipper c;
+        Paths child_paths;
 
         /* The clipPath node can only contain <path> children. usvg converts all geometric objects (rect etc.) to
          * <path>s. Raster images are invalid inside a clip path. usvg removes all groups that are not relevant to
@@ -552,36 +899,37 @@ void gerbolyze::SVGDocument::load_clips(const RenderSettings &rset) {
          */
         for (const auto &child : node.children("path")) {
             Paths _stroke_open, _stroke_closed; /* discarded */
-            PolyTree ptree_fill;
+            GeomTree ptree_fill;
             /* TODO: we currently only support clipPathUnits="userSpaceOnUse", not "objectBoundingBox". */
             xform2d child_xf(local_xf);
             child_xf.transform(xform2d(child.attribute("transform").value()));
 
-            load_svg_path(child_xf, child, _stroke_open, _stroke_closed, ptree_fill, rset.curve_tolerance_mm);
+            load_svg_path(child_xf, child, _stroke_open, _stroke_closed, ptree_fill, rset.curve_tolerance_mm,
+                    rset.fast_curves);
 
             Paths paths;
             PolyTreeToPaths(ptree_fill, paths);
-            c.AddPaths(paths, ptSubject, /* closed */ false);
+            child_paths.insert(child_paths.end(), paths.begin(), paths.end());
         }
 
         /* Support clip paths that themselves have clip paths */
+        Paths meta_clip;
         if (!meta_clip_path_id.empty()) {
             if (clip_path_map.count(meta_clip_path_id) > 0) {
                 /* all clip paths must be closed */
-                c.AddPaths(clip_path_map[meta_clip_path_id], ptClip, /* closed */ true);
+                meta_clip = clip_path_map[meta_clip_path_id];
 
             } else {
                 cerr << "Warning: Cannot find clip path with ID \"" << meta_clip_path_id << "\", ignoring." << endl;
             }
         }
 
-        PolyTree ptree;
-        c.StrictlySimple(true);
-        /* This unions all child <path>s together and at the same time applies any meta clip path. */
+        /* This unions all child <path>s together and at the same time applies any meta clip path. The child paths go
+         * in as open paths. */
         /* The fill rules are both nonzero since both subject and clip have already been normalized by clipper. */ 
-        c.Execute(ctUnion, ptree, pftNonZero, pftNonZero);
         /* Insert into document clip path map */
-        PolyTreeToPaths(ptree, clip_path_map[node.attribute("id").value()]);
+        geometry_backend().boolean_op(ctUnion, {}, meta_clip, clip_path_map[node.attribute("id").value()], pftNonZero,
+                &child_paths);
     }
 }
 
@@ -589,42 +937,110 @@ void gerbolyze::SVGDocument::load_clips(const RenderSettings &rset) {
 gerbolyze::RenderContext::RenderContext(const RenderSettings &settings,
         PolygonSink &sink,
         const ElementSelector &sel,
-        ClipperLib::Paths &clip) :
+        const ClipperLib::Paths &clip,
+        ParallelRenderer *parallel) :
     m_sink(sink),
     m_settings(settings),
     m_mat(),
     m_root(true),
     m_included(false),
     m_sel(sel),
-    m_clip(clip)
+    m_clip(clip),
+    m_parallel(parallel)
+{
+}
+
+gerbolyze::RenderContext::RenderContext(const RenderSettings &settings,
+        PolygonSink &sink,
+        const ElementSelector &sel,
+        const InternedClip &clip,
+        ParallelRenderer *parallel) :
+    RenderContext(settings, sink, sel, clip.paths, parallel)
+{
+    m_interned_clip = &clip;
+}
+
+gerbolyze::RenderContext::RenderContext(const RenderSettings &settings,
+        PolygonSink &sink,
+        const ElementSelector &sel,
+        const ClipperLib::Paths &clip,
+        const xform2d &mat,
+        bool included) :
+    m_sink(sink),
+    m_settings(settings),
+    m_mat(mat),
+    m_root(false),
+    m_included(included),
+    m_sel(sel),
+    m_clip(clip),
+    m_parallel(nullptr)
 {
 }
 
 gerbolyze::RenderContext::RenderContext(RenderContext &parent, xform2d transform) :
     RenderContext(parent, transform, parent.clip(), parent.included())
 {
+    m_interned_clip = parent.interned_clip();
 }
 
-gerbolyze::RenderContext::RenderContext(RenderContext &parent, xform2d transform, ClipperLib::Paths &clip, bool included) :
+gerbolyze::RenderContext::RenderContext(RenderContext &parent, xform2d transform, const InternedClip &clip, bool included) :
+    RenderContext(parent, transform, clip.paths, included)
+{
+    m_interned_clip = &clip;
+}
+
+gerbolyze::RenderContext::RenderContext(RenderContext &parent, xform2d transform, const ClipperLib::Paths &clip, bool included) :
     m_sink(parent.sink()),
     m_settings(parent.settings()),
     m_mat(parent.mat()),
     m_root(false),
     m_included(included),
     m_sel(parent.sel()),
-    m_clip(clip)
+    m_clip(clip),
+    m_parallel(parent.parallel()),
+    m_lookahead(parent.lookahead())
 {
     m_mat.transform(transform);
 }
 
-gerbolyze::RenderContext::RenderContext(RenderContext &parent, PolygonSink &sink, ClipperLib::Paths &clip) :
+gerbolyze::RenderContext::RenderContext(RenderContext &parent, PolygonSink &sink, const ClipperLib::Paths &clip) :
     m_sink(sink),
     m_settings(parent.settings()),
     m_mat(parent.mat()),
     m_root(false),
     m_included(true),
     m_sel(parent.sel()),
-    m_clip(clip)
+    m_clip(clip),
+    /* Everything rendered through this context has to end up in the given sink, not on the ParallelRenderer */
+    m_parallel(nullptr)
 {
 }
 
+ClipperLib::IntRect gerbolyze::RenderContext::clip_bounds() {
+    if (m_interned_clip) {
+        return m_interned_clip->bounds;
+    }
+    return get_paths_bounds(m_clip);
+}
+
+void gerbolyze::RenderContext::send_lookahead(const ClipperLib::IntRect &box) {
+    if (box.left > box.right) { /* nothing follows */
+        m_sink << LookaheadToken({1, 1}, {0, 0});
+        return;
+    }
+
+    m_sink << LookaheadToken({(double)box.left / clipper_scale, (double)box.top / clipper_scale},
+            {(double)box.right / clipper_scale, (double)box.bottom / clipper_scale});
+}
+
+const ClipperLib::IntRect *gerbolyze::RenderContext::clip_rect() {
+    if (m_interned_clip) {
+        return m_interned_clip->is_rect ? &m_interned_clip->bounds : nullptr;
+    }
+
+    if (!m_clip_rect_checked) {
+        m_clip_is_rect = paths_are_rect(m_clip, m_clip_rect);
+        m_clip_rect_checked = true;
+    }
+    return m_clip_is_rect ? &m_clip_rect : nullptr;
+}
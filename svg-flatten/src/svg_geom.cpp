@@ -23,8 +23,12 @@
 #include <iostream>
 #include <sstream>
 #include <queue>
+#include <vector>
+#include <tuple>
+#include <algorithm>
 #include <assert.h>
 #include "svg_import_defs.h"
+#include "geom_backend.h"
 
 using namespace ClipperLib;
 using namespace std;
@@ -91,7 +95,220 @@ enum ClipperLib::JoinType gerbolyze::clipper_join_type(const pugi::xml_node &nod
     return ClipperLib::jtMiter;
 }
 
-static void dehole_polytree_worker(PolyNode &ptree, Paths &out, queue<PolyTree> &todo) {
+namespace {
+
+/* A zero-width cut-in from a hole's leftmost vertex straight left to the nearest edge of the outline or of another hole
+ * that is further left. */
+struct KeyholeBridge {
+    size_t hole; /* index of the bridged hole in rings */
+    size_t ring; /* index of the ring the bridge ends on */
+    size_t edge; /* index of the start vertex of the edge the bridge ends on */
+    double dist; /* squared distance of the end point from the edge's start vertex, for ordering along the edge */
+    IntPoint at; /* end point of the bridge on that edge */
+
+    bool operator<(const KeyholeBridge &other) const {
+        return tie(ring, edge, dist) < tie(other.ring, other.edge, other.dist);
+    }
+};
+
+struct KeyholeEdge {
+    size_t ring, index;
+    cInt y0, y1;
+};
+
+struct KeyholeFrame {
+    size_t ring;
+    size_t edge; /* next edge to walk */
+    size_t bridge; /* next bridge in the sorted bridge list */
+    IntPoint back_to; /* where to continue in the parent ring once we are done */
+};
+
+} /* anonymous namespace */
+
+/* Bridge all holes into the outline with zero-width cut-ins, following gerber's G36 cut-in convention. Each hole is
+ * joined at its leftmost vertex with a horizontal cut to the left. Anything that cut can hit lies further left, so it
+ * belongs to the outline or to a hole sorting before this one. Since bridges only ever point to earlier rings, they form
+ * a tree rooted at the outline and never cross each other. All cuts are found in a single sweep over the edges in y, and
+ * each cut only looks at the edges crossing its scan line. The result is a single path that is simple except for the
+ * cut-ins.
+ *
+ * Returns false if some hole could not be bridged, which can only happen for inputs that are not strictly simple. */
+bool gerbolyze::keyhole_polygon(const Path &outer, const Paths &holes, Path &out) {
+    vector<Path> rings;
+    rings.reserve(holes.size() + 1);
+    rings.push_back(outer);
+    bool outer_orientation = Orientation(outer);
+
+    /* Holes run opposite to the outline and start at their leftmost vertex. */
+    for (const auto &hole : holes) {
+        if (hole.size() < 3) {
+            continue;
+        }
+
+        auto leftmost = min_element(hole.begin(), hole.end(), [](const IntPoint &a, const IntPoint &b) {
+                return a.X < b.X || (a.X == b.X && a.Y < b.Y);
+            });
+        Path &ring = rings.emplace_back();
+        ring.reserve(hole.size());
+        ring.insert(ring.end(), leftmost, hole.end());
+        ring.insert(ring.end(), hole.begin(), leftmost);
+
+        if (Orientation(ring) == outer_orientation) {
+            reverse(ring.begin() + 1, ring.end());
+        }
+    }
+
+    /* Holes sort by their leftmost vertex, the outline goes before everything. */
+    auto before = [&rings](size_t a, size_t b) {
+        if (a == 0 || b == 0) {
+            return a == 0 && b != 0;
+        }
+        const IntPoint &pa = rings[a][0], &pb = rings[b][0];
+        return pa.X < pb.X || (pa.X == pb.X && (pa.Y < pb.Y || (pa.Y == pb.Y && a < b)));
+    };
+
+    vector<KeyholeEdge> edges;
+    for (size_t r=0; r<rings.size(); r++) {
+        const Path &ring = rings[r];
+        for (size_t i=0; i<ring.size(); i++) {
+            cInt ya = ring[i].Y, yb = ring[(i+1) % ring.size()].Y;
+            if (ya != yb) { /* A horizontal cut never needs to end on a horizontal edge */
+                edges.push_back({r, i, min(ya, yb), max(ya, yb)});
+            }
+        }
+    }
+
+    /* Events are sorted by y. At the same y, edges are added first and removed last so that cuts through vertices see
+     * both adjacent edges. Event kinds: 0: add edge, 1: cut, 2: remove edge */
+    vector<tuple<cInt, int, size_t>> events;
+    events.reserve(2*edges.size() + rings.size());
+    for (size_t i=0; i<edges.size(); i++) {
+        events.emplace_back(edges[i].y0, 0, i);
+        events.emplace_back(edges[i].y1, 2, i);
+    }
+    for (size_t r=1; r<rings.size(); r++) {
+        events.emplace_back(rings[r][0].Y, 1, r);
+    }
+    sort(events.begin(), events.end());
+
+    vector<KeyholeBridge> bridges;
+    bridges.reserve(rings.size() - 1);
+    vector<size_t> active;
+    vector<size_t> active_pos(edges.size());
+    for (const auto &[y, kind, idx] : events) {
+        if (kind == 0) {
+            active_pos[idx] = active.size();
+            active.push_back(idx);
+
+        } else if (kind == 2) {
+            size_t last = active.back();
+            active[active_pos[idx]] = last;
+            active_pos[last] = active_pos[idx];
+            active.pop_back();
+
+        } else {
+            const IntPoint &p = rings[idx][0];
+            const KeyholeEdge *best = nullptr;
+            double best_x = 0;
+
+            for (size_t e : active) {
+                const KeyholeEdge &edge = edges[e];
+                if (edge.ring == idx || !before(edge.ring, idx)) {
+                    continue;
+                }
+
+                const Path &ring = rings[edge.ring];
+                const IntPoint &a = ring[edge.index], &b = ring[(edge.index + 1) % ring.size()];
+                double x = a.X + (double)(p.Y - a.Y) * (b.X - a.X) / (b.Y - a.Y);
+                if (x <= p.X && (!best || x > best_x)) {
+                    best = &edge;
+                    best_x = x;
+                }
+            }
+
+            if (!best) {
+                return false;
+            }
+
+            const Path &ring = rings[best->ring];
+            size_t edge = best->index, next = (edge + 1) % ring.size();
+            IntPoint at;
+            if (ring[edge].Y == p.Y) {
+                at = ring[edge];
+
+            } else if (ring[next].Y == p.Y) {
+                /* Cuts that end on a vertex belong to the edge that starts there */
+                edge = next;
+                at = ring[next];
+
+            } else {
+                /* Round towards the hole so the new vertex stays inside the filled area. */
+                at = {min((cInt)ceil(best_x), p.X), p.Y};
+            }
+
+            double dx = (double)(at.X - ring[edge].X), dy = (double)(at.Y - ring[edge].Y);
+            bridges.push_back({idx, best->ring, edge, dx*dx + dy*dy, at});
+        }
+    }
+
+    /* Walk the tree of rings, descending into each hole where its bridge sits along the parent's edge. */
+    sort(bridges.begin(), bridges.end());
+    vector<size_t> first_bridge(rings.size() + 1, bridges.size());
+    for (size_t i=bridges.size(); i>0; i--) {
+        first_bridge[bridges[i-1].ring] = i-1;
+    }
+
+    size_t total = rings.size() * 2;
+    for (const auto &ring : rings) {
+        total += ring.size() + 2;
+    }
+    out.clear();
+    out.reserve(total);
+    auto emit = [&out](const IntPoint &p) {
+        if (out.empty() || out.back() != p) {
+            out.push_back(p);
+        }
+    };
+
+    vector<KeyholeFrame> stack = {{0, 0, first_bridge[0], {}}};
+    emit(rings[0][0]);
+    while (!stack.empty()) {
+        KeyholeFrame &f = stack.back();
+        const Path &ring = rings[f.ring];
+
+        if (f.edge == ring.size()) {
+            IntPoint back_to = f.back_to;
+            bool is_hole = f.ring != 0;
+            stack.pop_back();
+            if (is_hole) {
+                emit(back_to);
+            }
+            continue;
+        }
+
+        if (f.bridge < bridges.size() && bridges[f.bridge].ring == f.ring && bridges[f.bridge].edge == f.edge) {
+            const KeyholeBridge &br = bridges[f.bridge];
+            f.bridge++;
+            emit(br.at);
+            emit(rings[br.hole][0]);
+            stack.push_back({br.hole, 0, first_bridge[br.hole], br.at});
+            continue;
+        }
+
+        /* Holes end on their start vertex, where their bridge leaves again. */
+        if (f.edge + 1 < ring.size() || f.ring != 0) {
+            emit(ring[(f.edge + 1) % ring.size()]);
+        }
+        f.edge++;
+    }
+
+    if (out.size() > 1 && out.front() == out.back()) {
+        out.pop_back();
+    }
+    return true;
+}
+
+static void dehole_polytree_worker(PolyNode &ptree, Paths &out, queue<gerbolyze::GeomTree> &todo) {
     for (int i=0; i<ptree.ChildCount(); i++) {
         PolyNode *nod = ptree.Childs[i];
         assert(nod);
@@ -113,33 +330,36 @@ static void dehole_polytree_worker(PolyNode &ptree, Paths &out, queue<PolyTree>
 
         } else {
             /* Do not add children's children, those were handled in the recursive call above */
-            Clipper c;
-            c.AddPath(nod->Contour, ptSubject, /* closed= */ true);
+            Paths subject = {nod->Contour};
             for (int k=0; k<nod->ChildCount(); k++) {
-                c.AddPath(nod->Childs[k]->Contour, ptSubject, /* closed= */ true);
+                subject.push_back(nod->Childs[k]->Contour);
+            }
+
+            Paths holes(subject.begin() + 1, subject.end());
+            if (gerbolyze::keyhole_polygon(nod->Contour, holes, out.emplace_back())) {
+                continue;
             }
+            out.pop_back();
 
-            /* Find a viable cut: Cut from top-left bounding box corner, through two subsequent points on the hole
+            /* We only get here for polygons that are not strictly simple. Split these the slow way. Find a viable cut: Cut from top-left bounding box corner, through two subsequent points on the hole
              * outline and to top-right bbox corner. */
-            IntRect bbox = c.GetBounds();
-            Path tri = { { bbox.left, bbox.top }, nod->Childs[0]->Contour[0], nod->Childs[0]->Contour[1], { bbox.right, bbox.top } };
-            c.AddPath(tri, ptClip, true);
+            IntRect bbox = gerbolyze::get_paths_bounds(subject);
+            Paths tri = {{ { bbox.left, bbox.top }, nod->Childs[0]->Contour[0], nod->Childs[0]->Contour[1], { bbox.right, bbox.top } }};
 
-            c.StrictlySimple(true);
             /* Execute twice, once for intersection fragment and once for difference fragment. Note that this will yield
              * at least two, but possibly more polygons. */
-            c.Execute(ctDifference, todo.emplace(), pftNonZero);
-            c.Execute(ctIntersection, todo.emplace(), pftNonZero);
+            gerbolyze::geometry_backend().boolean_op(ctDifference, subject, tri, todo.emplace());
+            gerbolyze::geometry_backend().boolean_op(ctIntersection, subject, tri, todo.emplace());
         }
     }
 }
 
 /* Take a Clipper polytree, i.e. a description of a set of polygons, their holes and their inner polygons, and remove
- * all holes from it. We remove holes by splitting each polygon that has a hole into two or more pieces so that the hole
- * is no more. These pieces perfectly fit each other so there is no visual or functional difference.
+ * all holes from it. We remove holes by cutting each hole into its polygon's outline with a zero-width cut-in (see
+ * keyhole_polygon above). Inner polygons inside holes come out as separate polygons.
  */
 void gerbolyze::dehole_polytree(PolyTree &ptree, Paths &out) {
-    queue<PolyTree> todo;
+    queue<GeomTree> todo;
     dehole_polytree_worker(ptree, out, todo);
     while (!todo.empty()) {
         dehole_polytree_worker(todo.front(), out, todo);
@@ -147,3 +367,181 @@ void gerbolyze::dehole_polytree(PolyTree &ptree, Paths &out) {
     }
 }
 
+/* true -> paths consist of a single axis-aligned rectangle. bounds_out is set to its bounds. */
+bool gerbolyze::paths_are_rect(const Paths &paths, IntRect &bounds_out) {
+    if (paths.size() != 1 || paths[0].size() != 4) {
+        return false;
+    }
+
+    const Path &p = paths[0];
+    IntRect r = get_paths_bounds(paths);
+    if (r.left == r.right || r.top == r.bottom) {
+        return false;
+    }
+
+    int corners = 0;
+    for (size_t i=0; i<4; i++) {
+        const IntPoint &a = p[i], &b = p[(i+1) % 4];
+        if ((a.X != r.left && a.X != r.right) || (a.Y != r.top && a.Y != r.bottom)) {
+            return false;
+        }
+        /* Each edge must run along exactly one axis */
+        if ((a.X == b.X) == (a.Y == b.Y)) {
+            return false;
+        }
+        corners |= 1 << ((a.X == r.right) * 2 + (a.Y == r.bottom));
+    }
+
+    if (corners != 0xf) {
+        return false;
+    }
+
+    bounds_out = r;
+    return true;
+}
+
+bool gerbolyze::rect_contains(const IntRect &outer, const IntRect &inner) {
+    return inner.left >= outer.left && inner.right <= outer.right
+        && inner.top >= outer.top && inner.bottom <= outer.bottom;
+}
+
+bool gerbolyze::rects_disjoint(const IntRect &a, const IntRect &b) {
+    return a.right < b.left || b.right < a.left || a.bottom < b.top || b.bottom < a.top;
+}
+
+void gerbolyze::rect_extend(IntRect &rect, const IntRect &other) {
+    if (other.left > other.right) {
+        return;
+    }
+
+    if (rect.left > rect.right) {
+        rect = other;
+        return;
+    }
+
+    rect.left = min(rect.left, other.left);
+    rect.top = min(rect.top, other.top);
+    rect.right = max(rect.right, other.right);
+    rect.bottom = max(rect.bottom, other.bottom);
+}
+
+/* true -> path is a convex, non-self-intersecting polygon. Collinear points are fine. */
+bool gerbolyze::path_is_convex(const Path &path) {
+    size_t n = path.size();
+    if (n < 3) {
+        return false;
+    }
+
+    int sign = 0;
+    int x_flips = 0, y_flips = 0;
+    int last_dx = 0, last_dy = 0;
+    for (size_t i=0; i<n; i++) {
+        const IntPoint &a = path[i], &b = path[(i+1) % n], &c = path[(i+2) % n];
+        double cross = (double)(b.X - a.X) * (double)(c.Y - b.Y) - (double)(b.Y - a.Y) * (double)(c.X - b.X);
+        if (cross != 0) {
+            int s = cross > 0 ? 1 : -1;
+            if (sign && s != sign) {
+                return false;
+            }
+            sign = s;
+        }
+
+        /* A convex polygon's edges reverse direction exactly twice in x and y each. Without this check, we would
+         * accept self-intersecting stars whose turns all go in the same direction. */
+        int dx = (b.X > a.X) - (b.X < a.X), dy = (b.Y > a.Y) - (b.Y < a.Y);
+        if (dx) {
+            x_flips += last_dx && dx != last_dx;
+            last_dx = dx;
+        }
+        if (dy) {
+            y_flips += last_dy && dy != last_dy;
+            last_dy = dy;
+        }
+    }
+
+    return sign != 0 && x_flips <= 2 && y_flips <= 2;
+}
+
+/* Sutherland-Hodgman clipping of a convex polygon against an axis-aligned rectangle. For convex input the result is
+ * exact apart from rounding of the new vertices. For concave input, it would produce degenerate zero-width edges along
+ * the rectangle's border, so don't use it for that. */
+void gerbolyze::clip_convex_path_to_rect(const Path &in, const IntRect &rect, Path &out) {
+    Path tmp(in);
+
+    /* axis: 0 -> x, 1 -> y. dir: +1 -> keep points >= limit, -1 -> keep points <= limit */
+    auto clip_edge = [](const Path &src, Path &dst, int axis, cInt limit, int dir) {
+        dst.clear();
+        size_t n = src.size();
+        for (size_t i=0; i<n; i++) {
+            const IntPoint &a = src[i], &b = src[(i+1) % n];
+            cInt va = axis ? a.Y : a.X, vb = axis ? b.Y : b.X;
+            bool in_a = dir > 0 ? va >= limit : va <= limit;
+            bool in_b = dir > 0 ? vb >= limit : vb <= limit;
+
+            if (in_a) {
+                dst.push_back(a);
+            }
+
+            if (in_a != in_b) {
+                double t = (double)(limit - va) / (double)(vb - va);
+                if (axis) {
+                    dst.push_back({(cInt)llround(a.X + t * (b.X - a.X)), limit});
+                } else {
+                    dst.push_back({limit, (cInt)llround(a.Y + t * (b.Y - a.Y))});
+                }
+            }
+        }
+    };
+
+    clip_edge(tmp, out, 0, rect.left, 1);
+    clip_edge(out, tmp, 0, rect.right, -1);
+    clip_edge(tmp, out, 1, rect.top, 1);
+    clip_edge(out, tmp, 1, rect.bottom, -1);
+
+    /* Remove duplicate points where the polygon touched a corner or edge of the rectangle */
+    out.clear();
+    for (const auto &p : tmp) {
+        if (out.empty() || !(p == out.back())) {
+            out.push_back(p);
+        }
+    }
+    while (out.size() > 1 && out.front() == out.back()) {
+        out.pop_back();
+    }
+}
+
+/* Intersect a single simple polygon with a clip, like a clipper intersection with nonzero fill rules would. When the
+ * clip is an axis-aligned rectangle (clip_rect is set), this avoids clipper in most cases. Like clipper, we output
+ * outer polygons in positive orientation and drop degenerate ones. */
+void gerbolyze::intersect_simple_path(const Path &subject, const Paths &clip, const IntRect *clip_rect, Paths &out) {
+    if (clip_rect && !clip.empty()) {
+        IntRect bounds = get_paths_bounds(Paths {subject});
+
+        if (rects_disjoint(*clip_rect, bounds)) {
+            return;
+        }
+
+        Path clipped;
+        bool fast = false;
+        if (rect_contains(*clip_rect, bounds)) {
+            clipped = subject;
+            fast = true;
+
+        } else if (path_is_convex(subject)) {
+            clip_convex_path_to_rect(subject, *clip_rect, clipped);
+            fast = true;
+        }
+
+        if (fast) {
+            if (clipped.size() >= 3 && Area(clipped) != 0) {
+                if (!Orientation(clipped)) {
+                    ReversePath(clipped);
+                }
+                out.push_back(std::move(clipped));
+            }
+            return;
+        }
+    }
+
+    geometry_backend().boolean_op(ctIntersection, {subject}, clip, out);
+}
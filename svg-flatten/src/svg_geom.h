@@ -28,7 +28,19 @@ namespace gerbolyze {
     enum ClipperLib::EndType clipper_end_type(const pugi::xml_node &node);
     enum ClipperLib::JoinType clipper_join_type(const pugi::xml_node &node);
     void dehole_polytree(ClipperLib::PolyTree &ptree, ClipperLib::Paths &out);
+    bool keyhole_polygon(const ClipperLib::Path &outer, const ClipperLib::Paths &holes, ClipperLib::Path &out);
     void combine_clip_paths(ClipperLib::Paths &in_a, ClipperLib::Paths &in_b, ClipperLib::Paths &out);
 
+    /* Fast paths for the common case of clipping against an axis-aligned rectangle such as the viewport */
+    bool paths_are_rect(const ClipperLib::Paths &paths, ClipperLib::IntRect &bounds_out);
+    bool rect_contains(const ClipperLib::IntRect &outer, const ClipperLib::IntRect &inner);
+    bool rects_disjoint(const ClipperLib::IntRect &a, const ClipperLib::IntRect &b);
+    /* Grow rect to also cover other. Either may be empty, i.e. have left > right. */
+    void rect_extend(ClipperLib::IntRect &rect, const ClipperLib::IntRect &other);
+    bool path_is_convex(const ClipperLib::Path &path);
+    void clip_convex_path_to_rect(const ClipperLib::Path &in, const ClipperLib::IntRect &rect, ClipperLib::Path &out);
+    void intersect_simple_path(const ClipperLib::Path &subject, const ClipperLib::Paths &clip,
+            const ClipperLib::IntRect *clip_rect, ClipperLib::Paths &out);
+
 } /* namespace gerbolyze */
 
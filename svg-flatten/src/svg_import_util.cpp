@@ -49,20 +49,23 @@ gerbolyze::RelativeUnits gerbolyze::map_str_to_units(string str, gerbolyze::Rela
     return default_val;
 }
 
-/* Cf. https://tools.ietf.org/html/rfc2397 */
-string gerbolyze::parse_data_iri(const string &data_url) {
-    if (data_url.rfind("data:", 0) == string::npos) /* check if url starts with "data:" */
+/* Cf. https://tools.ietf.org/html/rfc2397
+ *
+ * This takes the raw attribute value since embedded images can be huge. We only copy out the base64 payload. */
+string gerbolyze::parse_data_iri(const char *data_url) {
+    if (strncmp(data_url, "data:", 5)) /* check if url starts with "data:" */
         return string();
 
-    size_t foo = data_url.find("base64,");
-    if (foo == string::npos) /* check if this is actually a data URL */
+    const char *foo = strstr(data_url, "base64,");
+    if (!foo) /* check if this is actually a data URL */
         return string();
 
-    size_t b64_begin = data_url.find_first_not_of(" ", foo + strlen("base64,"));
-    assert(b64_begin != string::npos);
+    const char *b64_begin = foo + strlen("base64,");
+    while (*b64_begin == ' ')
+        b64_begin++;
 
     bool err_out;
-    string out = base64_decode(data_url.substr(b64_begin), false, &err_out);
+    string out = base64_decode(string(b64_begin), false, &err_out);
 
     if (err_out)
       return "";
@@ -27,7 +27,6 @@
 #include <string>
 #include <iostream>
 #include <sstream>
-#include <regex>
 
 #include <clipper.hpp>
 
@@ -47,7 +46,7 @@ enum RelativeUnits {
 double usvg_double_attr(const pugi::xml_node &node, const char *attr, double default_value=0.0);
 std::string usvg_id_url(std::string attr);
 RelativeUnits map_str_to_units(std::string str, RelativeUnits default_val=SVG_UnknownUnits);
-std::string parse_data_iri(const std::string &data_url);
+std::string parse_data_iri(const char *data_url);
 
 } /* namespace gerbolyze */
 
@@ -21,117 +21,170 @@
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <cstring>
 
 #include "svg_import_defs.h"
 #include "svg_path.h"
 #include "flatten.hpp"
+#include "scan_util.h"
 
 using namespace std;
+using namespace gerbolyze;
 
-static pair<bool, bool> flatten_path(gerbolyze::xform2d &mat, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::Clipper &c_fill, const pugi::char_t *path_data, double distance_tolerance_mm) {
-    istringstream in(path_data);
+static inline ClipperLib::IntPoint to_clipper(const gerbolyze::d2p &p) {
+    return {
+        (ClipperLib::cInt)round(p[0]*clipper_scale),
+        (ClipperLib::cInt)round(p[1]*clipper_scale)
+    };
+}
+
+/* Read one coordinate pair and transform it into physical coordinates */
+static inline bool scan_point(const char *&p, const char *end, gerbolyze::xform2d &mat, gerbolyze::d2p &out) {
+    p = gerbolyze::scan_skip_sep(p, end);
+    if (!gerbolyze::scan_double(p, end, out[0])) {
+        return false;
+    }
+    p = gerbolyze::scan_skip_sep(p, end);
+    if (!gerbolyze::scan_double(p, end, out[1])) {
+        return false;
+    }
+    out = mat.doc2phys(out);
+    return true;
+}
+
+/* Parse usvg's path data. usvg normalizes all paths to absolute M, L, C and Z commands with explicit command letters,
+ * so this is a simple hand-written scanner over the attribute value instead of a full SVG path grammar. Text-heavy
+ * documents contain millions of these commands, so we avoid allocating anything per command.
+ *
+ * We need to transform all points ourselves here, and cannot use the transform feature of cairo_to_clipper: Our
+ * transform may contain offsets, and clipper only passes its data into cairo's transform functions after scaling up to
+ * its internal fixed-point ints, but it does not scale the transform accordingly. This means a scale/rotation we set
+ * before calling clipper works out fine, but translations get lost as they get scaled by something like 1e-6.
+ */
+pair<bool, bool> gerbolyze::flatten_path(xform2d &mat, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::Paths &fill, const pugi::char_t *path_data, double distance_tolerance_mm, bool fast_curves) {
+    const char *p = path_data;
+    const char *end = p + strlen(p);
 
-    string cmd;
-    gerbolyze::d2p a, b, c, d;
+    d2p a {0, 0}, b, c, d;
 
     ClipperLib::Path in_poly;
+    in_poly.reserve(64);
+    gerbolyze::CurveFlattener flattener(distance_tolerance_mm, fast_curves);
+
+    /* Hand off the current subpath without copying it, and start the next one with room for as many points. */
+    auto finish_subpath = [&in_poly](ClipperLib::Paths &out) {
+        size_t capacity = in_poly.size();
+        out.push_back(std::move(in_poly));
+        in_poly = ClipperLib::Path();
+        in_poly.reserve(capacity);
+    };
 
     bool first = true;
     bool has_closed = false;
     int num_subpaths = 0;
-    while (!in.eof()) {
-        in >> cmd;
-        assert (!in.fail());
-        assert(!first || cmd == "M");
-        
-        if (cmd == "Z") { /* Close path */
-            stroke_closed.push_back(in_poly);
-            c_fill.AddPath(in_poly, ClipperLib::ptSubject, true);
+    while ((p = scan_skip_sep(p, end)) < end) {
+        char cmd = *p++;
+        if (first && cmd != 'M') {
+            cerr << "Warning: Path data does not start with a move command" << endl;
+            break;
+        }
+
+        if (cmd == 'Z') { /* Close path */
+            fill.push_back(in_poly);
+            finish_subpath(stroke_closed);
 
             has_closed = true;
-            in_poly.clear();
             num_subpaths += 1;
 
-        } else if (cmd == "M") { /* Move to */
+        } else if (cmd == 'M') { /* Move to */
             if (!first && !in_poly.empty()) {
-                stroke_open.push_back(in_poly);
-                c_fill.AddPath(in_poly, ClipperLib::ptSubject, true);
+                fill.push_back(in_poly);
+                finish_subpath(stroke_open);
                 num_subpaths += 1;
-                in_poly.clear();
             }
 
-            in >> a[0] >> a[1];
-            assert (!in.fail()); /* guaranteed by usvg */
-
-            /* We need to transform all points ourselves here, and cannot use the transform feature of cairo_to_clipper:
-             * Our transform may contain offsets, and clipper only passes its data into cairo's transform functions
-             * after scaling up to its internal fixed-point ints, but it does not scale the transform accordingly. This
-             * means a scale/rotation we set before calling clipper works out fine, but translations get lost as they
-             * get scaled by something like 1e-6.
-             */
-            a = mat.doc2phys(a);
-
-            in_poly.emplace_back(ClipperLib::IntPoint{
-                    (ClipperLib::cInt)round(a[0]*clipper_scale),
-                    (ClipperLib::cInt)round(a[1]*clipper_scale)
-            });
-
-        } else if (cmd == "L") { /* Line to */
-            in >> a[0] >> a[1];
-            assert (!in.fail()); /* guaranteed by usvg */
-
-            a = mat.doc2phys(a);
-            in_poly.emplace_back(ClipperLib::IntPoint{
-                    (ClipperLib::cInt)round(a[0]*clipper_scale),
-                    (ClipperLib::cInt)round(a[1]*clipper_scale)
-            });
-
-        } else { /* Curve to */
-            assert(cmd == "C"); /* guaranteed by usvg */
-            in >> b[0] >> b[1]; /* first control point */
-            in >> c[0] >> c[1]; /* second control point */
-            in >> d[0] >> d[1]; /* end point */
-            assert (!in.fail()); /* guaranteed by usvg */
-
-            b = mat.doc2phys(b);
-            c = mat.doc2phys(c);
-            d = mat.doc2phys(d);
-
-            gerbolyze::curve4_div c4div(distance_tolerance_mm);
-            c4div.run(a[0], a[1], b[0], b[1], c[0], c[1], d[0], d[1]);
-
-            for (auto &pt : c4div.points()) {
-                in_poly.emplace_back(ClipperLib::IntPoint{
-                        (ClipperLib::cInt)round(pt[0]*clipper_scale),
-                        (ClipperLib::cInt)round(pt[1]*clipper_scale)
-                });
+            if (!scan_point(p, end, mat, a)) {
+                break;
+            }
+            in_poly.push_back(to_clipper(a));
+
+        } else if (cmd == 'L') { /* Line to */
+            if (!scan_point(p, end, mat, a)) {
+                break;
             }
+            in_poly.push_back(to_clipper(a));
 
+        } else if (cmd == 'C') { /* Curve to */
+            if (!scan_point(p, end, mat, b) /* first control point */
+                    || !scan_point(p, end, mat, c) /* second control point */
+                    || !scan_point(p, end, mat, d)) { /* end point */
+                break;
+            }
+
+            flattener.run(a, b, c, d, in_poly);
             a = d; /* set last point to curve end point */
+
+        } else {
+            cerr << "Warning: Unexpected command '" << cmd << "' in path data. Was this file processed by usvg?" << endl;
+            break;
         }
 
         first = false;
     }
 
+    if (p < end) {
+        cerr << "Warning: Error parsing path data at offset " << (p - path_data) << endl;
+    }
+
     if (!in_poly.empty()) {
-        stroke_open.push_back(in_poly);
-        c_fill.AddPath(in_poly, ClipperLib::ptSubject, true);
+        fill.push_back(in_poly);
+        finish_subpath(stroke_open);
         num_subpaths += 1;
     }
 
     return {has_closed, num_subpaths > 1};
 }
 
-void gerbolyze::load_svg_path(xform2d &mat, const pugi::xml_node &node, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::PolyTree &ptree_fill, double curve_tolerance) {
+bool gerbolyze::path_data_bounds(xform2d &mat, const pugi::char_t *path_data, ClipperLib::IntRect &out) {
+    const char *p = path_data;
+    const char *end = p + strlen(p);
+
+    bool first = true;
+    d2p a;
+    while ((p = scan_skip_sep(p, end)) < end) {
+        if (*p == 'M' || *p == 'L' || *p == 'C' || *p == 'Z') {
+            p++;
+            continue;
+        }
+
+        if (!scan_point(p, end, mat, a)) {
+            break;
+        }
+
+        ClipperLib::IntPoint pt = to_clipper(a);
+        if (first) {
+            out = {pt.X, pt.Y, pt.X, pt.Y};
+            first = false;
+        } else {
+            out.left = min(out.left, pt.X);
+            out.top = min(out.top, pt.Y);
+            out.right = max(out.right, pt.X);
+            out.bottom = max(out.bottom, pt.Y);
+        }
+    }
+
+    return !first;
+}
+
+void gerbolyze::load_svg_path(xform2d &mat, const pugi::xml_node &node, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, GeomTree &ptree_fill, double curve_tolerance, bool fast_curves) {
     auto *path_data = node.attribute("d").value();
     auto fill_rule = clipper_fill_rule(node);
 
     /* For open paths, clipper does not correctly remove self-intersections. Thus, we pass everything into
      * clipper twice: Once with all paths set to "closed" to compute fill areas, and once with correct
      * open/closed properties for stroke offsetting. */
-    ClipperLib::Clipper c_fill;
-    c_fill.StrictlySimple(true);
-    auto res = flatten_path(mat, stroke_open, stroke_closed, c_fill, path_data, curve_tolerance);
+    ClipperLib::Paths fill;
+    auto res = flatten_path(mat, stroke_open, stroke_closed, fill, path_data, curve_tolerance, fast_curves);
     bool has_closed = res.first, has_multiple = res.second;
 
     if (!has_closed && !has_multiple) {
@@ -144,21 +197,20 @@ void gerbolyze::load_svg_path(xform2d &mat, const pugi::xml_node &node, ClipperL
          * It seems that when the input paths are all perfectly colinear and horizontal, so that the resulting bounding box
          * has zero height, clipper doesn't output anything. At least for open input paths.
          *
-         * Since there is no way to get paths out of a Clipper once they're Add'ed, we work around this by just doing an
-         * intersection with a maximum-size rectangle instead, that seems to work.
+         * We work around this by just doing an intersection with a maximum-size rectangle instead, that seems to work.
+         * Clipper2 accepts coordinates up to a quarter of the int64 range, which is half of clipper's hiRange.
          *
          * TODO: Fix clipper instead.
          */
-        auto le_min = -ClipperLib::loRange;
-        auto le_max = ClipperLib::hiRange;
-        ClipperLib::Path p = {{le_min, le_min}, {le_max, le_min}, {le_max, le_max}, {le_min, le_max}};
+        auto le_min = -ClipperLib::hiRange / 2;
+        auto le_max = ClipperLib::hiRange / 2;
+        ClipperLib::Paths p = {{{le_min, le_min}, {le_max, le_min}, {le_max, le_max}, {le_min, le_max}}};
 
-        c_fill.AddPath(p, ClipperLib::ptClip, /* closed= */ true);
-        c_fill.Execute(ClipperLib::ctIntersection, ptree_fill, fill_rule, ClipperLib::pftNonZero);
+        geometry_backend().boolean_op(ClipperLib::ctIntersection, fill, p, ptree_fill, fill_rule);
 
     } else {
         /* We cannot clip the polygon here since that would produce incorrect results for our stroke. */
-        c_fill.Execute(ClipperLib::ctUnion, ptree_fill, fill_rule, ClipperLib::pftNonZero);
+        geometry_backend().boolean_op(ClipperLib::ctUnion, fill, {}, ptree_fill, fill_rule);
     }
 }
 
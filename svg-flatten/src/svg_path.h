@@ -19,11 +19,18 @@
 #pragma once
 
 #include <vector>
+#include <utility>
 #include "svg_geom.h"
+#include "geom_backend.h"
 #include "geom2d.hpp"
 
 namespace gerbolyze {
-void load_svg_path(xform2d &mat, const pugi::xml_node &node, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::PolyTree &ptree_fill, double curve_tolerance);
+/* Flatten usvg path data into clipper paths. Returns {has closed subpaths, has multiple subpaths}. */
+std::pair<bool, bool> flatten_path(xform2d &mat, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::Paths &fill, const pugi::char_t *path_data, double distance_tolerance_mm, bool fast_curves=false);
+/* Bounding box of the points and control points of usvg path data in physical coordinates. Curves stay within the hull
+ * of their control points, so this contains the flattened path. Returns false if there are no points. */
+bool path_data_bounds(xform2d &mat, const pugi::char_t *path_data, ClipperLib::IntRect &out);
+void load_svg_path(xform2d &mat, const pugi::xml_node &node, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, GeomTree &ptree_fill, double curve_tolerance, bool fast_curves=false);
 void parse_dasharray(const pugi::xml_node &node, std::vector<double> &out);
 void dash_path(const ClipperLib::Path &in, ClipperLib::Paths &out, const std::vector<double> dasharray, double dash_offset=0.0);
 }
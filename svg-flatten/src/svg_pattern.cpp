@@ -17,14 +17,28 @@
  */
 
 #include <assert.h>
+#include <climits>
+#include <algorithm>
 #include "svg_import_util.h"
 #include "svg_pattern.h"
 #include "svg_import_defs.h"
 #include "svg_geom.h"
+#include "geom_backend.h"
 #include <gerbolyze.hpp>
 
 using namespace std;
 
+namespace gerbolyze {
+    /* One pattern tile's content, rendered with the tile transform mat. */
+    struct PatternContent {
+        d2p origin; /* mat's translation */
+        vector<pair<Polygon, GerberPolarityToken>> polys;
+        ClipperLib::Paths paths; /* polys at clipper scale */
+        vector<ClipperLib::IntRect> bounds; /* bounds of each path */
+        ClipperLib::IntRect total_bounds;
+    };
+}
+
 gerbolyze::Pattern::Pattern(const pugi::xml_node &node, SVGDocument &doc) : m_node(node), doc(&doc) {
     /* Read pattern attributes from SVG node */
     x = usvg_double_attr(node, "x");
@@ -51,6 +65,324 @@ gerbolyze::Pattern::Pattern(const pugi::xml_node &node, SVGDocument &doc) : m_no
     patternContentUnits = map_str_to_units(node.attribute("patternContentUnits").value(), SVG_UserSpaceOnUse);
 }
 
+gerbolyze::Pattern::Pattern() {}
+
+gerbolyze::Pattern::~Pattern() {}
+
+void gerbolyze::Pattern::clear_cache() {
+#ifndef WASI
+    lock_guard<mutex> lock(m_content_mutex);
+#endif
+    m_content_cache.clear();
+}
+
+/* Render the pattern's content for the tile in elem_ctx, or fetch it from the cache if we already rendered it for a tile
+ * that only differs from this one by a translation. */
+const gerbolyze::PatternContent &gerbolyze::Pattern::content(RenderContext &elem_ctx) {
+    array<double, 6> coeffs = elem_ctx.mat().coefficients();
+    array<double, 4> key {coeffs[0], coeffs[1], coeffs[2], coeffs[3]};
+
+#ifndef WASI
+    lock_guard<mutex> lock(m_content_mutex);
+#endif
+    unique_ptr<PatternContent> &entry = m_content_cache[key];
+    if (entry) {
+        return *entry;
+    }
+
+    entry = make_unique<PatternContent>();
+    entry->origin = {coeffs[4], coeffs[5]};
+    PatternContent &c = *entry;
+
+    /* Render without apertures, and clipped only to a huge rectangle so that nothing goes missing. We clip each tile
+     * to its actual clip below. An empty clip would not do, since images would not render at all then. */
+    LambdaPolygonSink list_sink([&c](const Polygon &poly, GerberPolarityToken pol) {
+            if (poly.size() < 3) {
+                return;
+            }
+
+            c.polys.emplace_back(pair<Polygon, GerberPolarityToken>{poly, pol});
+            ClipperLib::Path &path = c.paths.emplace_back(poly.size());
+            for (size_t i=0; i<poly.size(); i++) {
+                path[i] = {(ClipperLib::cInt)round(poly[i][0] * clipper_scale),
+                    (ClipperLib::cInt)round(poly[i][1] * clipper_scale)};
+            }
+            c.bounds.push_back(get_paths_bounds({path}));
+        });
+    auto le_min = -ClipperLib::hiRange / 4;
+    auto le_max = ClipperLib::hiRange / 4;
+    ClipperLib::Paths no_clip = {{{le_min, le_min}, {le_max, le_min}, {le_max, le_max}, {le_min, le_max}}};
+    RenderContext content_ctx(elem_ctx, list_sink, no_clip);
+    doc->export_svg_group(content_ctx, m_node);
+
+    if (!c.paths.empty()) {
+        c.total_bounds = get_paths_bounds(c.paths);
+    }
+    return c;
+}
+
+namespace {
+
+using namespace gerbolyze;
+
+/* Classifies areas of the document against a clip as inside, outside or crossing the clip's border. For rectangular
+ * clips, this is just a bounds check. For all other clips, we rasterize the clip once onto the grid of pattern tiles:
+ * Every grid cell that a clip edge passes through is a boundary cell. For the remaining cells, a scanline through the
+ * row's centers tells us whether they are inside or outside. After that, prefix sums let us classify any rectangle of
+ * cells in constant time.
+ *
+ * The grid lives in pattern coordinates, with cell (i, j) covering [x0 + i*w, x0 + (i+1)*w] x [y0 + j*h, ...]. Areas
+ * of the document are mapped into the grid through their bounding box, so results are conservative: Anything that is
+ * not certainly inside or outside comes out as boundary. When there are more tiles than we want to spend memory on,
+ * each cell covers a block of several tiles. This only makes the blocks along the clip's border coarser. */
+class ClipGrid {
+public:
+    enum Class { OUTSIDE, INSIDE, BOUNDARY };
+
+    ClipGrid(RenderContext &ctx, const xform2d &pat2doc, double x0, double y0, double w, double h, int nx, int ny);
+
+    /* Classify a rectangle in document coordinates at clipper scale */
+    Class classify(const ClipperLib::IntRect &bounds);
+
+private:
+    Class cells(int i0, int j0, int i1, int j1) const;
+    int window_sum(const vector<int> &sums, int i0, int j0, int i1, int j1) const {
+        return sums[(j1+1)*(m_nx+1) + i1+1] - sums[j0*(m_nx+1) + i1+1] - sums[(j1+1)*(m_nx+1) + i0] + sums[j0*(m_nx+1) + i0];
+    }
+
+    /* Grid cells we are willing to allocate, at about 9 bytes each. Beyond this, we merge tiles into larger cells. */
+    static constexpr long long max_cells = 1<<20;
+    /* Cells are compared in floating point, be generous about what counts as touching. */
+    static constexpr double eps = 1e-9;
+
+    ClipperLib::IntRect m_bounds;
+    const ClipperLib::IntRect *m_rect;
+    bool m_valid = false;
+    bool m_clip_inside_grid = true;
+    xform2d m_doc2pat;
+    double m_x0, m_y0, m_w, m_h;
+    int m_nx, m_ny;
+    vector<int> m_inside_sums, m_outside_sums; /* 2D prefix sums over cell classes */
+};
+
+static int clamp_floor(double v, int lo, int hi) {
+    if (!(v >= lo)) /* also catches NaN */
+        return lo;
+    if (v >= hi)
+        return hi;
+    return (int)floor(v);
+}
+
+ClipGrid::ClipGrid(RenderContext &ctx, const xform2d &pat2doc, double x0, double y0, double w, double h, int nx, int ny)
+    : m_bounds(ctx.clip_bounds()), m_rect(ctx.clip_rect()), m_doc2pat(pat2doc),
+      m_x0(x0), m_y0(y0), m_w(w), m_h(h), m_nx(nx), m_ny(ny) {
+
+    bool invert_success = false;
+    m_doc2pat.invert(&invert_success);
+    if (m_rect || !invert_success || nx <= 0 || ny <= 0) {
+        return;
+    }
+    m_valid = true;
+
+    if ((long long)nx * ny > max_cells) {
+        long long f = (long long)ceil(sqrt((double)nx * ny / max_cells));
+        while (((nx + f - 1) / f) * ((ny + f - 1) / f) > max_cells) {
+            f++;
+        }
+        w *= f;
+        h *= f;
+        nx = m_nx = (int)((nx + f - 1) / f);
+        ny = m_ny = (int)((ny + f - 1) / f);
+        m_w = w;
+        m_h = h;
+    }
+
+    /* Boundary cells */
+    vector<uint8_t> cls(nx * ny, OUTSIDE);
+    vector<vector<pair<double, int>>> crossings(ny); /* per row: (u, winding direction) */
+
+    for (const auto &path : ctx.clip()) {
+        vector<d2p> uv(path.size());
+        for (size_t k=0; k<path.size(); k++) {
+            d2p p = m_doc2pat.doc2phys(d2p{path[k].X / clipper_scale, path[k].Y / clipper_scale});
+            uv[k] = {(p[0] - x0) / w, (p[1] - y0) / h};
+            if (!(uv[k][0] >= 0 && uv[k][0] <= nx && uv[k][1] >= 0 && uv[k][1] <= ny)) {
+                m_clip_inside_grid = false;
+            }
+        }
+
+        for (size_t k=0; k<uv.size(); k++) {
+            const d2p &a = uv[k], &b = uv[(k+1) % uv.size()];
+            double vmin = fmin(a[1], b[1]), vmax = fmax(a[1], b[1]);
+            double dv = b[1] - a[1];
+
+            /* Mark every cell the edge touches, one row at a time */
+            int j0 = clamp_floor(vmin - eps, 0, ny-1), j1 = clamp_floor(vmax + eps, 0, ny-1);
+            bool on_grid = vmax > -eps && vmin < ny + eps && fmax(a[0], b[0]) > -eps && fmin(a[0], b[0]) < nx + eps;
+            for (int j=j0; on_grid && j<=j1; j++) {
+                double ua = a[0], ub = b[0];
+                if (fabs(dv) > eps) {
+                    double ta = fmax(0.0, fmin(1.0, (j - eps - a[1]) / dv));
+                    double tb = fmax(0.0, fmin(1.0, (j + 1 + eps - a[1]) / dv));
+                    ua = a[0] + ta * (b[0] - a[0]);
+                    ub = a[0] + tb * (b[0] - a[0]);
+                }
+                if (fmax(ua, ub) < -eps || fmin(ua, ub) > nx + eps) {
+                    continue;
+                }
+                int i0 = clamp_floor(fmin(ua, ub) - eps, 0, nx-1), i1 = clamp_floor(fmax(ua, ub) + eps, 0, nx-1);
+                for (int i=i0; i<=i1; i++) {
+                    cls[j*nx + i] = BOUNDARY;
+                }
+            }
+
+            /* Record where the edge crosses the scanlines through the row centers */
+            int c0 = (int)fmax(0.0, fmin(ny, ceil(vmin - 0.5)));
+            int c1 = (int)fmax(-1.0, fmin(ny - 1, ceil(vmax - 0.5) - 1));
+            for (int j=c0; j<=c1; j++) {
+                double v = j + 0.5;
+                crossings[j].emplace_back(a[0] + (v - a[1]) * (b[0] - a[0]) / dv, dv > 0 ? 1 : -1);
+            }
+        }
+    }
+
+    /* Cells no edge passes through are entirely on one side of the clip. Clipper's output is normalized for the
+     * nonzero fill rule. */
+    for (int j=0; j<ny; j++) {
+        auto &row = crossings[j];
+        sort(row.begin(), row.end());
+        size_t k = 0;
+        int winding = 0;
+        for (int i=0; i<nx; i++) {
+            while (k < row.size() && row[k].first < i + 0.5) {
+                winding += row[k++].second;
+            }
+            if (cls[j*nx + i] != BOUNDARY) {
+                cls[j*nx + i] = winding ? INSIDE : OUTSIDE;
+            }
+        }
+    }
+
+    m_inside_sums.resize((nx+1) * (ny+1), 0);
+    m_outside_sums.resize((nx+1) * (ny+1), 0);
+    for (int j=0; j<ny; j++) {
+        for (int i=0; i<nx; i++) {
+            size_t idx = (j+1)*(nx+1) + i+1;
+            size_t up = j*(nx+1) + i+1, left = (j+1)*(nx+1) + i, diag = j*(nx+1) + i;
+            m_inside_sums[idx] = m_inside_sums[up] + m_inside_sums[left] - m_inside_sums[diag] + (cls[j*nx + i] == INSIDE);
+            m_outside_sums[idx] = m_outside_sums[up] + m_outside_sums[left] - m_outside_sums[diag] + (cls[j*nx + i] == OUTSIDE);
+        }
+    }
+}
+
+ClipGrid::Class ClipGrid::cells(int i0, int j0, int i1, int j1) const {
+    /* Cells off the grid are outside if the whole clip is on the grid, and unknown otherwise. */
+    bool off_grid = i0 < 0 || j0 < 0 || i1 >= m_nx || j1 >= m_ny;
+    if (off_grid && !m_clip_inside_grid) {
+        return BOUNDARY;
+    }
+
+    i0 = max(i0, 0); j0 = max(j0, 0);
+    i1 = min(i1, m_nx-1); j1 = min(j1, m_ny-1);
+    if (i0 > i1 || j0 > j1) {
+        return OUTSIDE;
+    }
+
+    int total = (i1 - i0 + 1) * (j1 - j0 + 1);
+    if (!off_grid && window_sum(m_inside_sums, i0, j0, i1, j1) == total) {
+        return INSIDE;
+    }
+    if (window_sum(m_outside_sums, i0, j0, i1, j1) == total) {
+        return OUTSIDE;
+    }
+    return BOUNDARY;
+}
+
+ClipGrid::Class ClipGrid::classify(const ClipperLib::IntRect &bounds) {
+    if (rects_disjoint(m_bounds, bounds)) {
+        return OUTSIDE;
+    }
+
+    if (m_rect) {
+        return rect_contains(*m_rect, bounds) ? INSIDE : BOUNDARY;
+    }
+
+    if (!m_valid) {
+        return BOUNDARY;
+    }
+
+    double umin = INFINITY, umax = -INFINITY, vmin = INFINITY, vmax = -INFINITY;
+    for (auto [x, y] : {pair{bounds.left, bounds.top}, pair{bounds.right, bounds.top},
+            pair{bounds.right, bounds.bottom}, pair{bounds.left, bounds.bottom}}) {
+        d2p p = m_doc2pat.doc2phys(d2p{x / clipper_scale, y / clipper_scale});
+        double u = (p[0] - m_x0) / m_w, v = (p[1] - m_y0) / m_h;
+        umin = fmin(umin, u); umax = fmax(umax, u);
+        vmin = fmin(vmin, v); vmax = fmax(vmax, v);
+    }
+
+    /* Keep the cell indices in int range, anything beyond the grid is treated alike anyway. */
+    return cells(clamp_floor(umin - eps, -1, m_nx), clamp_floor(vmin - eps, -1, m_ny),
+            clamp_floor(umax + eps, -1, m_nx), clamp_floor(vmax + eps, -1, m_ny));
+}
+
+} /* anonymous namespace */
+
+/* Emit one tile of pattern content. The tile's transform differs from the one the content was rendered with only by
+ * a translation. Most tiles lie entirely inside or entirely outside of the clip, so we only run clipper on the few
+ * polygons that actually cross its border. */
+static void emit_tile(gerbolyze::RenderContext &elem_ctx, const gerbolyze::PatternContent &c, ClipGrid &grid) {
+    using namespace gerbolyze;
+
+    if (c.paths.empty()) {
+        return;
+    }
+
+    d2p origin = elem_ctx.mat().doc2phys(d2p{0, 0});
+    double dx = origin[0] - c.origin[0], dy = origin[1] - c.origin[1];
+    ClipperLib::cInt idx = (ClipperLib::cInt)round(dx * clipper_scale), idy = (ClipperLib::cInt)round(dy * clipper_scale);
+    auto translate = [idx, idy](const ClipperLib::IntRect &r) {
+        return ClipperLib::IntRect {r.left + idx, r.top + idy, r.right + idx, r.bottom + idy};
+    };
+
+    ClipGrid::Class tile_class = grid.classify(translate(c.total_bounds));
+    if (tile_class == ClipGrid::OUTSIDE) {
+        return;
+    }
+
+    const ClipperLib::IntRect *clip_rect = elem_ctx.clip_rect();
+    for (size_t i=0; i<c.polys.size(); i++) {
+        const auto &[poly, pol] = c.polys[i];
+
+        if (tile_class == ClipGrid::BOUNDARY) {
+            ClipGrid::Class poly_class = grid.classify(translate(c.bounds[i]));
+            if (poly_class == ClipGrid::OUTSIDE) {
+                continue;
+            }
+
+            if (poly_class == ClipGrid::BOUNDARY) {
+                ClipperLib::Path path(c.paths[i]);
+                for (auto &p : path) {
+                    p.X += idx;
+                    p.Y += idy;
+                }
+
+                ClipperLib::Paths out;
+                if (clip_rect && path_is_convex(path)) {
+                    intersect_simple_path(path, elem_ctx.clip(), clip_rect, out);
+                } else {
+                    GeomTree ptree;
+                    geometry_backend().boolean_op(ClipperLib::ctIntersection, {path}, elem_ctx.clip(), ptree);
+                    dehole_polytree(ptree, out);
+                }
+                elem_ctx.sink() << pol << ApertureToken() << out;
+                continue;
+            }
+        }
+
+        elem_ctx.sink() << pol << ApertureToken() << PolygonView(poly).translated({dx, dy});
+    }
+}
+
 /* Tile pattern into gerber. Note that this function may be called several times in case the pattern is
  * referenced from multiple places, so we must not clobber any of the object's state. */
 void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
@@ -63,7 +395,7 @@ void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
     double inst_w = ctx.mat().doc2phys_dist(w);
     double inst_h = ctx.mat().doc2phys_dist(h);
 
-    ClipperLib::IntRect clip_bounds = get_paths_bounds(ctx.clip());
+    ClipperLib::IntRect clip_bounds = ctx.clip_bounds();
     double bx = clip_bounds.left / clipper_scale;
     double by = clip_bounds.top / clipper_scale;
     double bw = (clip_bounds.right - clip_bounds.left) / clipper_scale;
@@ -98,14 +430,30 @@ void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
         pat_ctx.sink() << PatternToken(out);
     }
 
-    /* Iterate over all pattern tiles in pattern coordinates */
-    for (double inst_off_x = fmod(inst_x, inst_w) - 2*inst_w;
-            inst_off_x < bx + bw + 2*inst_w;
-            inst_off_x += inst_w) {
+    /* In outline mode, pattern content may contain strokes and drills that we have to pass through as apertures. */
+    bool use_cache = !ctx.settings().use_apertures_for_patterns && !ctx.settings().outline_mode && !ctx.clip().empty();
+
+    if (!(inst_w > 0 && inst_h > 0)) {
+        return;
+    }
+
+    /* Pattern tiles in pattern coordinates */
+    double start_x = fmod(inst_x, inst_w) - 2*inst_w;
+    double start_y = fmod(inst_y, inst_h) - 2*inst_h;
+    int nx = (int)fmax(0.0, fmin(INT_MAX, ceil((bx + bw + 2*inst_w - start_x) / inst_w)));
+    int ny = (int)fmax(0.0, fmin(INT_MAX, ceil((by + bh + 2*inst_h - start_y) / inst_h)));
+
+    /* Classify tiles against the clip up front, so we only do any actual clipping for tiles on the clip's border. */
+    unique_ptr<ClipGrid> grid;
+    if (!ctx.clip().empty() && (use_cache || ctx.settings().pattern_complete_tiles_only)) {
+        grid = make_unique<ClipGrid>(ctx, pat_ctx.mat(), start_x, start_y, inst_w, inst_h, nx, ny);
+    }
 
-        for (double inst_off_y = fmod(inst_y, inst_h) - 2*inst_h;
-                inst_off_y < by + bh + 2*inst_h;
-                inst_off_y += inst_h) {
+    for (int i=0; i<nx; i++) {
+        double inst_off_x = start_x + i*inst_w;
+
+        for (int j=0; j<ny; j++) {
+            double inst_off_y = start_y + j*inst_h;
 
             xform2d elem_xf;
             /* Change into this individual tile's coordinate system */
@@ -121,8 +469,6 @@ void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
             RenderContext elem_ctx(pat_ctx, elem_xf);
 
             if (ctx.settings().pattern_complete_tiles_only) {
-                ClipperLib::Clipper c;
-
                 double eps = 1e-6;
                 Polygon poly = {{eps, eps}, {inst_w-eps, eps}, {inst_w-eps, inst_h-eps}, {eps, inst_h-eps}};
                 elem_ctx.mat().transform_polygon(poly);
@@ -132,19 +478,33 @@ void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
                     path[i] = {x, y};
                 }
 
-                ClipperLib::Paths out;
-                c.StrictlySimple(true);
-                c.AddPath(path, ClipperLib::ptSubject, /* closed */ true);
-                c.AddPaths(elem_ctx.clip(), ClipperLib::ptClip, /* closed */ true);
-                c.Execute(ClipperLib::ctDifference, out, ClipperLib::pftNonZero);
-                if (out.size() > 0) {
+                /* The tile is convex, so against a rectangular clip it is complete iff all its corners are inside. */
+                ClipGrid::Class tile_class = grid ? grid->classify(get_paths_bounds({path})) : ClipGrid::BOUNDARY;
+                if (tile_class == ClipGrid::OUTSIDE) {
                     continue;
+
+                } else if (tile_class == ClipGrid::INSIDE) {
+                    /* complete */
+
+                } else if (const ClipperLib::IntRect *rect = elem_ctx.clip_rect()) {
+                    if (!rect_contains(*rect, get_paths_bounds({path}))) {
+                        continue;
+                    }
+
+                } else {
+                    ClipperLib::Paths out;
+                    geometry_backend().boolean_op(ClipperLib::ctDifference, {path}, elem_ctx.clip(), out);
+                    if (out.size() > 0) {
+                        continue;
+                    }
                 }
             }
 
             if (ctx.settings().use_apertures_for_patterns) {
                 /* use inst_h offset to compensate for gerber <-> svg "y" coordinate spaces */
                 elem_ctx.sink() << FlashToken(elem_ctx.mat().doc2phys({0, inst_h}));
+            } else if (use_cache) {
+                emit_tile(elem_ctx, content(elem_ctx), *grid);
             } else {
                 doc->export_svg_group(elem_ctx, m_node);
             }
@@ -19,6 +19,12 @@
 #pragma once
 
 #include <string>
+#include <map>
+#include <array>
+#include <memory>
+#ifndef WASI
+#include <mutex>
+#endif
 
 #include <pugixml.hpp>
 #include <clipper.hpp>
@@ -31,15 +37,22 @@ namespace gerbolyze {
 class SVGDocument;
 class RenderSettings;
 class RenderContext;
+struct PatternContent;
 
 class Pattern {
 public:
-    Pattern() {}
+    Pattern();
     Pattern(const pugi::xml_node &node, SVGDocument &doc);
+    ~Pattern();
 
     void tile (RenderContext &ctx);
+    /* Drop cached pattern content. The cache depends on the render settings, so this has to be called before every
+     * render. */
+    void clear_cache();
 
 private:
+    const PatternContent &content(RenderContext &elem_ctx);
+
     double x, y, w, h;
     double vb_x, vb_y, vb_w, vb_h;
     bool has_vb;
@@ -49,6 +62,14 @@ private:
     enum RelativeUnits patternContentUnits;
     const pugi::xml_node m_node;
     SVGDocument *doc = nullptr;
+
+    /* Rendered pattern content, keyed by the linear part of the tile transform. All tiles of one tile() call and
+     * usually all uses of a pattern share the same linear part, so we only render the content once and translate it
+     * into place for each tile. */
+    std::map<std::array<double, 4>, std::unique_ptr<PatternContent>> m_content_cache;
+#ifndef WASI
+    std::mutex m_content_mutex; /* tile() may run on several ParallelRenderer threads at once */
+#endif
 };
 
 } /* namespace gerbolyze */
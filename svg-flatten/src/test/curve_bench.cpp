@@ -0,0 +1,165 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmark for the bezier flatteners in flatten.cpp.
+ *
+ * Usage: curve-bench [num_curves] [tolerance_mm] [iterations]
+ *
+ * Compares the AGG curve4_div port (one per curve, like the old path parser used it) against CurveFlattener's
+ * subdivision and forward differencing modes. Most curves are glyph-sized, some span a good part of a board. The
+ * subdivision mode must produce exactly the same points as curve4_div. For each mode, this prints the throughput, the
+ * number of output points and the largest distance between the curve and its flattened polyline.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "flatten.hpp"
+
+using namespace std;
+using namespace gerbolyze;
+
+struct Curve {
+    d2p p1, p2, p3, p4;
+};
+
+static void generate_curves(vector<Curve> &out, int num_curves) {
+    srand(0);
+    auto rnd = [](double scale) { return scale * rand() / RAND_MAX; };
+
+    for (int i=0; i<num_curves; i++) {
+        double size = (i % 50 == 0) ? 100.0 : 3.0; /* mm */
+        double x0 = rnd(200), y0 = rnd(200);
+        out.push_back({
+                {x0 + rnd(size), y0 + rnd(size)},
+                {x0 + rnd(size), y0 + rnd(size)},
+                {x0 + rnd(size), y0 + rnd(size)},
+                {x0 + rnd(size), y0 + rnd(size)}});
+    }
+}
+
+static ClipperLib::IntPoint to_clipper(const d2p &p) {
+    return {(ClipperLib::cInt)round(p[0]*clipper_scale), (ClipperLib::cInt)round(p[1]*clipper_scale)};
+}
+
+static void flatten_agg(const Curve &c, double tolerance, ClipperLib::Path &out) {
+    curve4_div c4div(tolerance);
+    c4div.run(c.p1[0], c.p1[1], c.p2[0], c.p2[1], c.p3[0], c.p3[1], c.p4[0], c.p4[1]);
+    /* Skip the start point like CurveFlattener does */
+    for (size_t i=1; i<c4div.points().size(); i++) {
+        out.push_back(to_clipper(c4div.points()[i]));
+    }
+}
+
+static d2p eval_curve(const Curve &c, double t) {
+    double u = 1-t;
+    double w1 = u*u*u, w2 = 3*u*u*t, w3 = 3*u*t*t, w4 = t*t*t;
+    return {w1*c.p1[0] + w2*c.p2[0] + w3*c.p3[0] + w4*c.p4[0], w1*c.p1[1] + w2*c.p2[1] + w3*c.p3[1] + w4*c.p4[1]};
+}
+
+static double point_segment_distance(const d2p &p, const d2p &a, const d2p &b) {
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+    double len_sq = dx*dx + dy*dy;
+    double t = len_sq > 0 ? ((p[0] - a[0])*dx + (p[1] - a[1])*dy) / len_sq : 0;
+    t = fmax(0, fmin(1, t));
+    return hypot(p[0] - (a[0] + t*dx), p[1] - (a[1] + t*dy));
+}
+
+/* Sample the curve and find the largest distance of any sample from the polyline. */
+static double max_error(const Curve &c, const ClipperLib::Path &path) {
+    vector<d2p> poly = {c.p1};
+    for (const auto &ip : path) {
+        poly.push_back({ip.X / clipper_scale, ip.Y / clipper_scale});
+    }
+
+    double err = 0;
+    for (int i=0; i<=256; i++) {
+        d2p p = eval_curve(c, i / 256.0);
+        double dist = INFINITY;
+        for (size_t j=1; j<poly.size(); j++) {
+            dist = fmin(dist, point_segment_distance(p, poly[j-1], poly[j]));
+        }
+        err = fmax(err, dist);
+    }
+    return err;
+}
+
+template<typename F>
+static void run(const char *name, F fun, const vector<Curve> &curves, int iterations) {
+    ClipperLib::Path path;
+    size_t num_points = 0;
+
+    auto t_start = chrono::steady_clock::now();
+    for (int i=0; i<iterations; i++) {
+        for (const auto &c : curves) {
+            path.clear();
+            fun(c, path);
+            num_points += path.size();
+        }
+    }
+    double t = chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count();
+
+    double err = 0;
+    for (size_t i=0; i<curves.size() && i<2000; i++) {
+        path.clear();
+        fun(curves[i], path);
+        err = fmax(err, max_error(curves[i], path));
+    }
+
+    fprintf(stderr, "%-16s %8.1f ms %8.2f Mpoints/s %10zu points/iteration  max error %.4f mm\n",
+            name, t, num_points / t / 1e3, num_points / iterations, err);
+}
+
+int main(int argc, char **argv) {
+    int num_curves = argc > 1 ? atoi(argv[1]) : 200000;
+    double tolerance = argc > 2 ? atof(argv[2]) : 0.01;
+    int iterations = argc > 3 ? atoi(argv[3]) : 5;
+
+    vector<Curve> curves;
+    generate_curves(curves, num_curves);
+    cerr << num_curves << " curves, tolerance " << tolerance << " mm, " << iterations << " iterations" << endl;
+
+    CurveFlattener subdiv(tolerance);
+    CurveFlattener fast(tolerance, /* fast */ true);
+
+    for (const auto &c : curves) {
+        ClipperLib::Path a, b;
+        flatten_agg(c, tolerance, a);
+        subdiv.run(c.p1, c.p2, c.p3, c.p4, b);
+        if (a != b) {
+            cerr << "Output mismatch between curve4_div and CurveFlattener" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    run("curve4_div", [tolerance](const Curve &c, ClipperLib::Path &out) {
+            flatten_agg(c, tolerance, out);
+        }, curves, iterations);
+    run("subdivision", [&subdiv](const Curve &c, ClipperLib::Path &out) {
+            subdiv.run(c.p1, c.p2, c.p3, c.p4, out);
+        }, curves, iterations);
+    run("wang/fwd diff", [&fast](const Curve &c, ClipperLib::Path &out) {
+            fast.run(c.p1, c.p2, c.p3, c.p4, out);
+        }, curves, iterations);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark for the flattening engines in out_flattener.cpp, one of which sexp output always goes through.
+ *
+ * Usage: flatten-bench [-n iterations] [-v vectorizer] [image.png...]
+ *
+ * Vectorizes each input image (by default with binary-contours, which on a photo gives lots of nested dark and clear
+ * contours) into a list of polygons once, then times running that list through a Flattener and a SweepFlattener.
+ * Without input images, this uses a synthetic list of small dark and clear squares with a few large dark ones in
+ * between, and testdata/svg/rect_occlusion.svg tiled up to 100k rectangles. For each input and engine, this prints the
+ * number of dark and clear input polygons, the time and the number and total area of output polygons. Flattener does
+ * not merge overlapping dark polygons, so its total area is larger than SweepFlattener's, whose output polygons never
+ * overlap, wherever they overlap.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include <string>
+
+#include <gerbolyze.hpp>
+
+using namespace std;
+using namespace gerbolyze;
+
+typedef vector<pair<Polygon, GerberPolarityToken>> PolygonList;
+
+static void generate_polygons(PolygonList &out, int num_polys) {
+    srand(0);
+    auto rnd = [](double scale) { return scale * rand() / RAND_MAX; };
+
+    for (int i=0; i<num_polys; i++) {
+        double size = (i % 200 == 0) ? 60.0 : 0.5 + rnd(2.0); /* mm */
+        double x = rnd(100) - 5, y = rnd(100) - 5;
+        out.emplace_back(Polygon {{x, y}, {x+size, y}, {x+size, y+size}, {x, y+size}},
+                (rand() % 3 == 0) ? GRB_POL_CLEAR : GRB_POL_DARK);
+    }
+}
+
+/* The rectangles of testdata/svg/rect_occlusion.svg in drawing order, minus its white background, repeated on a grid
+ * that is slightly denser than the original 50mm document so that neighboring copies overlap. */
+static void generate_rect_occlusion(PolygonList &out, int num_polys, d2p &size) {
+    struct { double x, y; GerberPolarityToken pol; } rects[] = {
+        {10, 15, GRB_POL_DARK},
+        {19.318335, 22.307203, GRB_POL_DARK},
+        {19.318335, 22.307203, GRB_POL_DARK},
+        {23.297699, 13.616298, GRB_POL_CLEAR},
+    };
+    constexpr double pitch = 30.0, w = 20.0, h = 15.0; /* mm */
+
+    int copies = (num_polys + 3) / 4;
+    int cols = (int)ceil(sqrt(copies));
+    size = {cols * pitch + 50.0, cols * pitch + 50.0};
+
+    for (int i=0; i<copies; i++) {
+        double x0 = (i % cols) * pitch, y0 = (i / cols) * pitch;
+        for (const auto &r : rects) {
+            double x = x0 + r.x, y = y0 + r.y;
+            out.emplace_back(Polygon {{x, y}, {x+w, y}, {x+w, y+h}, {x, y+h}}, r.pol);
+        }
+    }
+}
+
+static bool vectorize_image(const char *filename, const string &vectorizer, PolygonList &out) {
+    ifstream in(filename, ios::binary);
+    if (!in) {
+        return false;
+    }
+    string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    RasterImage img;
+    img.data = data.data();
+    img.size = data.size();
+    img.width = 100.0;
+    img.height = 100.0;
+
+    VectorizerSelectorizer vec_sel(vectorizer);
+    RenderSettings rset {
+        0.1, /* minimum feature size */
+        0.01, /* curve tolerance */
+        0.01, 0.01, 0.01,
+        vec_sel,
+    };
+
+    LambdaPolygonSink sink([&out](const Polygon &poly, GerberPolarityToken pol) {
+            out.emplace_back(poly, pol);
+        });
+    render_raster_image(rset, sink, img);
+    return !out.empty();
+}
+
+static unique_ptr<PolygonSink> make_flattener(const string &engine, PolygonSink &sink) {
+    if (engine == "sweep") {
+        return make_unique<SweepFlattener>(sink);
+    }
+    return make_unique<Flattener>(sink);
+}
+
+static void run(const char *name, const PolygonList &polys, d2p size, const string &engine, int iterations) {
+    size_t num_dark = 0, num_clear = 0;
+    for (const auto &[poly, pol] : polys) {
+        (pol == GRB_POL_DARK ? num_dark : num_clear) += 1;
+    }
+
+    size_t num_out = 0;
+    double area = 0;
+    LambdaPolygonSink sink([&num_out, &area](const Polygon &poly, GerberPolarityToken) {
+            num_out += 1;
+            double a = 0;
+            for (size_t i=0; i<poly.size(); i++) {
+                const d2p &p = poly[i], &q = poly[(i+1) % poly.size()];
+                a += p[0]*q[1] - p[1]*q[0];
+            }
+            area += 0.5 * fabs(a);
+        });
+
+    auto t_start = chrono::steady_clock::now();
+    for (int i=0; i<iterations; i++) {
+        num_out = 0;
+        area = 0;
+
+        auto flattener = make_flattener(engine, sink);
+        flattener->header({0, 0}, size);
+        for (const auto &[poly, pol] : polys) {
+            *flattener << pol << poly;
+        }
+        flattener->footer();
+    }
+    double t = chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count() / iterations;
+
+    fprintf(stderr, "%-30s %-8s %8zu dark %8zu clear %10.1f ms/iteration %8zu polygons out, area %.3f mm^2\n",
+            name, engine.c_str(), num_dark, num_clear, t, num_out, area);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 3;
+    string vectorizer = "binary-contours";
+    int argi = 1;
+    for (; argi+1 < argc; argi += 2) {
+        if (!strcmp(argv[argi], "-n")) {
+            iterations = atoi(argv[argi+1]);
+        } else if (!strcmp(argv[argi], "-v")) {
+            vectorizer = argv[argi+1];
+        } else {
+            break;
+        }
+    }
+
+    const char *engines[] = {"layered", "sweep"};
+
+    if (argi == argc) {
+        PolygonList polys;
+        generate_polygons(polys, 20000);
+        for (const char *engine : engines) {
+            run("synthetic", polys, {100, 100}, engine, iterations);
+        }
+
+        polys.clear();
+        d2p size;
+        generate_rect_occlusion(polys, 100000, size);
+        for (const char *engine : engines) {
+            run("rect_occlusion x25000", polys, size, engine, iterations);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for (; argi<argc; argi++) {
+        PolygonList polys;
+        if (!vectorize_image(argv[argi], vectorizer, polys)) {
+            cerr << "Warning: Cannot vectorize \"" << argv[argi] << "\", skipping." << endl;
+            continue;
+        }
+        for (const char *engine : engines) {
+            run(argv[argi], polys, {100, 100}, engine, iterations);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
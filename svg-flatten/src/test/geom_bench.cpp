@@ -0,0 +1,147 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark for the geometry backends in geom_backend.cpp.
+ *
+ * Usage: geom-bench [-n iterations] file.svg...
+ *
+ * Runs every input file through usvg once, then renders all of them with each geometry backend that was built in, once
+ * as-is, once through a Dilater and once through a Dilater in merge mode. Run it on testdata/svg for a rough idea, and
+ * on some real-world board art for numbers that matter. For each backend, this prints the total render time, the number
+ * of output polygons and points and the total output area. The areas should agree closely between backends. In merge
+ * mode, overlapping polygons are only counted once, so the area will be smaller there.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include <string>
+#include <unistd.h>
+
+#include <gerbolyze.hpp>
+#include "geom_backend.h"
+#include "util.h"
+
+using namespace std;
+using namespace gerbolyze;
+
+static bool load_with_usvg(const string &filename, SVGDocument &doc) {
+    string out_name = (filesystem::temp_directory_path() / "geom-bench-usvg-XXXXXX").string();
+    int out_fd = mkstemp(out_name.data());
+    if (out_fd < 0) {
+        cerr << "Error: Cannot create temporary file for usvg output: " << strerror(errno) << endl;
+        return false;
+    }
+    close(out_fd);
+
+    vector<string> command_line = {"--keep-named-groups", filename, out_name};
+    int rc = run_cargo_command("usvg", command_line, "USVG");
+    bool ok = !rc && doc.load(out_name);
+    remove(out_name.c_str());
+    return ok;
+}
+
+struct Stats {
+    size_t num_polys = 0;
+    size_t num_points = 0;
+    double area = 0;
+};
+
+static void render(SVGDocument &doc, const RenderSettings &rset, Stats &stats, const string &mode) {
+    LambdaPolygonSink sink([&stats](const Polygon &poly, GerberPolarityToken pol) {
+            stats.num_polys += 1;
+            stats.num_points += poly.size();
+
+            double area = 0;
+            for (size_t i=0; i<poly.size(); i++) {
+                const d2p &a = poly[i], &b = poly[(i+1) % poly.size()];
+                area += a[0]*b[1] - a[1]*b[0];
+            }
+            stats.area += (pol == GRB_POL_DARK ? 0.5 : -0.5) * fabs(area);
+        });
+
+    if (mode != "plain") {
+        Dilater dil(sink, 0.1, mode == "merged");
+        doc.render(rset, dil);
+    } else {
+        doc.render(rset, sink);
+    }
+}
+
+int main(int argc, char **argv) {
+    int iterations = 5;
+    int argi = 1;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        iterations = atoi(argv[2]);
+        argi = 3;
+    }
+
+    vector<unique_ptr<SVGDocument>> docs;
+    for (; argi<argc; argi++) {
+        auto doc = make_unique<SVGDocument>();
+        if (!load_with_usvg(argv[argi], *doc)) {
+            cerr << "Warning: Cannot load \"" << argv[argi] << "\" through usvg, skipping." << endl;
+            continue;
+        }
+        docs.push_back(std::move(doc));
+    }
+
+    if (docs.empty()) {
+        cerr << "Usage: " << argv[0] << " [-n iterations] file.svg..." << endl;
+        return EXIT_FAILURE;
+    }
+    cerr << docs.size() << " documents, " << iterations << " iterations" << endl;
+
+    VectorizerSelectorizer vec_sel;
+    RenderSettings rset {
+        0.1, /* minimum feature size */
+        0.01, /* curve tolerance */
+        0.01, 0.01, 0.01,
+        vec_sel,
+    };
+
+    for (const auto &name : geometry_backend_names()) {
+        set_geometry_backend(name);
+
+        for (const string mode : {"plain", "dilated", "merged"}) {
+            Stats stats;
+            auto t_start = chrono::steady_clock::now();
+            for (int i=0; i<iterations; i++) {
+                stats = Stats();
+                for (auto &doc : docs) {
+                    render(*doc, rset, stats, mode);
+                }
+            }
+            double t = chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count();
+
+            /* Stats are from the last iteration */
+            fprintf(stderr, "%-10s %-8s %10.1f ms %10zu polygons %12zu points  area %.3f mm^2\n",
+                    name.c_str(), mode.c_str(), t, stats.num_polys, stats.num_points, stats.area);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
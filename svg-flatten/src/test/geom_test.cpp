@@ -0,0 +1,263 @@
+#include <iostream>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <clipper.hpp>
+#include "svg_geom.h"
+
+#include <minunit.h>
+
+using namespace std;
+using namespace ClipperLib;
+using namespace gerbolyze;
+
+char msg[512];
+
+/* Signed area of a polygon set that was normalized by clipper, i.e. outlines positive and holes negative. */
+static double paths_area(const Paths &paths) {
+    double area = 0.0;
+    for (const auto &p : paths) {
+        area += Area(p);
+    }
+    return area;
+}
+
+/* Area of the symmetric difference of a and b, with both filled using the nonzero rule. */
+static double xor_area(const Paths &a, const Paths &b) {
+    Clipper c;
+    c.AddPaths(a, ptSubject, true);
+    c.AddPaths(b, ptClip, true);
+    Paths out;
+    c.Execute(ctXor, out, pftNonZero, pftNonZero);
+    return fabs(paths_area(out));
+}
+
+static int orientation_sign(const IntPoint &p, const IntPoint &q, const IntPoint &r) {
+    double v = (double)(q.X - p.X) * (r.Y - p.Y) - (double)(q.Y - p.Y) * (r.X - p.X);
+    return (v > 0) - (v < 0);
+}
+
+/* Edges that touch or run along each other are fine, since zero-width cut-ins do exactly that. Only proper crossings
+ * count. */
+static bool segments_cross(const IntPoint &a, const IntPoint &b, const IntPoint &c, const IntPoint &d) {
+    return orientation_sign(a, b, c) * orientation_sign(a, b, d) < 0
+        && orientation_sign(c, d, a) * orientation_sign(c, d, b) < 0;
+}
+
+static void check_no_crossings(const Path &path, const char *name) {
+    size_t n = path.size();
+    for (size_t i=0; i<n; i++) {
+        for (size_t j=i+1; j<n; j++) {
+            if (segments_cross(path[i], path[(i+1) % n], path[j], path[(j+1) % n])) {
+                snprintf(msg, sizeof(msg), "%s: Edges %zu and %zu of the result cross", name, i, j);
+                mu_fail(msg);
+            }
+        }
+    }
+}
+
+/* Cut-ins that end in the middle of a slanted edge get a vertex rounded to the integer grid, which may move that part of
+ * the edge by up to one unit. There is one cut-in per hole. */
+static double rounding_tolerance(const Paths &input) {
+    double max_len = 0.0;
+    for (const auto &p : input) {
+        for (size_t i=0; i<p.size(); i++) {
+            const IntPoint &a = p[i], &b = p[(i+1) % p.size()];
+            if (a.X != b.X && a.Y != b.Y) {
+                max_len = fmax(max_len, hypot((double)(b.X - a.X), (double)(b.Y - a.Y)));
+            }
+        }
+    }
+    return input.size() * max_len / 2.0;
+}
+
+static void check_keyhole(const Path &outer, const Paths &holes, const char *name) {
+    Path out;
+    snprintf(msg, sizeof(msg), "%s: Could not bridge all holes", name);
+    mu_assert(keyhole_polygon(outer, holes, out), msg);
+
+    Paths input = holes;
+    input.push_back(outer);
+    double tolerance = rounding_tolerance(input);
+
+    double expected_area = fabs(Area(outer));
+    for (const auto &hole : holes) {
+        expected_area -= fabs(Area(hole));
+    }
+    snprintf(msg, sizeof(msg), "%s: Area changed from %g to %g", name, expected_area, fabs(Area(out)));
+    mu_assert(fabs(fabs(Area(out)) - expected_area) <= tolerance, msg);
+
+    /* The result must fill exactly the outline minus the holes */
+    Paths expected;
+    Clipper c;
+    c.AddPath(outer, ptSubject, true);
+    c.AddPaths(holes, ptClip, true);
+    c.Execute(ctDifference, expected, pftNonZero, pftNonZero);
+    double diff = xor_area({out}, expected);
+    snprintf(msg, sizeof(msg), "%s: Result differs from input by an area of %g", name, diff);
+    mu_assert(diff <= tolerance, msg);
+
+    check_no_crossings(out, name);
+}
+
+static Path rect(cInt x0, cInt y0, cInt x1, cInt y1) {
+    return {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+}
+
+static Path diamond(cInt cx, cInt cy, cInt r) {
+    return {{cx - r, cy}, {cx, cy - r}, {cx + r, cy}, {cx, cy + r}};
+}
+
+MU_TEST(test_keyhole_single_hole) {
+    check_keyhole(rect(0, 0, 1000, 1000), {rect(300, 300, 700, 700)}, "single hole");
+}
+
+MU_TEST(test_keyhole_hole_orientation) {
+    /* Holes may come in either orientation */
+    Path hole = rect(300, 300, 700, 700);
+    ReversePath(hole);
+    check_keyhole(rect(0, 0, 1000, 1000), {hole}, "reversed hole");
+}
+
+MU_TEST(test_keyhole_many_holes) {
+    Paths holes;
+    for (int y=0; y<5; y++) {
+        for (int x=0; x<5; x++) {
+            holes.push_back(rect(100 + x*200, 100 + y*200, 200 + x*200, 200 + y*200));
+        }
+    }
+    check_keyhole(rect(0, 0, 1100, 1100), holes, "5x5 holes");
+}
+
+MU_TEST(test_keyhole_cut_ends_on_hole_vertex) {
+    /* The cut from the right hole's top left corner runs straight into the left hole's top right corner, and the
+     * diamonds' cuts run into the tips of their left neighbours. */
+    check_keyhole(rect(0, 0, 1000, 1000), {rect(100, 100, 300, 300), rect(500, 100, 700, 300)}, "aligned rects");
+    check_keyhole(rect(0, 0, 1000, 1000),
+            {diamond(200, 600, 100), diamond(450, 600, 100), diamond(700, 600, 100)}, "aligned diamonds");
+}
+
+MU_TEST(test_keyhole_cut_ends_on_outline_vertex) {
+    /* A notched outline with a vertex exactly on the hole's cut line */
+    Path outer = {{0, 0}, {1000, 0}, {1000, 1000}, {0, 1000}, {0, 600}, {200, 500}, {0, 400}};
+    check_keyhole(outer, {rect(400, 500, 600, 700)}, "notched outline");
+}
+
+MU_TEST(test_keyhole_slanted_edges) {
+    /* Cuts ending in the middle of slanted edges need a new, rounded vertex */
+    Path outer = {{0, 0}, {100000, 13700}, {61300, 100000}};
+    check_keyhole(outer, {diamond(50000, 45000, 5000), diamond(60000, 42000, 3000)}, "triangle");
+}
+
+MU_TEST(test_keyhole_random) {
+    mt19937 rng(23);
+    uniform_int_distribution<int> coord(1, 8);
+    uniform_int_distribution<int> shape(0, 3);
+
+    for (int run=0; run<200; run++) {
+        /* A coarse grid makes coincident y coordinates, and with that cuts ending on vertices, likely. We scale it up
+         * at the end so that rounding stays small compared to the holes. */
+        Paths holes;
+        for (int y=0; y<6; y++) {
+            for (int x=0; x<6; x++) {
+                cInt x0 = 10 + x*10, y0 = 10 + y*10;
+                switch (shape(rng)) {
+                    case 0:
+                        break;
+                    case 1: {
+                        int a = coord(rng), b = coord(rng), c = coord(rng), d = coord(rng);
+                        if (a == b || c == d) {
+                            break;
+                        }
+                        holes.push_back(rect(x0 + min(a, b), y0 + min(c, d), x0 + max(a, b), y0 + max(c, d)));
+                        break;
+                    }
+                    case 2:
+                        holes.push_back(diamond(x0 + 5, y0 + 5, coord(rng) % 4 + 1));
+                        break;
+                    case 3: {
+                        Path tri = {{x0 + coord(rng), y0 + coord(rng)}, {x0 + coord(rng), y0 + coord(rng)},
+                            {x0 + coord(rng), y0 + coord(rng)}};
+                        if (Area(tri) != 0) {
+                            holes.push_back(tri);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
+        /* Comb-shaped left edge with vertices on the grid lines */
+        Path outer = {{0, 0}, {80, 0}, {80, 80}, {0, 80}};
+        for (int y=7; y>0; y--) {
+            outer.push_back({(y % 2) ? 5 : 0, y*10});
+        }
+
+        for (auto &p : holes) {
+            for (auto &pt : p) {
+                pt = {pt.X * 10000, pt.Y * 10000};
+            }
+        }
+        for (auto &pt : outer) {
+            pt = {pt.X * 10000, pt.Y * 10000};
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "random run %d", run);
+        check_keyhole(outer, holes, name);
+        if (minunit_status) {
+            return;
+        }
+    }
+}
+
+MU_TEST(test_dehole_islands) {
+    /* Outline with a hole, an island in that hole, a hole in the island and another island in there */
+    Paths input = {rect(0, 0, 1000, 1000), rect(100, 100, 900, 900), rect(200, 200, 800, 800),
+        rect(300, 300, 700, 700), rect(400, 400, 600, 600), rect(920, 920, 980, 980)};
+
+    PolyTree tree;
+    Clipper c;
+    c.AddPaths(input, ptSubject, true);
+    c.Execute(ctUnion, tree, pftEvenOdd, pftEvenOdd);
+
+    Paths out;
+    dehole_polytree(tree, out);
+
+    Paths expected;
+    c.Execute(ctUnion, expected, pftEvenOdd, pftEvenOdd);
+
+    /* Deholed polygons do not overlap, so their areas simply add up */
+    double area = 0.0;
+    for (const auto &p : out) {
+        area += fabs(Area(p));
+        check_no_crossings(p, "islands");
+    }
+    snprintf(msg, sizeof(msg), "islands: Area changed from %g to %g", paths_area(expected), area);
+    mu_assert(fabs(area - paths_area(expected)) <= rounding_tolerance(input), msg);
+
+    double diff = xor_area(out, expected);
+    snprintf(msg, sizeof(msg), "islands: Result differs from input by an area of %g", diff);
+    mu_assert(diff <= rounding_tolerance(input), msg);
+}
+
+MU_TEST_SUITE(geom_suite) {
+    MU_RUN_TEST(test_keyhole_single_hole);
+    MU_RUN_TEST(test_keyhole_hole_orientation);
+    MU_RUN_TEST(test_keyhole_many_holes);
+    MU_RUN_TEST(test_keyhole_cut_ends_on_hole_vertex);
+    MU_RUN_TEST(test_keyhole_cut_ends_on_outline_vertex);
+    MU_RUN_TEST(test_keyhole_slanted_edges);
+    MU_RUN_TEST(test_keyhole_random);
+    MU_RUN_TEST(test_dehole_islands);
+};
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    MU_RUN_SUITE(geom_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
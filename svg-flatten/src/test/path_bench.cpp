@@ -0,0 +1,253 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmark for the path data parser in svg_path.cpp.
+ *
+ * Usage: path-bench [usvg_output.svg] [iterations]
+ *
+ * Without a file, this generates text-like path data similar to what usvg produces for glyph outlines: Many short
+ * closed subpaths made of lines and cubic curves. With a file, it uses the d attributes of all paths in it. Run the
+ * file through usvg first, since we only understand usvg's normalized path data.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "svg_path.h"
+#include "flatten.hpp"
+
+using namespace std;
+using namespace gerbolyze;
+
+/* The original istringstream-based parser, kept here as a reference */
+static pair<bool, bool> flatten_path_istream(xform2d &mat, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::Paths &fill, const char *path_data, double distance_tolerance_mm) {
+    istringstream in(path_data);
+
+    string cmd;
+    d2p a, b, c, d;
+
+    ClipperLib::Path in_poly;
+
+    bool first = true;
+    bool has_closed = false;
+    int num_subpaths = 0;
+    while (!in.eof()) {
+        in >> cmd;
+
+        if (cmd == "Z") {
+            stroke_closed.push_back(in_poly);
+            fill.push_back(in_poly);
+
+            has_closed = true;
+            in_poly.clear();
+            num_subpaths += 1;
+
+        } else if (cmd == "M") {
+            if (!first && !in_poly.empty()) {
+                stroke_open.push_back(in_poly);
+                fill.push_back(in_poly);
+                num_subpaths += 1;
+                in_poly.clear();
+            }
+
+            in >> a[0] >> a[1];
+            a = mat.doc2phys(a);
+            in_poly.emplace_back(ClipperLib::IntPoint{
+                    (ClipperLib::cInt)round(a[0]*clipper_scale),
+                    (ClipperLib::cInt)round(a[1]*clipper_scale)
+            });
+
+        } else if (cmd == "L") {
+            in >> a[0] >> a[1];
+            a = mat.doc2phys(a);
+            in_poly.emplace_back(ClipperLib::IntPoint{
+                    (ClipperLib::cInt)round(a[0]*clipper_scale),
+                    (ClipperLib::cInt)round(a[1]*clipper_scale)
+            });
+
+        } else {
+            in >> b[0] >> b[1];
+            in >> c[0] >> c[1];
+            in >> d[0] >> d[1];
+
+            b = mat.doc2phys(b);
+            c = mat.doc2phys(c);
+            d = mat.doc2phys(d);
+
+            curve4_div c4div(distance_tolerance_mm);
+            c4div.run(a[0], a[1], b[0], b[1], c[0], c[1], d[0], d[1]);
+
+            /* curve4_div repeats the start point, which the scanner no longer does */
+            for (size_t i=1; i<c4div.points().size(); i++) {
+                auto &pt = c4div.points()[i];
+                in_poly.emplace_back(ClipperLib::IntPoint{
+                        (ClipperLib::cInt)round(pt[0]*clipper_scale),
+                        (ClipperLib::cInt)round(pt[1]*clipper_scale)
+                });
+            }
+
+            a = d;
+        }
+
+        first = false;
+    }
+
+    if (!in_poly.empty()) {
+        stroke_open.push_back(in_poly);
+        fill.push_back(in_poly);
+        num_subpaths += 1;
+    }
+
+    return {has_closed, num_subpaths > 1};
+}
+
+/* Roughly what usvg makes of a line of text: One path per glyph, each with an outer contour and maybe a hole, made of
+ * lines and curves. */
+static void generate_glyph_paths(vector<string> &out, int num_glyphs) {
+    srand(0);
+    auto rnd = [](double scale) { return scale * rand() / RAND_MAX; };
+
+    for (int i=0; i<num_glyphs; i++) {
+        double x0 = (i % 80) * 7.3, y0 = (i / 80) * 12.1;
+        ostringstream d;
+        d.precision(8);
+
+        for (int contour=0; contour < 1 + (i % 3 == 0); contour++) {
+            d << "M " << x0 + rnd(1) << " " << y0 + rnd(1);
+            int segments = 6 + i % 9;
+            for (int j=0; j<segments; j++) {
+                if (j % 2) {
+                    d << " L " << x0 + rnd(6) << " " << y0 + rnd(10);
+                } else {
+                    d << " C " << x0 + rnd(6) << " " << y0 + rnd(10)
+                      << " " << x0 + rnd(6) << " " << y0 + rnd(10)
+                      << " " << x0 + rnd(6) << " " << y0 + rnd(10);
+                }
+            }
+            d << " Z ";
+        }
+
+        string s = d.str();
+        s.pop_back();
+        out.push_back(s);
+    }
+}
+
+/* No XML parser needed, usvg's output is regular enough. */
+static void extract_path_data(const string &svg, vector<string> &out) {
+    size_t pos = 0;
+    while ((pos = svg.find(" d=\"", pos)) != string::npos) {
+        pos += 4;
+        size_t end = svg.find('"', pos);
+        if (end == string::npos) {
+            break;
+        }
+        out.push_back(svg.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+typedef pair<bool, bool> (*parser_fun)(xform2d &, ClipperLib::Paths &, ClipperLib::Paths &, ClipperLib::Paths &,
+        const char *, double);
+
+static pair<bool, bool> flatten_path_scanner(xform2d &mat, ClipperLib::Paths &stroke_open, ClipperLib::Paths &stroke_closed, ClipperLib::Paths &fill, const char *path_data, double distance_tolerance_mm) {
+    return flatten_path(mat, stroke_open, stroke_closed, fill, path_data, distance_tolerance_mm);
+}
+
+static double run(parser_fun fun, const vector<string> &paths, int iterations, size_t &num_points) {
+    xform2d mat(0.26, 0, 0, 0.26, 12.0, 34.0);
+
+    auto t_start = chrono::steady_clock::now();
+    num_points = 0;
+    for (int i=0; i<iterations; i++) {
+        for (const auto &d : paths) {
+            ClipperLib::Paths stroke_open, stroke_closed, fill;
+            fun(mat, stroke_open, stroke_closed, fill, d.c_str(), 0.01);
+
+            for (const auto &p : stroke_open) {
+                num_points += p.size();
+            }
+            for (const auto &p : stroke_closed) {
+                num_points += p.size();
+            }
+        }
+    }
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t_start).count();
+}
+
+static bool check_equal(const vector<string> &paths) {
+    xform2d mat(0.26, 0, 0, 0.26, 12.0, 34.0);
+
+    for (const auto &d : paths) {
+        ClipperLib::Paths open_a, closed_a, fill_a, open_b, closed_b, fill_b;
+        auto res_a = flatten_path_scanner(mat, open_a, closed_a, fill_a, d.c_str(), 0.01);
+        auto res_b = flatten_path_istream(mat, open_b, closed_b, fill_b, d.c_str(), 0.01);
+
+        if (res_a != res_b || open_a != open_b || closed_a != closed_b || fill_a != fill_b) {
+            cerr << "Output mismatch on path data: " << d.substr(0, 80) << "..." << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    vector<string> paths;
+    size_t total_len = 0;
+
+    if (argc > 1) {
+        ifstream in(argv[1]);
+        if (!in) {
+            cerr << "Cannot open " << argv[1] << endl;
+            return EXIT_FAILURE;
+        }
+        ostringstream svg;
+        svg << in.rdbuf();
+        extract_path_data(svg.str(), paths);
+    } else {
+        generate_glyph_paths(paths, 20000);
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+    for (const auto &d : paths) {
+        total_len += d.size();
+    }
+    cerr << paths.size() << " paths, " << total_len / 1024 << " kB of path data, " << iterations << " iterations" << endl;
+
+    if (!check_equal(paths)) {
+        return EXIT_FAILURE;
+    }
+
+    size_t points_old, points_new;
+    double t_old = run(flatten_path_istream, paths, iterations, points_old);
+    double t_new = run(flatten_path_scanner, paths, iterations, points_new);
+
+    fprintf(stderr, "istringstream: %8.1f ms (%6.1f MB/s)\n", t_old, total_len * iterations / t_old / 1e3);
+    fprintf(stderr, "scanner:       %8.1f ms (%6.1f MB/s)\n", t_new, total_len * iterations / t_new / 1e3);
+    fprintf(stderr, "speedup:       %8.2fx\n", t_old / t_new);
+
+    return EXIT_SUCCESS;
+}
+
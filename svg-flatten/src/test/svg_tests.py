@@ -6,26 +6,29 @@ import unittest
 from pathlib import Path
 import subprocess
 import itertools
+import json
 import os
 import sys
 
 from PIL import Image
 import numpy as np
 
-def run_svg_flatten(input_file, output_file, *args, **kwargs):
+def find_svg_flatten():
     if 'SVG_FLATTEN' in os.environ:
         svg_flatten = os.environ.get('SVG_FLATTEN')
-        if not hasattr(run_svg_flatten, 'custom_svg_flatten_warned'):
+        if not hasattr(find_svg_flatten, 'custom_svg_flatten_warned'):
             print(f'Using svg-flatten from SVG_FLATTEN environment variable: "{svg_flatten}"', file=sys.stderr)
-            run_svg_flatten.custom_svg_flatten_warned = True
+            find_svg_flatten.custom_svg_flatten_warned = True
+        return svg_flatten
     elif (Path(__file__) / '../../build/svg-flatten').is_file():
-        svg_flatten = '../../build/svg-flatten'
+        return '../../build/svg-flatten'
     elif Path('./build/svg-flatten').is_file():
-        svg_flatten = './build/svg-flatten'
+        return './build/svg-flatten'
     else:
-        svg_flatten = 'svg-flatten'
+        return 'svg-flatten'
 
-    args = [ svg_flatten ]
+def run_svg_flatten(input_file, output_file, *args, **kwargs):
+    args = [ find_svg_flatten() ]
     for key, value in kwargs.items():
         key = '--' + key.replace("_", "-")
         args.append(key)
@@ -36,12 +39,12 @@ def run_svg_flatten(input_file, output_file, *args, **kwargs):
     args.append(str(output_file))
 
     try:
-        proc = subprocess.run(args, capture_output=True, check=True)
-    except:
+        return subprocess.run(args, capture_output=True, check=True)
+    except subprocess.CalledProcessError as e:
         print('Subprocess stdout:')
-        print(proc.stdout.decode())
+        print(e.stdout.decode())
         print('Subprocess stderr:')
-        print(proc.stderr.decode())
+        print(e.stderr.decode())
         raise
 
 def run_cargo_cmd(cmd, args, **kwargs):
@@ -213,11 +216,106 @@ class SVGRoundTripTests(unittest.TestCase):
                 e.args = (msg, *rest)
                 raise e
 
+class ParallelRenderTests(unittest.TestCase):
+    # With --jobs, paths and images are rendered on worker threads, but their output is put back into document order.
+    # The result must be exactly the same as that of a serial render.
+
+    def run_parallel_render_test(self, test_in_svg, **kwargs):
+        with tempfile.NamedTemporaryFile(suffix='.out') as tmp_serial,\
+            tempfile.NamedTemporaryFile(suffix='.out') as tmp_parallel:
+
+            run_svg_flatten(test_in_svg, tmp_serial.name, jobs='1', **kwargs)
+            run_svg_flatten(test_in_svg, tmp_parallel.name, jobs='8', **kwargs)
+
+            serial = Path(tmp_serial.name).read_bytes()
+            parallel = Path(tmp_parallel.name).read_bytes()
+            self.assertTrue(serial == parallel,
+                    f'Output with --jobs 8 differs from output with --jobs 1 ({len(parallel)} vs. {len(serial)} bytes)')
+
+class ServeBatchCacheTests(unittest.TestCase):
+    # --serve, --batch and the render cache are only different ways of running the same conversion. They must produce
+    # exactly the same output as a plain svg-flatten run.
+
+    formats = ['svg', 'gerber']
+
+    def reference_outputs(self, tmpdir):
+        refs = {}
+        for test_in_svg in sorted(Path('testdata/svg').glob('*.svg')):
+            for fmt in self.formats:
+                out = Path(tmpdir) / f'{test_in_svg.stem}-{fmt}.ref'
+                run_svg_flatten(test_in_svg, out, format=fmt)
+                refs[test_in_svg, fmt] = out.read_bytes()
+        return refs
+
+    def test_render_cache(self):
+        with tempfile.TemporaryDirectory() as tmpdir, tempfile.TemporaryDirectory() as cache_dir:
+            for (test_in_svg, fmt), ref in self.reference_outputs(tmpdir).items():
+                for run in ['miss', 'hit']:
+                    out = Path(tmpdir) / f'{test_in_svg.stem}-{fmt}.{run}'
+                    proc = run_svg_flatten(test_in_svg, out, format=fmt, cache_dir=cache_dir, cache_stats=True)
+                    expected = b'Render cache: 0 hits' if run == 'miss' else b'Render cache: 1 hits'
+                    self.assertIn(expected, proc.stderr, f'{test_in_svg.stem} ({fmt}): Unexpected cache {run}')
+                    self.assertTrue(out.read_bytes() == ref,
+                            f'{test_in_svg.stem} ({fmt}): Output on render cache {run} differs from uncached output')
+
+    def test_batch(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            refs = self.reference_outputs(tmpdir)
+
+            # The --format on the command line applies to all lines of the gerber manifest
+            for fmt in self.formats:
+                manifest = Path(tmpdir) / f'manifest-{fmt}.txt'
+                with manifest.open('w') as f:
+                    for test_in_svg, ref_fmt in refs:
+                        if ref_fmt == fmt:
+                            fmt_arg = '--format svg ' if fmt == 'svg' else ''
+                            f.write(f'{fmt_arg}"{test_in_svg}" "{tmpdir}/{test_in_svg.stem}-{fmt}.batch"\n')
+
+                cmd = [find_svg_flatten(), '--batch', str(manifest), '--jobs', '4']
+                if fmt != 'svg':
+                    cmd += ['--format', fmt]
+                subprocess.run(cmd, capture_output=True, check=True)
+
+            for (test_in_svg, fmt), ref in refs.items():
+                out = Path(tmpdir) / f'{test_in_svg.stem}-{fmt}.batch'
+                self.assertTrue(out.read_bytes() == ref,
+                        f'{test_in_svg.stem} ({fmt}): Output of --batch differs from that of a single run')
+
+    def test_serve(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            refs = self.reference_outputs(tmpdir)
+
+            # Every request twice in a row, so that the second one gets the parsed document from the server's cache
+            jobs = [key for key in refs for _ in range(2)]
+            requests = [json.dumps({'id': i, 'args': ['--format', fmt, str(test_in_svg), '-']})
+                    for i, (test_in_svg, fmt) in enumerate(jobs)]
+            proc = subprocess.run([find_svg_flatten(), '--serve'], input='\n'.join(requests).encode(),
+                    capture_output=True, check=True)
+
+            responses = [json.loads(line) for line in proc.stdout.decode().splitlines()]
+            self.assertEqual(len(responses), len(requests))
+            for i, ((test_in_svg, fmt), resp) in enumerate(zip(jobs, responses)):
+                self.assertEqual(resp['id'], i)
+                self.assertEqual(resp['status'], 'ok', f'{test_in_svg.stem} ({fmt}): {resp.get("messages")}')
+                if i % 2 == 1:
+                    self.assertTrue(resp['doc_cached'], f'{test_in_svg.stem} ({fmt}): Document was not cached')
+                self.assertTrue(resp.get('output_data', '').encode() == refs[test_in_svg, fmt],
+                        f'{test_in_svg.stem} ({fmt}): Output of --serve differs from that of a single run')
+
 for test_in_svg in Path('testdata/svg').glob('*.svg'):
     # We need to make sure we capture the loop variable's current value here.
     gen = lambda testcase: lambda self: self.run_svg_round_trip_test(testcase)
     setattr(SVGRoundTripTests, f'test_{test_in_svg.stem}', gen(test_in_svg))
 
+for test_in_svg in Path('testdata/svg').glob('*.svg'):
+    for mode, kwargs in {
+            'svg': dict(format='svg'),
+            'gerber': dict(format='gerber'),
+            'gerber_flatten': dict(format='gerber', flatten=True),
+            }.items():
+        gen = lambda testcase, kwargs: lambda self: self.run_parallel_render_test(testcase, **kwargs)
+        setattr(ParallelRenderTests, f'test_{test_in_svg.stem}_{mode}', gen(test_in_svg, kwargs))
+
 for group in ["g0", "g00", "g000", "g0000", "g00000", "g0001", "g001", "g0010", "g002", "g01", "g010", "g0100", "g011",
               "g02", "g020", "g03", "path846-59", "path846-3-2", "path846-5-2", "path846-3-3-8"]:
     gen = lambda mode, group: lambda self: self.run_svg_group_selector_test(mode, group)
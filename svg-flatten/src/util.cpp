@@ -3,17 +3,205 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <cstdio>
 
 #ifndef NOFORK
 #include <pwd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
 #include <subprocess.h>
 #endif
+#ifndef WASI
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#else
+#include <fstream>
+#endif
 #include <filesystem>
 
 #include "util.h"
 
+/* Read an entire stream into the given string. For seekable streams (regular files) this allocates the output buffer
+ * once up front instead of growing it chunk by chunk. */
+bool gerbolyze::read_stream(std::istream &in, std::string &out) {
+    out.clear();
+
+    in.seekg(0, std::ios::end);
+    auto len = in.tellg();
+    if (in && len > 0) {
+        in.seekg(0, std::ios::beg);
+        out.resize(len);
+        in.read(out.data(), len);
+        out.resize(in.gcount());
+        return !in.bad();
+    }
+
+    /* Not seekable, e.g. stdin */
+    in.clear();
+    char buf[65536];
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+        out.append(buf, in.gcount());
+    }
+    return !in.bad();
+}
+
+#ifndef WASI
+bool gerbolyze::MappedFile::open(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open \"" << filename << "\": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        std::cerr << "Cannot stat \"" << filename << "\": " << strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    /* mmap does not like empty mappings. Leave data() null and let the parser complain. */
+    if (st.st_size > 0) {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            std::cerr << "Cannot map \"" << filename << "\": " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+        m_data = static_cast<char *>(addr);
+        m_size = st.st_size;
+    }
+
+    /* The mapping keeps the file alive, so we can close it (and our caller can even delete it) right away. */
+    ::close(fd);
+    return true;
+}
+
+gerbolyze::MappedFile::~MappedFile() {
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+}
+
+#else /* WASI */
+bool gerbolyze::MappedFile::open(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in || !read_stream(in, m_buf)) {
+        std::cerr << "Cannot read \"" << filename << "\"" << std::endl;
+        return false;
+    }
+
+    m_data = m_buf.data();
+    m_size = m_buf.size();
+    return true;
+}
+
+gerbolyze::MappedFile::~MappedFile() {}
+#endif
+
 #ifndef NOFORK
-int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar) {
+static void close_proc_stdin(struct subprocess_s &subprocess) {
+    /* Close the child's stdin so it sees EOF. subprocess_destroy would otherwise close it a second time. */
+    if (subprocess.stdin_file) {
+        fclose(subprocess.stdin_file);
+        subprocess.stdin_file = nullptr;
+    }
+}
+
+/* Feed the child its stdin while reading its stdout and stderr. We have to do all three at once: If we only read one of
+ * the child's output pipes at a time, the child blocks as soon as it fills up the other one (e.g. with lots of warnings
+ * on stderr), and then we both wait on each other forever. */
+static bool pipe_data(struct subprocess_s &subprocess, const std::string *stdin_data, std::string *stdout_data) {
+    bool success = true;
+
+    FILE *proc_in = subprocess_stdin(&subprocess);
+    FILE *proc_out = subprocess_stdout(&subprocess);
+    FILE *proc_err = subprocess_stderr(&subprocess);
+
+    int in_fd = -1;
+    size_t in_pos = 0;
+    if (proc_in && stdin_data && !stdin_data->empty()) {
+        in_fd = fileno(proc_in);
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+    } else {
+        close_proc_stdin(subprocess);
+    }
+
+    if (stdout_data) {
+        stdout_data->clear();
+    }
+    int out_fd = proc_out ? fileno(proc_out) : -1;
+    int err_fd = proc_err ? fileno(proc_err) : -1;
+
+    char buf[65536];
+    while (in_fd >= 0 || out_fd >= 0 || err_fd >= 0) {
+        /* poll ignores negative fds, so finished streams just drop out */
+        struct pollfd fds[3] = {
+            {in_fd, POLLOUT, 0},
+            {out_fd, POLLIN, 0},
+            {err_fd, POLLIN, 0},
+        };
+
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error waiting for subprocess: " << strerror(errno) << std::endl;
+            success = false;
+            break;
+        }
+
+        if (in_fd >= 0 && fds[0].revents) {
+            ssize_t n = write(in_fd, stdin_data->data() + in_pos, stdin_data->size() - in_pos);
+            if (n >= 0) {
+                in_pos += n;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                /* The child may exit before reading all of its input, e.g. when the binary cannot be found. SIGPIPE is
+                 * ignored process-wide (see main()), so we get EPIPE here instead of being killed. */
+                success = false;
+            }
+
+            if (!success || in_pos == stdin_data->size()) {
+                close_proc_stdin(subprocess);
+                in_fd = -1;
+            }
+        }
+
+        for (int i=1; i<3; i++) {
+            int &fd = (i == 1) ? out_fd : err_fd;
+            if (fd < 0 || !fds[i].revents) {
+                continue;
+            }
+
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n > 0) {
+                if (i == 1) {
+                    if (stdout_data) {
+                        stdout_data->append(buf, n);
+                    }
+                } else {
+                    /* Forward anything the child printed on stderr, e.g. usvg's warnings. */
+                    std::cerr.write(buf, n);
+                }
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                fd = -1;
+            }
+        }
+    }
+
+    close_proc_stdin(subprocess);
+    return success;
+}
+
+int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar,
+        const std::string *stdin_data, std::string *stdout_data) {
 
     //std::cerr << "Running command: " << cmd_name << " ";
     std::vector<const char *> cmdline_c = {nullptr};
@@ -60,6 +248,8 @@ int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string>
             return EXIT_FAILURE;
         }
 
+        bool piped_ok = pipe_data(subprocess, stdin_data, stdout_data);
+
         proc_rc = -1;
         rc = subprocess_join(&subprocess, &proc_rc);
         if (rc) {
@@ -78,6 +268,11 @@ int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string>
             continue;
         }
         found = true;
+
+        if (!piped_ok && proc_rc == 0) {
+            std::cerr << "Error piping data through " << cmd_name << std::endl;
+            return EXIT_FAILURE;
+        }
         break;
     }
 
@@ -94,8 +289,9 @@ int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string>
     return 0;
 }
 #else
-int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar) {
-    (void) cmd_name, (void) cmdline, (void) envvar;
+int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar,
+        const std::string *stdin_data, std::string *stdout_data) {
+    (void) cmd_name, (void) cmdline, (void) envvar, (void) stdin_data, (void) stdout_data;
     std::cerr << "Error: Cannot spawn " << cmd_name << " subprocess since binary was built with fork/exec disabled (-DNOFORK=1)" << std::endl;
     return EXIT_FAILURE;
 }
@@ -20,8 +20,35 @@
 
 #include <vector>
 #include <string>
+#include <istream>
 
 namespace gerbolyze {
-int run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar);
+/* If stdin_data is given, it is piped into the command's stdin. If stdout_data is given, the command's stdout is
+ * captured into it. */
+int run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar,
+        const std::string *stdin_data=nullptr, std::string *stdout_data=nullptr);
+bool read_stream(std::istream &in, std::string &out);
+
+/* Private, writable mapping of a file for in-place parsing. Writes only touch our own copies of the affected pages and
+ * never make it back to the file. Pages that are only ever read stay shared with the page cache. Where we don't have
+ * mmap, this just reads the file into memory. */
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &filename);
+    char *data() { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    char *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef WASI
+    std::string m_buf;
+#endif
+};
 }
 
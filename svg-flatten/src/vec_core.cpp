@@ -21,11 +21,13 @@
 #include <iostream>
 #include <algorithm>
 #include <vector>
-#include <regex>
+#include <cstring>
 #include "nopencv.hpp"
 #include "svg_import_util.h"
 #include "vec_core.h"
 #include "svg_import_defs.h"
+#include "svg_geom.h"
+#include "geom_backend.h"
 #include "jc_voronoi.h"
 
 using namespace gerbolyze;
@@ -78,21 +80,33 @@ void gerbolyze::parse_img_meta(const pugi::xml_node &node, double &x, double &y,
     cerr << "image elem: w="<<width<<", h="<<height<<endl;
 }
 
-template<typename T> nopencv::Image<T> *img_from_node(const pugi::xml_node &node) {
+template<typename T> nopencv::Image<T> *img_from_raster(const RasterImage &raster) {
+    auto *img = new nopencv::Image<T>();
+    if (!img->load_memory(raster.data, raster.size)) {
+        cerr << "Warning: Could not decode content of image element with id \"" << raster.id << "\"" << endl;
+        delete img;
+        return nullptr;
+    }
+
+    return img;
+}
+
+void gerbolyze::ImageVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
     /* Read image from data:base64... URL */
     string img_data = parse_data_iri(node.attribute("xlink:href").value());
     if (img_data.empty()) {
         cerr << "Warning: Empty or invalid image element with id \"" << node.attribute("id").value() << "\"" << endl;
-        return nullptr;
+        return;
     }
 
-    auto *img = new nopencv::Image<T>();
-    if (!img->load_memory(img_data.c_str(), img_data.size())) {
-        cerr << "Warning: Could not decode content of image element with id \"" << node.attribute("id").value() << "\"" << endl;
-        return nullptr;
-    }
+    RasterImage raster;
+    raster.data = img_data.data();
+    raster.size = img_data.size();
+    parse_img_meta(node, raster.x, raster.y, raster.width, raster.height);
+    raster.preserve_aspect_ratio = node.attribute("preserveAspectRatio").value();
+    raster.id = node.attribute("id").value();
 
-    return img;
+    vectorize_raster(ctx, raster, min_feature_size_px);
 }
 
 void gerbolyze::draw_bg_rect(RenderContext &ctx, double width, double height) {
@@ -115,24 +129,12 @@ void gerbolyze::draw_bg_rect(RenderContext &ctx, double width, double height) {
     }
 
     /* Intersect the bounding box with the caller's clip path */
-    ClipperLib::Clipper c;
-    c.AddPath(rect_path, ClipperLib::ptSubject, /* closed */ true);
-    if (!ctx.clip().empty()) {
-        c.AddPaths(ctx.clip(), ClipperLib::ptClip, /* closed */ true);
-    }
-
     ClipperLib::Paths rect_out;
-    c.StrictlySimple(true);
-    c.Execute(ClipperLib::ctIntersection, rect_out, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+    intersect_simple_path(rect_path, ctx.clip(), ctx.clip_rect(), rect_out);
 
     /* draw into gerber. */
     for (const auto &poly : rect_out) {
-        vector<array<double, 2>> out;
-        for (const auto &p : poly)
-            out.push_back(std::array<double, 2>{
-                    ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                    });
-        ctx.sink() << GRB_POL_CLEAR << out;
+        ctx.sink() << GRB_POL_CLEAR << poly;
     }
 }
 
@@ -156,10 +158,9 @@ void gerbolyze::draw_bg_rect(RenderContext &ctx, double width, double height) {
  * 4. It scales each of these voronoi cell polygons to match the input images brightness at the spot covered by this
  *    cell.
  */
-void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
-    double x, y, width, height;
-    parse_img_meta(node, x, y, width, height);
-    nopencv::Image32f *img = img_from_node<float>(node);
+void gerbolyze::VoronoiVectorizer::vectorize_raster(RenderContext &ctx, const RasterImage &raster, double min_feature_size_px) {
+    double x = raster.x, y = raster.y, width = raster.width, height = raster.height;
+    nopencv::Image32f *img = img_from_raster<float>(raster);
     if (img == nullptr)
         return;
 
@@ -173,7 +174,7 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
     double scale_y = (double)height / orig_rows;
     double off_x = 0;
     double off_y = 0;
-    handle_aspect_ratio(node.attribute("preserveAspectRatio").value(),
+    handle_aspect_ratio(raster.preserve_aspect_ratio,
             scale_x, scale_y, off_x, off_y, orig_cols, orig_rows);
     //cerr << "aspect " << scale_x << ", " << scale_y << " / " << off_x << ", " << off_y << endl;
 
@@ -250,6 +251,20 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
             fill_factors[sites[i].index] = sqrt(pxd);
     }
 
+    /* For lookahead, the lowest y any of the remaining cells reaches. jcv hands us the sites sorted by y, so this lets
+     * the sink write out the blobs above as we go. */
+    vector<double> remaining_min_y;
+    if (img_ctx.lookahead()) {
+        remaining_min_y.resize(diagram.numsites + 1, scale_y * orig_rows);
+        for (int i=diagram.numsites-1; i>=0; i--) {
+            double min_y = remaining_min_y[i+1];
+            for (const jcv_graphedge *e = sites[i].edges; e; e = e->next) {
+                min_y = fmin(min_y, fmin(e->pos[0].y, e->pos[1].y));
+            }
+            remaining_min_y[i] = min_y;
+        }
+    }
+
     /* Minimum gap between adjacent scaled site polygons. */
     double min_gap_px = min_feature_size_px;
     vector<double> adjusted_fill_factors;
@@ -257,6 +272,21 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
     /* now iterate over all voronoi cells again to generate each cell's scaled polygon halftone blob. */
     //cerr << "  generating cells " << diagram.numsites << endl;
     for (int i=0; i<diagram.numsites; i++) {
+        if (!remaining_min_y.empty() && i % 1024 == 0) {
+            ClipperLib::Paths corners(1);
+            for (const d2p &p : {
+                    d2p{off_x,                      off_y + remaining_min_y[i]},
+                    d2p{off_x + scale_x*orig_cols,  off_y + remaining_min_y[i]},
+                    d2p{off_x + scale_x*orig_cols,  off_y + scale_y*orig_rows},
+                    d2p{off_x,                      off_y + scale_y*orig_rows}}) {
+                d2p q = img_ctx.mat().doc2phys(p);
+                corners[0].push_back({(ClipperLib::cInt)round(q[0] * clipper_scale), (ClipperLib::cInt)round(q[1] * clipper_scale)});
+            }
+            ClipperLib::IntRect box = get_paths_bounds(corners);
+            rect_extend(box, *img_ctx.lookahead());
+            img_ctx.send_lookahead(box);
+        }
+
         const jcv_point center = sites[i].p;
         //cerr << "  site center " << center.x << ", " << center.y << endl;
         double fill_factor_ours = fill_factors[sites[i].index];
@@ -339,22 +369,11 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
         /* Now, clip the halftone blob generated above against the given clip path. We do this individually for each
          * blob since this way is *much* faster than throwing a million blobs at once at poor clipper. */
         ClipperLib::Paths polys;
-        ClipperLib::Clipper c;
-        c.AddPath(cell_path, ClipperLib::ptSubject, /* closed */ true);
-        if (!img_ctx.clip().empty()) {
-            c.AddPaths(img_ctx.clip(), ClipperLib::ptClip, /* closed */ true);
-        }
-        c.StrictlySimple(true);
-        c.Execute(ClipperLib::ctIntersection, polys, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+        intersect_simple_path(cell_path, img_ctx.clip(), img_ctx.clip_rect(), polys);
 
         /* Export halftone blob to gerber. */
         for (const auto &poly : polys) {
-            vector<array<double, 2>> out;
-            for (const auto &p : poly)
-                out.push_back(std::array<double, 2>{
-                        ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                        });
-            img_ctx.sink() << GRB_POL_DARK << out;
+            img_ctx.sink() << GRB_POL_DARK << poly;
         }
     }
 
@@ -363,6 +382,21 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
     delete img;
 }
 
+/* Parse the "Min", "Mid" or "Max" part of a preserveAspectRatio align value into the fraction of the slack space that
+ * goes before the image. */
+static bool parse_align_keyword(const char *s, double &out) {
+    if (!strncmp(s, "Min", 3)) {
+        out = 0.0;
+    } else if (!strncmp(s, "Mid", 3)) {
+        out = 0.5;
+    } else if (!strncmp(s, "Max", 3)) {
+        out = 1.0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 void gerbolyze::handle_aspect_ratio(string spec, double &scale_x, double &scale_y, double &off_x, double &off_y, double cols, double rows) {
 
     if (spec.empty()) {
@@ -385,24 +419,14 @@ void gerbolyze::handle_aspect_ratio(string spec, double &scale_x, double &scale_
             scale = std::min(scale_x, scale_y);
         }
 
-        std::regex reg("x(Min|Mid|Max)Y(Min|Mid|Max)");
-        std::smatch match;
-
         off_x = (scale_x - scale) * cols;
         off_y = (scale_y - scale) * rows;
-        if (std::regex_match(par_align, match, reg)) {
-            assert (match.size() == 3);
-            if (match[1].str() == "Min") {
-                off_x = 0;
-            } else if (match[1].str() == "Mid") {
-                off_x *= 0.5;
-            }
-
-            if (match[2].str() == "Min") {
-                off_y = 0;
-            } else if (match[2].str() == "Mid") {
-                off_y *= 0.5;
-            }
+        double align_x, align_y;
+        if (par_align.size() == 8 && par_align[0] == 'x' && par_align[4] == 'Y'
+                && parse_align_keyword(par_align.c_str() + 1, align_x)
+                && parse_align_keyword(par_align.c_str() + 5, align_y)) {
+            off_x *= align_x;
+            off_y *= align_y;
 
         } else {
             cerr << "Invalid preserveAspectRatio meetOrSlice value \"" << par_align << "\"" << endl;
@@ -415,11 +439,10 @@ void gerbolyze::handle_aspect_ratio(string spec, double &scale_x, double &scale_
 }
 
 
-void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
+void gerbolyze::OpenCVContoursVectorizer::vectorize_raster(RenderContext &ctx, const RasterImage &raster, double min_feature_size_px) {
     (void) min_feature_size_px; /* unused by this vectorizer */
-    double x, y, width, height;
-    parse_img_meta(node, x, y, width, height);
-    nopencv::Image32 *img = img_from_node<int32_t>(node);
+    double x = raster.x, y = raster.y, width = raster.width, height = raster.height;
+    nopencv::Image32 *img = img_from_raster<int32_t>(raster);
     if (img == nullptr)
         return;
 
@@ -430,15 +453,20 @@ void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, co
     double scale_y = (double)height / (double)img->rows();
     double off_x = 0;
     double off_y = 0;
-    handle_aspect_ratio(node.attribute("preserveAspectRatio").value(),
+    handle_aspect_ratio(raster.preserve_aspect_ratio,
             scale_x, scale_y, off_x, off_y, img->cols(), img->rows());
 
     draw_bg_rect(img_ctx, width, height);
 
+    /* Pixel coordinates -> physical coordinates in one matrix so we can transform each contour in one go */
+    xform2d px_xf(img_ctx.mat());
+    px_xf.translate(off_x, off_y);
+    px_xf.scale(scale_x, scale_y);
+
     img->binarize(128);
     nopencv::find_contours(*img,
             nopencv::simplify_contours_douglas_peucker(
-                [&img_ctx, off_x, off_y, scale_x, scale_y](Polygon_i& poly, nopencv::ContourPolarity pol) {
+                [&img_ctx, &px_xf](Polygon_i& poly, nopencv::ContourPolarity pol) {
 
         if (pol == nopencv::CP_HOLE) {
             std::reverse(poly.begin(), poly.end());
@@ -449,34 +477,14 @@ void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, co
         }
 
         ClipperLib::Path out;
-        for (const auto &p : poly) {
-            d2p q = img_ctx.mat().doc2phys(d2p{
-                off_x + (double)p[0] * scale_x,
-                off_y + (double)p[1] * scale_y
-            });
-            out.push_back({
-                    (ClipperLib::cInt)round(q[0] * clipper_scale),
-                    (ClipperLib::cInt)round(q[1] * clipper_scale)
-            });
-        }
+        px_xf.transform_polygon(poly, out);
 
-        ClipperLib::Clipper c;
-        c.AddPath(out, ClipperLib::ptSubject, /* closed */ true);
-        if (!img_ctx.clip().empty()) {
-            c.AddPaths(img_ctx.clip(), ClipperLib::ptClip, /* closed */ true);
-        }
-        c.StrictlySimple(true);
         ClipperLib::Paths polys;
-        c.Execute(ClipperLib::ctIntersection, polys, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+        geometry_backend().boolean_op(ClipperLib::ctIntersection, {out}, img_ctx.clip(), polys);
 
         /* Draw into gerber. */
         for (const auto &poly : polys) {
-            vector<array<double, 2>> out;
-            for (const auto &p : poly)
-                out.push_back(std::array<double, 2>{
-                        ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                        });
-            img_ctx.sink() << out;
+            img_ctx.sink() << poly;
         }
     }));
 }
@@ -506,7 +514,10 @@ gerbolyze::VectorizerSelectorizer::VectorizerSelectorizer(const string default_v
 }
 
 ImageVectorizer *gerbolyze::VectorizerSelectorizer::select(const pugi::xml_node &img) {
-    const string id = img.attribute("id").value();
+    return select(string(img.attribute("id").value()));
+}
+
+ImageVectorizer *gerbolyze::VectorizerSelectorizer::select(const string &id) {
     // cerr << "selecting vectorizer for image \"" << id << "\"" << endl;
     if (m_map.count(id) > 0) {
         // cerr << "  -> found" << endl;
@@ -517,3 +528,35 @@ ImageVectorizer *gerbolyze::VectorizerSelectorizer::select(const pugi::xml_node
     return makeVectorizer(m_default);
 }
 
+
+void gerbolyze::render_raster_image(const RenderSettings &rset, PolygonSink &sink, const RasterImage &img) {
+    ImageVectorizer *vec = rset.m_vec_sel.select(img.id);
+    if (!vec) {
+        cerr << "Cannot resolve vectorizer for image" << endl;
+        return;
+    }
+
+    /* Clip to the image's bounding box like the viewport clip of the equivalent SVG document would. */
+    ClipperLib::Path vb_path;
+    for (const auto &p : vector<d2p> {
+            {img.x, img.y},
+            {img.x + img.width, img.y},
+            {img.x + img.width, img.y + img.height},
+            {img.x, img.y + img.height}}) {
+        vb_path.push_back({
+                (ClipperLib::cInt)round(p[0] * clipper_scale),
+                (ClipperLib::cInt)round(p[1] * clipper_scale)
+        });
+    }
+    ClipperLib::Paths vb_paths {vb_path};
+
+    ElementSelector sel;
+    RenderContext ctx(rset, sink, sel, vb_paths);
+
+    sink.header({img.x, img.y}, {img.width, img.height});
+    vec->vectorize_raster(ctx, img, rset.m_minimum_feature_size_mm);
+    sink.footer();
+
+    delete vec;
+}
+
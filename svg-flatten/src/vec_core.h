@@ -29,7 +29,7 @@ namespace gerbolyze {
     public:
         VoronoiVectorizer(grid_type grid, bool relax=true) : m_relax(relax), m_grid_type(grid) {}
 
-        virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+        virtual void vectorize_raster(RenderContext &ctx, const RasterImage &img, double min_feature_size_px);
     private:
         double m_relax;
         grid_type m_grid_type;
@@ -39,14 +39,14 @@ namespace gerbolyze {
     public:
         OpenCVContoursVectorizer() {}
 
-        virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+        virtual void vectorize_raster(RenderContext &ctx, const RasterImage &img, double min_feature_size_px);
     };
 
     class DevNullVectorizer : public ImageVectorizer {
     public:
         DevNullVectorizer() {}
 
-        virtual void vectorize_image(RenderContext &, const pugi::xml_node &, double) {}
+        virtual void vectorize_raster(RenderContext &, const RasterImage &, double) {}
     };
 
     void parse_img_meta(const pugi::xml_node &node, double &x, double &y, double &width, double &height);
@@ -36,10 +36,15 @@ sampling_fun gerbolyze::get_sampler(enum grid_type type) {
     }
 }
 
+static constexpr uint32_t poisson_disc_max_attempts = 30; /* library default */
+static constexpr uint32_t poisson_disc_seed = 0;
+
 vector<d2p> *gerbolyze::sample_poisson_disc(double w, double h, double center_distance) {
     d2p top_left {0, 0};
     d2p bottom_right {w, h};
-    return new auto(thinks::PoissonDiskSampling(center_distance/2.5, top_left, bottom_right));
+    /* Always use the same seed so that halftone output is reproducible, e.g. for the render cache. */
+    return new auto(thinks::PoissonDiskSampling(center_distance/2.5, top_left, bottom_right,
+                poisson_disc_max_attempts, poisson_disc_seed));
 }
 
 vector<d2p> *gerbolyze::sample_hexgrid(double w, double h, double center_distance) {